@@ -0,0 +1,255 @@
+/*
+ * Benchmark of a pipeline of coroutines passing batches of numbers through channels
+ *
+ * Build: cc -O2 -I.. channel.c ../coro.c ../coro_arena.c ../coro_clock.c ../coro_ctx.c ../coro_io.c ../coro_stack.c
+ *        ../dynamic_memory_management.c ../merge_sort.c ../radix_sort.c ../sort_kernel.c -o channel -lm -lpthread -lrt
+ * Usage: ./channel [-w n_workers] [-s n_sorters] [-c capacity] [n_batches]
+ *
+ * A generator fills batches of BATCH_SZ random numbers, sorters sort them and a checker verifies that they are sorted,
+ * the stages running as separate coroutines connected by channels holding capacity batches each. Batches are recycled
+ * from the checker back to the generator through one more channel, so the memory taken is bounded by the capacity of
+ * the channels whatever the number of batches. The throughput is reported against generating, sorting and checking
+ * the same batches one after another in a single coroutine.
+ */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "sort_kernel.h"
+
+enum { BATCH_SZ = 64 * 1024 };
+
+/*!
+ * Batch of numbers passed between the stages
+ */
+typedef struct {
+    elem_t elems[BATCH_SZ];
+    elem_t aux[BATCH_SZ];
+} batch;
+
+static size_t n_batches = 1000;
+static size_t n_sorters = 1;
+static size_t capacity = 4;
+
+static coro_chan free_batches;
+static coro_chan generated;
+static coro_chan sorted;
+static atomic_size_t n_sorters_running;
+static bool pipelined;
+static bool ok = true;
+
+static double now_ns();
+static bool run(bool pipeline, size_t n_workers);
+static void fill(batch *batch, unsigned *seed);
+static bool check(const batch *batch);
+static void generator(void *arg);
+static void sorter(void *arg);
+static void checker(void *arg);
+static void coroutine();
+
+signed main(signed argc, const char *argv[])
+{
+    size_t n_workers = 1;
+
+    signed opt = 0;
+    while ((opt = getopt(argc, (char *const *) argv, "c:s:w:")) != -1) {
+        switch (opt) {
+            case 'c':
+                capacity = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                n_sorters = strtoull(optarg, NULL, 10);
+                break;
+            case 'w':
+                n_workers = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc > 0) n_batches = strtoull(argv[0], NULL, 10);
+    if ((capacity == 0) || (n_sorters == 0)) return EXIT_FAILURE;
+
+    double start = now_ns();
+    if (!run(false, 1)) return EXIT_FAILURE;
+    double serial_ns = now_ns() - start;
+
+    start = now_ns();
+    if (!run(true, n_workers)) return EXIT_FAILURE;
+    double pipeline_ns = now_ns() - start;
+
+    double n_elems = (double) n_batches * BATCH_SZ;
+    printf("%zu batches of %d numbers\n", n_batches, BATCH_SZ);
+    printf("serial:   %.1lf M numbers/s\n", n_elems / serial_ns * 1e3);
+    printf("pipeline: %.1lf M numbers/s (%zu sorters, %zu workers, capacity %zu)\n",
+           n_elems / pipeline_ns * 1e3, n_sorters, n_workers, capacity);
+
+    return EXIT_SUCCESS;
+}
+
+/*!
+ * @return monotonic timestamp in nanoseconds
+ */
+double now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+}
+
+/*!
+ * Runs all the batches through the stages
+ *
+ * @param pipeline  [in] whether the stages run as separate coroutines
+ * @param n_workers [in]
+ *
+ * @return true on success, false otherwise
+ */
+bool run(bool pipeline, size_t n_workers)
+{
+    pipelined = pipeline;
+
+    if (!scheduler_setup(1, 1000, 256 * 1024)) return false;
+    scheduler_register_coro_entry_point(coroutine);
+
+    bool run_ok = scheduler_run_workers(n_workers) && ok;
+    scheduler_cleanup();
+
+    return run_ok;
+}
+
+/*!
+ * Fills a batch with random numbers
+ *
+ * @param batch [out]
+ * @param seed  [in, out]
+ */
+void fill(batch *batch, unsigned *seed)
+{
+    for (size_t i = 0; i < BATCH_SZ; ++i) {
+        batch->elems[i] = (elem_t) (rand_r(seed) - RAND_MAX / 2);
+    }
+}
+
+/*!
+ * @param batch [in]
+ *
+ * @return whether the batch is sorted
+ */
+bool check(const batch *batch)
+{
+    for (size_t i = 1; i < BATCH_SZ; ++i) {
+        if (elem_less(batch->elems[i], batch->elems[i - 1])) return false;
+    }
+
+    return true;
+}
+
+/*!
+ * Fills the free batches and sends them to the sorters
+ *
+ * @param arg [in] unused
+ */
+void generator(void *arg)
+{
+    unsigned seed = 1;
+    batch *batch = NULL;
+
+    for (size_t i = 0; i < n_batches; ++i) {
+        if (!coro_chan_recv(&free_batches, &batch)) coro_error();
+        fill(batch, &seed);
+        if (!coro_chan_send(&generated, &batch)) coro_error();
+    }
+
+    coro_chan_close(&generated);
+}
+
+/*!
+ * Sorts the batches generated and sends them to the checker, the last sorter to finish closes the checker's channel
+ *
+ * @param arg [in] unused
+ */
+void sorter(void *arg)
+{
+    batch *batch = NULL;
+
+    while (coro_chan_recv(&generated, &batch)) {
+        sort_array_with_coroutines(batch->elems, batch->aux, BATCH_SZ);
+        if (!coro_chan_send(&sorted, &batch)) coro_error();
+    }
+
+    if (atomic_fetch_sub(&n_sorters_running, 1) == 1) coro_chan_close(&sorted);
+}
+
+/*!
+ * Checks the batches sorted and returns them to the generator
+ *
+ * @param arg [in] unused
+ */
+void checker(void *arg)
+{
+    batch *batch = NULL;
+
+    while (coro_chan_recv(&sorted, &batch)) {
+        if (!check(batch)) ok = false;
+        coro_chan_send(&free_batches, &batch);
+    }
+}
+
+/*!
+ * Runs the stages, either one after another or as a pipeline
+ */
+void coroutine()
+{
+    size_t n_buffers = pipelined ? 2 * capacity + n_sorters + 2 : 1;
+    batch *buffers = malloc(n_buffers * sizeof(*buffers));
+    if (buffers == NULL) coro_error();
+
+    if (!pipelined) {
+        unsigned seed = 1;
+        for (size_t i = 0; i < n_batches; ++i) {
+            fill(buffers, &seed);
+            sort_array_with_coroutines(buffers->elems, buffers->aux, BATCH_SZ);
+            if (!check(buffers)) ok = false;
+        }
+
+        free(buffers);
+        coro_done();
+
+        return;
+    }
+
+    if (!coro_chan_init(&free_batches, sizeof(batch *), n_buffers)) coro_error();
+    if (!coro_chan_init(&generated, sizeof(batch *), capacity)) coro_error();
+    if (!coro_chan_init(&sorted, sizeof(batch *), capacity)) coro_error();
+    for (size_t i = 0; i < n_buffers; ++i) {
+        batch *buffer = &buffers[i];
+        coro_chan_send(&free_batches, &buffer);
+    }
+
+    atomic_init(&n_sorters_running, n_sorters);
+    coro *stages[n_sorters + 2];
+    stages[0] = coro_spawn(generator, NULL);
+    stages[1] = coro_spawn(checker, NULL);
+    for (size_t i = 0; i < n_sorters; ++i) {
+        stages[i + 2] = coro_spawn(sorter, NULL);
+    }
+    for (size_t i = 0; i < n_sorters + 2; ++i) {
+        if (stages[i] == NULL) coro_error();
+        coro_join(stages[i]);
+    }
+
+    coro_chan_destroy(&free_batches);
+    coro_chan_destroy(&generated);
+    coro_chan_destroy(&sorted);
+    free(buffers);
+
+    coro_done();
+}
@@ -0,0 +1,91 @@
+/*
+ * Microbenchmark of the context switch backends
+ *
+ * Build: cc -O2 -I.. ctx_switch.c ../coro_ctx.c -o ctx_switch
+ *        (add -DCORO_CTX_UCONTEXT to make the scheduler's backend the ucontext one)
+ * Usage: ./ctx_switch [n_switches]
+ *
+ * Ping-pongs between the main context and a single coroutine, reporting nanoseconds per switch both for the backend
+ * coro_ctx.c was built with and for plain swapcontext as the baseline.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "coro_ctx.h"
+
+enum { STACK_SZ = 64 * 1024 };
+
+static size_t n_switches = 10 * 1000 * 1000;
+
+static coro_ctx main_ctx, bench_ctx;
+static ucontext_t main_uc, bench_uc;
+
+static double now_ns();
+static void coro_ctx_ping_pong();
+static void ucontext_ping_pong();
+
+signed main(signed argc, const char *argv[])
+{
+    if (argc > 1) n_switches = strtoull(argv[1], NULL, 10);
+
+    static char ctx_stack[STACK_SZ], uc_stack[STACK_SZ];
+
+    if (!coro_ctx_init(&bench_ctx, ctx_stack, sizeof(ctx_stack), &main_ctx)) return EXIT_FAILURE;
+    coro_ctx_make(&bench_ctx, coro_ctx_ping_pong);
+
+    double start = now_ns();
+    for (size_t i = 0; i < n_switches / 2; ++i) {
+        coro_ctx_switch(&main_ctx, &bench_ctx);
+    }
+    double ctx_ns = (now_ns() - start) / (double) (n_switches / 2 * 2);
+
+    if (getcontext(&bench_uc) != 0) return EXIT_FAILURE;
+    bench_uc.uc_stack.ss_sp = uc_stack;
+    bench_uc.uc_stack.ss_size = sizeof(uc_stack);
+    bench_uc.uc_link = &main_uc;
+    makecontext(&bench_uc, ucontext_ping_pong, 0);
+
+    start = now_ns();
+    for (size_t i = 0; i < n_switches / 2; ++i) {
+        swapcontext(&main_uc, &bench_uc);
+    }
+    double uc_ns = (now_ns() - start) / (double) (n_switches / 2 * 2);
+
+    printf("coro_ctx (%s): %.2lf ns/switch\n", CORO_CTX_BACKEND, ctx_ns);
+    printf("swapcontext: %.2lf ns/switch\n", uc_ns);
+
+    return EXIT_SUCCESS;
+}
+
+/*!
+ * @return monotonic timestamp in nanoseconds
+ */
+double now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+}
+
+/*!
+ * Switches straight back to the main context, forever
+ */
+void coro_ctx_ping_pong()
+{
+    for (;;) {
+        coro_ctx_switch(&bench_ctx, &main_ctx);
+    }
+}
+
+/*!
+ * Switches straight back to the main context, forever
+ */
+void ucontext_ping_pong()
+{
+    for (;;) {
+        swapcontext(&bench_uc, &main_uc);
+    }
+}
@@ -0,0 +1,280 @@
+/*
+ * Benchmark of sorting arrays backed by huge pages
+ *
+ * Build: cc -O2 -I.. huge_pages.c ../coro.c ../coro_arena.c ../coro_clock.c ../coro_ctx.c ../coro_io.c ../coro_stack.c
+ *        ../dynamic_memory_management.c ../merge_sort.c ../radix_sort.c ../sort_kernel.c
+ *        -o huge_pages -lm -lpthread -lrt
+ * Usage: ./huge_pages [-n n_mil] [n_runs]
+ *        (-n sets the number of elements in millions)
+ *
+ * The same random numbers are sorted by merge sort and radix sort, in a single coroutine, with the array and the
+ * auxiliary array taken from the arena with 4 KiB pages, with transparent huge pages advised and with hugetlbfs pages
+ * (which fall back to transparent huge pages unless vm.nr_hugepages reserves enough of them). The best time of n_runs
+ * is reported along with the share of data loads which missed the dTLB in that run, as counted by perf events (n/a
+ * where they are unavailable, e.g. with kernel.perf_event_paranoid above 2 or in a VM without a PMU). The amount of
+ * anonymous memory actually backed by transparent huge pages is reported as well.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "coro.h"
+#include "coro_arena.h"
+#include "merge_sort.h"
+#include "radix_sort.h"
+
+/*!
+ * Counters of dTLB loads and their misses, -1 where they are unavailable
+ */
+typedef struct {
+    signed misses_fd;
+    signed loads_fd;
+} dtlb_counters;
+
+/*!
+ * Sort engines
+ */
+static const struct {
+    const char *name;
+    void (*sort)(elem_t *restrict arr, elem_t *restrict aux, size_t sz);
+} kernels[] = {
+    {"merge", merge_sort_array_with_coroutines},
+    {"radix", radix_sort_array_with_coroutines},
+};
+
+static size_t n_kernels = sizeof(kernels) / sizeof(*kernels);
+static size_t kernel;
+static elem_t *input;
+static elem_t *arr;
+static elem_t *aux;
+static size_t sz;
+
+static double now_ns();
+static signed open_counter(uint64_t result, signed group_fd);
+static dtlb_counters open_dtlb_counters();
+static void close_dtlb_counters(dtlb_counters *counters);
+static double read_miss_rate(const dtlb_counters *counters);
+static size_t thp_kib();
+static bool run(huge_page_mode mode, double *elapsed_ns, double *miss_rate, size_t *huge_kib);
+static void coroutine();
+
+signed main(signed argc, const char *argv[])
+{
+    sz = 16 * 1000 * 1000;
+
+    signed opt = 0;
+    while ((opt = getopt(argc, (char *const *) argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                sz = strtoull(optarg, NULL, 10) * 1000 * 1000;
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    size_t n_runs = (argc > 0) ? strtoull(argv[0], NULL, 10) : 3;
+
+    if ((input = malloc(sz * sizeof(*input))) == NULL) return EXIT_FAILURE;
+    unsigned seed = 1;
+    for (size_t i = 0; i < sz; ++i) {
+        input[i] = (elem_t) (rand_r(&seed) - RAND_MAX / 2);
+    }
+
+    static const char *mode_names[] = {
+        [HUGE_PAGES_OFF] = "4 KiB pages",
+        [HUGE_PAGES_THP] = "thp",
+        [HUGE_PAGES_HUGETLB] = "hugetlb",
+    };
+
+    printf("%zu numbers\n%-12s %-6s %9s %12s %12s\n", sz, "", "", "ms", "dTLB misses", "THP, MiB");
+    for (huge_page_mode mode = HUGE_PAGES_OFF; mode <= HUGE_PAGES_HUGETLB; ++mode) {
+        for (kernel = 0; kernel < n_kernels; ++kernel) {
+            double best_ns = 0;
+            double best_miss_rate = -1;
+            size_t huge_kib = 0;
+            for (size_t i = 0; i < n_runs; ++i) {
+                double elapsed_ns = 0;
+                double miss_rate = -1;
+                if (!run(mode, &elapsed_ns, &miss_rate, &huge_kib)) return EXIT_FAILURE;
+                if ((best_ns == 0) || (elapsed_ns < best_ns)) {
+                    best_ns = elapsed_ns;
+                    best_miss_rate = miss_rate;
+                }
+            }
+
+            printf("%-12s %-6s %9.1lf ", mode_names[mode], kernels[kernel].name, best_ns / 1e6);
+            if (best_miss_rate < 0) {
+                printf("%12s", "n/a");
+            } else {
+                printf("%11.3lf%%", best_miss_rate * 100);
+            }
+            printf(" %12zu\n", huge_kib / 1024);
+        }
+    }
+
+    free(input);
+
+    return EXIT_SUCCESS;
+}
+
+/*!
+ * @return monotonic timestamp in nanoseconds
+ */
+double now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+}
+
+/*!
+ * Opens a disabled counter of the calling thread's dTLB loads in user space
+ *
+ * @param result   [in] PERF_COUNT_HW_CACHE_RESULT_ACCESS or PERF_COUNT_HW_CACHE_RESULT_MISS
+ * @param group_fd [in] leader of the counter's group, -1 to make the counter a leader
+ *
+ * @return counter's file descriptor, -1 on failure
+ */
+signed open_counter(uint64_t result, signed group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+    attr.disabled = (group_fd == -1);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return (signed) syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/*!
+ * Opens and starts the dTLB counters
+ *
+ * @return counters, both -1 if they are unavailable
+ */
+dtlb_counters open_dtlb_counters()
+{
+    dtlb_counters counters = {.misses_fd = open_counter(PERF_COUNT_HW_CACHE_RESULT_MISS, -1), .loads_fd = -1};
+    if (counters.misses_fd == -1) return counters;
+
+    if ((counters.loads_fd = open_counter(PERF_COUNT_HW_CACHE_RESULT_ACCESS, counters.misses_fd)) == -1) {
+        close_dtlb_counters(&counters);
+        return counters;
+    }
+
+    ioctl(counters.misses_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counters.misses_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+    return counters;
+}
+
+/*!
+ * @param counters [in, out]
+ */
+void close_dtlb_counters(dtlb_counters *counters)
+{
+    if (counters->loads_fd != -1) close(counters->loads_fd);
+    if (counters->misses_fd != -1) close(counters->misses_fd);
+    *counters = (dtlb_counters) {.misses_fd = -1, .loads_fd = -1};
+}
+
+/*!
+ * Stops the dTLB counters and reads them
+ *
+ * @param counters [in]
+ *
+ * @return share of loads which missed the dTLB, -1 if the counters are unavailable
+ */
+double read_miss_rate(const dtlb_counters *counters)
+{
+    if (counters->misses_fd == -1) return -1;
+
+    ioctl(counters->misses_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    uint64_t misses = 0;
+    uint64_t loads = 0;
+    if ((read(counters->misses_fd, &misses, sizeof(misses)) != sizeof(misses)) ||
+        (read(counters->loads_fd, &loads, sizeof(loads)) != sizeof(loads)) || (loads == 0)) {
+        return -1;
+    }
+
+    return (double) misses / (double) loads;
+}
+
+/*!
+ * @return amount of the process' anonymous memory backed by transparent huge pages, in KiB
+ */
+size_t thp_kib()
+{
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    if (file == NULL) return 0;
+
+    char line[256];
+    size_t kib = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "AnonHugePages: %zu kB", &kib) == 1) break;
+    }
+    fclose(file);
+
+    return kib;
+}
+
+/*!
+ * Sorts the input once with the engine being benchmarked, in arrays taken from the arena
+ *
+ * @param mode       [in] how the arrays are backed by huge pages
+ * @param elapsed_ns [out]
+ * @param miss_rate  [out] share of loads which missed the dTLB, -1 if unavailable
+ * @param huge_kib   [out] memory backed by transparent huge pages while sorting, in KiB
+ *
+ * @return true on success, false otherwise
+ */
+bool run(huge_page_mode mode, double *elapsed_ns, double *miss_rate, size_t *huge_kib)
+{
+    if (!scheduler_setup(1, 1000, 256 * 1024)) return false;
+    coro_arena_use_huge_pages(mode);
+    scheduler_register_coro_entry_point(coroutine);
+
+    arr = coro_arena_alloc(sz * sizeof(*arr));
+    aux = coro_arena_alloc(sz * sizeof(*aux));
+    if ((arr == NULL) || (aux == NULL)) {
+        scheduler_cleanup();
+        return false;
+    }
+    memcpy(arr, input, sz * sizeof(*arr));
+    memset(aux, 0, sz * sizeof(*aux));
+
+    dtlb_counters counters = open_dtlb_counters();
+    double start = now_ns();
+    bool ok = scheduler_run();
+    *elapsed_ns = now_ns() - start;
+    *miss_rate = read_miss_rate(&counters);
+    close_dtlb_counters(&counters);
+
+    *huge_kib = thp_kib();
+    scheduler_cleanup();
+
+    return ok;
+}
+
+/*!
+ * Sorts the array with the engine being benchmarked
+ */
+void coroutine()
+{
+    kernels[kernel].sort(arr, aux, sz);
+    coro_done();
+}
@@ -0,0 +1,160 @@
+/*
+ * Benchmark of the input modes: streaming through the I/O reactor versus parsing an mmap'ed file
+ *
+ * Build: cc -O2 -I.. ingest.c ../coro.c ../coro_arena.c ../coro_clock.c ../coro_ctx.c ../coro_io.c ../coro_stack.c
+ *        ../dynamic_memory_management.c ../elem_parser.c ../ingest.c ../merge_sort.c ../run_file.c ../stream_reader.c
+ *        -o ingest -lm -lpthread -lrt
+ * Usage: ./ingest [-g size_mib] file [n_runs]
+ *        (-g generates a file of random numbers of about size_mib MiB first)
+ *
+ * Each run parses the whole file in a single coroutine with each of the modes in turn, reporting the best time and
+ * throughput of each. After the first run the file is served from the page cache, which is the case mmap targets;
+ * drop the page cache between invocations to measure cold reads.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "coro.h"
+#include "dynamic_memory_management.h"
+#include "ingest.h"
+
+static const char *file_name;
+static ingest_mode mode;
+static size_t n_elems;
+static double elapsed_ns;
+
+static double now_ns();
+static bool generate(const char *name, size_t size_mib);
+static bool run(ingest_mode run_mode);
+static void coroutine();
+
+signed main(signed argc, const char *argv[])
+{
+    size_t generate_mib = 0;
+
+    signed opt = 0;
+    while ((opt = getopt(argc, (char *const *) argv, "g:")) != -1) {
+        switch (opt) {
+            case 'g':
+                generate_mib = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1) {
+        fprintf(stderr, "usage: ingest [-g size_mib] file [n_runs]\n");
+
+        return EXIT_FAILURE;
+    }
+
+    file_name = argv[0];
+    size_t n_runs = (argc > 1) ? strtoull(argv[1], NULL, 10) : 3;
+    if ((generate_mib != 0) && !generate(file_name, generate_mib)) return EXIT_FAILURE;
+
+    struct stat stat_buf;
+    if (stat(file_name, &stat_buf) != 0) return EXIT_FAILURE;
+    double size_mib = (double) stat_buf.st_size / (1024 * 1024);
+
+    static const char *mode_names[] = {[INGEST_STREAM] = "stream", [INGEST_MMAP] = "mmap"};
+    double best_ns[2] = {0, 0};
+    for (size_t i = 0; i < n_runs; ++i) {
+        for (ingest_mode run_mode = INGEST_STREAM; run_mode <= INGEST_MMAP; ++run_mode) {
+            if (!run(run_mode)) return EXIT_FAILURE;
+            if ((best_ns[run_mode] == 0) || (elapsed_ns < best_ns[run_mode])) best_ns[run_mode] = elapsed_ns;
+        }
+    }
+
+    printf("%.0lf MiB, %zu numbers\n", size_mib, n_elems);
+    for (ingest_mode run_mode = INGEST_STREAM; run_mode <= INGEST_MMAP; ++run_mode) {
+        printf("%-6s %9.1lf ms %8.1lf MiB/s\n", mode_names[run_mode], best_ns[run_mode] / 1e6,
+               size_mib / (best_ns[run_mode] / 1e9));
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*!
+ * @return monotonic timestamp in nanoseconds
+ */
+double now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+}
+
+/*!
+ * Writes random numbers separated by spaces to a file
+ *
+ * @param name     [in]
+ * @param size_mib [in] approximate size of the file
+ *
+ * @return true on success, false otherwise
+ */
+bool generate(const char *name, size_t size_mib)
+{
+    FILE *file = fopen(name, "w");
+    if (file == NULL) return false;
+
+    unsigned seed = 1;
+    for (size_t written = 0; written < size_mib * 1024 * 1024;) {
+        signed n = fprintf(file, "%d ", rand_r(&seed) - RAND_MAX / 2);
+        if (n < 0) break;
+        written += (size_t) n;
+    }
+
+    return fclose(file) == 0;
+}
+
+/*!
+ * Parses the file in one coroutine
+ *
+ * @param run_mode [in]
+ *
+ * @return true on success, false otherwise
+ */
+bool run(ingest_mode run_mode)
+{
+    mode = run_mode;
+
+    if (!scheduler_setup(1, 1000, 64 * 1024)) return false;
+    scheduler_register_coro_entry_point(coroutine);
+
+    double start = now_ns();
+    bool ok = scheduler_run();
+    elapsed_ns = now_ns() - start;
+
+    free_and_null((void **) &scheduler_coro_pool()->storage);
+    scheduler_cleanup();
+
+    return ok;
+}
+
+/*!
+ * Parses the file with the mode being benchmarked
+ */
+void coroutine()
+{
+    coro *this = scheduler_curr_coro();
+
+    signed fd = open(file_name, O_RDONLY);
+    bool sorted = false;
+    if ((fd == -1) || !ingest_file(mode, fd, &this->storage, &this->storage_sz, &sorted)) {
+        if (fd != -1) close(fd);
+        coro_error();
+    }
+    close(fd);
+
+    n_elems = this->storage_sz;
+    coro_done();
+}
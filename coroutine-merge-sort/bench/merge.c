@@ -0,0 +1,124 @@
+/*
+ * Benchmark of the final merge: k sorted runs merged and written out by an increasing number of threads
+ *
+ * Build: cc -O2 -I.. merge.c ../coro.c ../coro_arena.c ../coro_clock.c ../coro_ctx.c ../coro_io.c ../coro_stack.c
+ *        ../dynamic_memory_management.c ../loser_tree.c ../merge_path.c ../run_file.c ../text_writer.c
+ *        -o merge -lm -lpthread -lrt
+ * Usage: ./merge [-b] [-k n_runs] [-n n_mil] [-t max_threads] out_file
+ *        (-b writes a binary run instead of text, -n sets the total number of elements in millions)
+ *
+ * Each thread count is run three times, reporting the best time. The output goes through the page cache, so put
+ * out_file on tmpfs to measure the merge rather than the disk.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "merge_path.h"
+
+static double now_ns();
+static signed elem_cmp(const void *a, const void *b);
+
+signed main(signed argc, const char *argv[])
+{
+    bool binary = false;
+    size_t k = 64;
+    size_t sz = 16 * 1000 * 1000;
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    signed opt = 0;
+    while ((opt = getopt(argc, (char *const *) argv, "bk:n:t:")) != -1) {
+        switch (opt) {
+            case 'b':
+                binary = true;
+                break;
+            case 'k':
+                k = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                sz = strtoull(optarg, NULL, 10) * 1000 * 1000;
+                break;
+            case 't':
+                max_threads = strtol(optarg, NULL, 10);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if ((argc < 1) || (k == 0)) {
+        fprintf(stderr, "usage: merge [-b] [-k n_runs] [-n n_mil] [-t max_threads] out_file\n");
+
+        return EXIT_FAILURE;
+    }
+    if (max_threads < 1) max_threads = 1;
+
+    elem_t *elems = malloc(sz * sizeof(*elems));
+    merge_run *runs = calloc(k, sizeof(*runs));
+    if ((elems == NULL) || (runs == NULL)) return EXIT_FAILURE;
+
+    unsigned seed = 1;
+    for (size_t i = 0; i < sz; ++i) {
+        elems[i] = rand_r(&seed) - RAND_MAX / 2;
+    }
+    for (size_t i = 0; i < k; ++i) {
+        elem_t *begin = elems + sz / k * i;
+        elem_t *end = (i == k - 1) ? elems + sz : begin + sz / k;
+
+        qsort(begin, (size_t) (end - begin), sizeof(*begin), elem_cmp);
+        runs[i] = (merge_run) {.begin = begin, .end = end};
+    }
+
+    printf("%zu runs, %zu numbers, %s output\n", k, sz, binary ? "binary" : "text");
+    for (long n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        double best_ns = 0;
+        for (size_t i = 0; i < 3; ++i) {
+            signed fd = open(argv[0], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) return EXIT_FAILURE;
+
+            double start = now_ns();
+            bool ok = merge_path_write(fd, runs, k, binary, (size_t) n_threads);
+            double elapsed_ns = now_ns() - start;
+
+            close(fd);
+            if (!ok) return EXIT_FAILURE;
+            if ((best_ns == 0) || (elapsed_ns < best_ns)) best_ns = elapsed_ns;
+        }
+
+        printf("%3ld threads %9.1lf ms %8.1lf M/s\n", n_threads, best_ns / 1e6, (double) sz / (best_ns / 1e3));
+    }
+
+    free(runs);
+    free(elems);
+
+    return EXIT_SUCCESS;
+}
+
+/*!
+ * @return monotonic timestamp in nanoseconds
+ */
+double now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+}
+
+/*!
+ * @param a [in]
+ * @param b [in]
+ *
+ * @return comparison of two elements for qsort()
+ */
+signed elem_cmp(const void *a, const void *b)
+{
+    elem_t x = *(const elem_t *) a;
+    elem_t y = *(const elem_t *) b;
+
+    return (x > y) - (x < y);
+}
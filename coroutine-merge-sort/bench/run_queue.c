@@ -0,0 +1,108 @@
+/*
+ * Benchmark of the scheduler's run queue with many short-lived coroutines
+ *
+ * Build: cc -O2 -I.. run_queue.c ../coro.c ../coro_arena.c ../coro_clock.c ../coro_ctx.c ../coro_io.c ../coro_stack.c
+ *        ../dynamic_memory_management.c -o run_queue -lm -lpthread -lrt
+ * Usage: ./run_queue [n_coros]
+ *
+ * Every hundredth coroutine is long-lived and passes control LONG_LIVED_SWITCHES times, the rest pass control
+ * SHORT_LIVED_SWITCHES times and finish early, so that most of the run is spent with the few long-lived coroutines
+ * among thousands of finished ones. The cost of a switch is reported for every tenth of the switches made: it should
+ * not depend on how many coroutines are done.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "coro.h"
+
+enum {
+    N_PHASES = 10,
+    LONG_LIVED_PERIOD = 100,
+    LONG_LIVED_SWITCHES = 10000,
+    SHORT_LIVED_SWITCHES = 10,
+};
+
+static size_t n_coros = 10000;
+static size_t n_done = 0;
+static size_t n_switches = 0;
+static size_t n_switches_total = 0;
+
+static double phase_start_ns;
+static size_t phase = 0;
+
+static double now_ns();
+static size_t coro_n_switches(size_t id);
+static void coroutine();
+
+signed main(signed argc, const char *argv[])
+{
+    if (argc > 1) n_coros = strtoull(argv[1], NULL, 10);
+
+    for (size_t i = 0; i < n_coros; ++i) {
+        n_switches_total += coro_n_switches(i);
+    }
+
+    if (!scheduler_setup(n_coros, 1, 64 * 1024)) return EXIT_FAILURE;
+    scheduler_register_coro_entry_point(coroutine);
+
+    printf("%zu coroutines\n", n_coros);
+
+    phase_start_ns = now_ns();
+    double start = phase_start_ns;
+    if (!scheduler_run()) {
+        scheduler_cleanup();
+
+        return EXIT_FAILURE;
+    }
+
+    printf("total: %zu switches in %.3lf ms\n", n_switches, (now_ns() - start) / 1e6);
+    scheduler_cleanup();
+
+    return EXIT_SUCCESS;
+}
+
+/*!
+ * @return monotonic timestamp in nanoseconds
+ */
+double now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+}
+
+/*!
+ * @param id [in] index of a coroutine in the pool
+ *
+ * @return number of times the coroutine passes control before it finishes
+ */
+size_t coro_n_switches(size_t id)
+{
+    return (id % LONG_LIVED_PERIOD == 0) ? LONG_LIVED_SWITCHES : SHORT_LIVED_SWITCHES;
+}
+
+/*!
+ * Passes control a number of times depending on the coroutine's index, reporting a phase whenever one ends
+ */
+void coroutine()
+{
+    size_t id = (size_t) (scheduler_curr_coro() - scheduler_coro_pool());
+
+    for (size_t i = 0; i < coro_n_switches(id); ++i) {
+        if (++n_switches * N_PHASES >= (phase + 1) * n_switches_total) {
+            double now = now_ns();
+            printf("%3zu%% of switches, %5zu coroutines done: %.2lf ns/switch\n", (phase + 1) * 100 / N_PHASES, n_done,
+                   (now - phase_start_ns) * N_PHASES / (double) n_switches_total);
+
+            phase_start_ns = now;
+            ++phase;
+        }
+
+        coro_suspend();
+    }
+
+    ++n_done;
+    coro_done();
+}
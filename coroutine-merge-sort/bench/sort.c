@@ -0,0 +1,220 @@
+/*
+ * Benchmark of the sort engines on inputs of different presortedness
+ *
+ * Build: cc -O2 -I.. sort.c ../coro.c ../coro_arena.c ../coro_clock.c ../coro_ctx.c ../coro_io.c ../coro_stack.c
+ *        ../dynamic_memory_management.c ../merge_sort.c ../radix_sort.c ../sort_kernel.c -o sort -lm -lpthread -lrt
+ * Usage: ./sort [-n n_mil] [n_runs]
+ *        (-n sets the number of elements in millions)
+ *
+ * Each input is sorted by merge sort, radix sort and the automatic choice between them, cooperatively in a single
+ * coroutine n_runs times each, reporting the best time. The nearly sorted input is sorted with one element in a
+ * thousand swapped with a random one, which resembles log data merged from a few sources.
+ *
+ * Define one of the ELEM_* types (see elem.h) for the build to benchmark it instead of 32-bit integers; records get
+ * the generated numbers as keys and their positions as payloads.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "merge_sort.h"
+#include "radix_sort.h"
+#include "sort_kernel.h"
+
+/*!
+ * Input patterns
+ */
+typedef enum {
+    PATTERN_RANDOM,
+    PATTERN_SORTED,
+    PATTERN_REVERSED,
+    PATTERN_NEARLY_SORTED,
+    PATTERN_SAWTOOTH,
+    PATTERN_FEW_UNIQUE,
+} pattern;
+
+/*!
+ * Sort engines
+ */
+static const struct {
+    const char *name;
+    void (*sort)(elem_t *restrict arr, elem_t *restrict aux, size_t sz);
+} kernels[] = {
+    {"merge", merge_sort_array_with_coroutines},
+    {"radix", radix_sort_array_with_coroutines},
+    {"auto", sort_array_with_coroutines},
+};
+
+static size_t n_kernels = sizeof(kernels) / sizeof(*kernels);
+static size_t kernel;
+static elem_t *input;
+static elem_t *arr;
+static elem_t *aux;
+static size_t sz;
+static double elapsed_ns;
+
+static double now_ns();
+static elem_t make_elem(int64_t value, size_t i);
+static void generate(pattern kind);
+static bool run();
+static void coroutine();
+
+signed main(signed argc, const char *argv[])
+{
+    sz = 16 * 1000 * 1000;
+
+    signed opt = 0;
+    while ((opt = getopt(argc, (char *const *) argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                sz = strtoull(optarg, NULL, 10) * 1000 * 1000;
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    size_t n_runs = (argc > 0) ? strtoull(argv[0], NULL, 10) : 3;
+
+    input = malloc(sz * sizeof(*input));
+    arr = malloc(sz * sizeof(*arr));
+    aux = malloc(sz * sizeof(*aux));
+    if ((input == NULL) || (arr == NULL) || (aux == NULL)) return EXIT_FAILURE;
+
+    static const char *pattern_names[] = {
+        [PATTERN_RANDOM] = "random",
+        [PATTERN_SORTED] = "sorted",
+        [PATTERN_REVERSED] = "reversed",
+        [PATTERN_NEARLY_SORTED] = "nearly sorted",
+        [PATTERN_SAWTOOTH] = "sawtooth",
+        [PATTERN_FEW_UNIQUE] = "few unique",
+    };
+
+    printf("%zu numbers, ms\n%-13s", sz, "");
+    for (kernel = 0; kernel < n_kernels; ++kernel) {
+        printf(" %9s", kernels[kernel].name);
+    }
+    printf("\n");
+
+    for (pattern kind = PATTERN_RANDOM; kind <= PATTERN_FEW_UNIQUE; ++kind) {
+        generate(kind);
+
+        printf("%-13s", pattern_names[kind]);
+        for (kernel = 0; kernel < n_kernels; ++kernel) {
+            double best_ns = 0;
+            for (size_t i = 0; i < n_runs; ++i) {
+                memcpy(arr, input, sz * sizeof(*arr));
+                if (!run()) return EXIT_FAILURE;
+                if ((best_ns == 0) || (elapsed_ns < best_ns)) best_ns = elapsed_ns;
+            }
+
+            printf(" %9.1lf", best_ns / 1e6);
+        }
+        printf("\n");
+    }
+
+    free(input);
+    free(arr);
+    free(aux);
+
+    return EXIT_SUCCESS;
+}
+
+/*!
+ * @return monotonic timestamp in nanoseconds
+ */
+double now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+}
+
+/*!
+ * @param value [in] generated number
+ * @param i     [in] position of the element in the input
+ *
+ * @return element for the number
+ */
+elem_t make_elem(int64_t value, size_t i)
+{
+#ifdef ELEM_RECORD
+    return (elem_t) {.key = value, .payload = i};
+#else
+    return (elem_t) value;
+#endif
+}
+
+/*!
+ * Fills the input with a pattern
+ *
+ * @param kind [in]
+ */
+void generate(pattern kind)
+{
+    unsigned seed = 1;
+
+    for (size_t i = 0; i < sz; ++i) {
+        switch (kind) {
+            case PATTERN_RANDOM:
+                input[i] = make_elem(rand_r(&seed) - RAND_MAX / 2, i);
+                break;
+            case PATTERN_SORTED:
+            case PATTERN_NEARLY_SORTED:
+                input[i] = make_elem((int64_t) i, i);
+                break;
+            case PATTERN_REVERSED:
+                input[i] = make_elem((int64_t) (sz - i), i);
+                break;
+            case PATTERN_SAWTOOTH:
+                input[i] = make_elem((int64_t) (i % 100000), i);
+                break;
+            case PATTERN_FEW_UNIQUE:
+                input[i] = make_elem(rand_r(&seed) % 16, i);
+                break;
+        }
+    }
+
+    if (kind == PATTERN_NEARLY_SORTED) {
+        for (size_t i = 0; i < sz; i += 1000) {
+            size_t j = (size_t) rand_r(&seed) % sz;
+            elem_t tmp = input[i];
+            input[i] = input[j];
+            input[j] = tmp;
+        }
+    }
+}
+
+/*!
+ * Sorts the array in one coroutine
+ *
+ * @return true on success, false otherwise
+ */
+bool run()
+{
+    if (!scheduler_setup(1, 1000, 256 * 1024)) return false;
+    scheduler_register_coro_entry_point(coroutine);
+
+    double start = now_ns();
+    bool ok = scheduler_run();
+    elapsed_ns = now_ns() - start;
+
+    scheduler_cleanup();
+
+    return ok;
+}
+
+/*!
+ * Sorts the array with the engine being benchmarked
+ */
+void coroutine()
+{
+    kernels[kernel].sort(arr, aux, sz);
+    coro_done();
+}
@@ -0,0 +1,160 @@
+/*
+ * Benchmark of spawning and joining coroutines
+ *
+ * Build: cc -O2 -I.. spawn.c ../coro.c ../coro_arena.c ../coro_clock.c ../coro_ctx.c ../coro_io.c ../coro_stack.c
+ *        ../dynamic_memory_management.c -o spawn -lm -lpthread -lrt
+ * Usage: ./spawn [-w n_workers] [n_spawns]
+ *
+ * A single coroutine first spawns n_spawns trivial coroutines in batches of BATCH_SZ, joining every batch before
+ * spawning the next one, so that all but the first batch reuse joined coroutines; then it sums the numbers below
+ * n_spawns with a fork-join tree, every coroutine spawning two children until the range is down to LEAF_SZ numbers.
+ * Nanoseconds per spawn and join are reported for both, the second one spread among the workers.
+ */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro.h"
+
+enum {
+    BATCH_SZ = 64,
+    LEAF_SZ = 64,
+};
+
+/*!
+ * Range of numbers summed by a coroutine of the fork-join tree
+ */
+typedef struct {
+    size_t begin;
+    size_t end;
+    size_t sum;
+} range;
+
+static size_t n_spawns = 1000 * 1000;
+static atomic_size_t n_tree_spawns;
+static double batches_ns;
+static double tree_ns;
+static bool ok = true;
+
+static double now_ns();
+static void nop(void *arg);
+static void sum(void *arg);
+static void coroutine();
+
+signed main(signed argc, const char *argv[])
+{
+    size_t n_workers = 1;
+
+    signed opt = 0;
+    while ((opt = getopt(argc, (char *const *) argv, "w:")) != -1) {
+        switch (opt) {
+            case 'w':
+                n_workers = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc > 0) n_spawns = strtoull(argv[0], NULL, 10);
+
+    if (!scheduler_setup(1, 1000, 64 * 1024)) return EXIT_FAILURE;
+    scheduler_register_coro_entry_point(coroutine);
+
+    if (!scheduler_run_workers(n_workers) || !ok) {
+        scheduler_cleanup();
+
+        return EXIT_FAILURE;
+    }
+    scheduler_cleanup();
+
+    printf("batches: %.1lf ns per spawn and join\n", batches_ns / (double) n_spawns);
+    printf("tree:    %.1lf ns per spawn and join (%zu coroutines, %zu workers)\n",
+           tree_ns / (double) atomic_load(&n_tree_spawns), atomic_load(&n_tree_spawns), n_workers);
+
+    return EXIT_SUCCESS;
+}
+
+/*!
+ * @return monotonic timestamp in nanoseconds
+ */
+double now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+}
+
+/*!
+ * Does nothing
+ *
+ * @param arg [in] unused
+ */
+void nop(void *arg)
+{
+}
+
+/*!
+ * Sums a range of numbers, splitting it between two child coroutines unless it's small
+ *
+ * @param arg [in, out] range
+ */
+void sum(void *arg)
+{
+    range *this = arg;
+
+    if (this->end - this->begin <= LEAF_SZ) {
+        this->sum = 0;
+        for (size_t i = this->begin; i < this->end; ++i) {
+            this->sum += i;
+        }
+
+        return;
+    }
+
+    size_t middle = this->begin + (this->end - this->begin) / 2;
+    range halves[2] = {{.begin = this->begin, .end = middle}, {.begin = middle, .end = this->end}};
+    coro *children[2] = {coro_spawn(sum, &halves[0]), coro_spawn(sum, &halves[1])};
+    for (size_t i = 0; i < 2; ++i) {
+        if (children[i] == NULL) coro_error();
+        coro_join(children[i]);
+    }
+    atomic_fetch_add(&n_tree_spawns, 2);
+
+    this->sum = halves[0].sum + halves[1].sum;
+}
+
+/*!
+ * Runs both benchmarks
+ */
+void coroutine()
+{
+    coro *batch[BATCH_SZ];
+
+    double start = now_ns();
+    for (size_t i = 0; i < n_spawns; i += BATCH_SZ) {
+        size_t batch_sz = (n_spawns - i < BATCH_SZ) ? n_spawns - i : BATCH_SZ;
+        for (size_t j = 0; j < batch_sz; ++j) {
+            if ((batch[j] = coro_spawn(nop, NULL)) == NULL) coro_error();
+        }
+        for (size_t j = 0; j < batch_sz; ++j) {
+            coro_join(batch[j]);
+        }
+    }
+    batches_ns = now_ns() - start;
+
+    range all = {.begin = 0, .end = n_spawns};
+    start = now_ns();
+    sum(&all);
+    tree_ns = now_ns() - start;
+
+    ok = (all.sum == n_spawns * (n_spawns - 1) / 2);
+    if (!ok) fprintf(stderr, "wrong sum: %zu\n", all.sum);
+
+    coro_done();
+}
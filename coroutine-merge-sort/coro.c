@@ -1,60 +1,200 @@
+#define _GNU_SOURCE
+
 #include "coro.h"
 
 #include <assert.h>
-#include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
-#include <ucontext.h>
+#include <unistd.h>
 
+#include "coro_arena.h"
+#include "coro_clock.h"
+#include "coro_io.h"
 #include "errors.h"
 #include "dynamic_memory_management.h"
 
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/*!
+ * Minimum period of the preemption timer, in microseconds
+ */
+static const double MIN_PREEMPTION_PERIOD = 50;
+
+/*!
+ * Intrusive list of coroutines, linked through their next and prev fields
+ *
+ * @note a coroutine is in at most one list at a time: either a run queue or the blocked set
+ */
+typedef struct {
+    coro *head;
+    coro *tail;
+    size_t len;
+} coro_list;
+
+/*!
+ * Queue of runnable coroutines owned by a worker
+ *
+ * @details list guarded by a spinlock: the owner pushes to the tail and pops from the head, other workers steal up to
+ * a half of it from the head when they run out of coroutines
+ */
+typedef struct {
+    atomic_flag lock;
+    coro_list coros;
+} run_queue;
+
+/*!
+ * Worker running coroutines on an OS thread
+ *
+ * @details coroutines switch to each other directly, so the coroutine switched away from can only be pushed to the run
+ * queue (requeued) or to the blocked set (blocked) once its context has been saved, i.e. by whichever context is
+ * resumed; similarly, the stack of a coroutine which is done is released only after switching to the park (finished)
+ * @details coro_yield() only decrements the yield budget, the clock is read once it runs out (see coro_yield_check())
+ * @details preemption_tick is set by the SIGALRM handler and cleared by the worker's own thread, at a coro_yield()
+ */
+typedef struct {
+    pthread_t thread;
+    coro_ctx park;
+    coro_stack sigaltstack;
+    timer_t preemption_timer;
+    bool preemption_timer_armed;
+    run_queue run_queue;
+    unsigned steal_seed;
+
+    coro *curr;
+    coro *requeued;
+    coro *blocked;
+    coro *finished;
+    uint64_t curr_coro_resume_ticks;
+    long yield_budget;
+    long yield_budget_granted;
+    long yields_in_slice;
+    volatile sig_atomic_t preemption_tick;
+} worker;
+
 /*!
  * Abstract singleton scheduler
+ *
+ * @details spawned coroutines are allocated on demand and never freed until cleanup: all of them are chained through
+ * their spawned_next fields, and those which have been joined are kept on a free-list, linked through their next
+ * fields, for coro_spawn() to reuse
  */
 struct {
     size_t coro_pool_sz;
     coro *coro_pool;
+    ctx_entry_point_func_t entry_point;
+    double target_latency;
+
+    atomic_flag spawn_lock;
+    coro *spawned;
+    coro *free_coros;
 
-    bool err;
-    size_t semaphore;
-    size_t curr_coro_id;
-    struct timespec curr_coro_resume_time;
-    double time_quanta;
-    bool running;
+    size_t n_workers;
+    worker *workers;
+
+    atomic_flag blocked_lock;
+    coro_list blocked;
+
+    atomic_bool err;
+    atomic_size_t semaphore;
+    atomic_size_t n_idle;
+    uint64_t time_quanta;
+    bool preemptive;
 } static scheduler;
 
-static bool setup_context_stack(stack_t *stack);
-static double time_elapsed_since_last_invocation();
+/*!
+ * Worker run by the current thread, NULL outside of the scheduler
+ */
+static _Thread_local worker *this_worker;
+
+static bool setup_stack_overflow_handler();
+static void cleanup_stack_overflow_handler();
+static void stack_overflow_handler(int sig, siginfo_t *info, void *ucontext);
+static void preemption_handler(int sig);
+
+static void coro_list_push(coro_list *list, coro *coro);
+static coro *coro_list_pop(coro_list *list);
+static void coro_list_remove(coro_list *list, coro *coro);
+static void coro_list_append(coro_list *list, coro_list *other);
+
+static void spin_lock(atomic_flag *lock);
+static void spin_unlock(atomic_flag *lock);
+
+static void run_queue_push(run_queue *run_queue, coro *coro);
+static coro *run_queue_pop(run_queue *run_queue);
+static coro_list run_queue_steal(run_queue *run_queue);
 
-static void coro_park();
-static void coro_pass_control();
+static worker *curr_worker();
+static void *worker_main(void *arg);
+static bool worker_setup_sigaltstack(worker *worker);
+static void worker_cleanup_sigaltstack(worker *worker);
+static bool worker_setup_preemption_timer(worker *worker);
+static void worker_cleanup_preemption_timer(worker *worker);
+static void worker_park(worker *worker);
+static coro *worker_next_coro(worker *worker);
+static coro *worker_steal(worker *worker);
+static void worker_idle(worker *worker);
+static bool worker_runnable_exists();
+static void worker_start_slice(worker *worker);
+static void worker_refill_yield_budget(worker *worker, uint64_t ticks_left);
+static double time_elapsed_since_last_invocation(worker *worker);
+static void worker_end_slice(worker *worker, bool switched, bool blocked, bool preempted);
+static void coro_metrics_resume(coro *coro, uint64_t now);
+static void coro_metrics_write(FILE *file, const coro *coro, bool last);
+
+static bool coro_start(coro *coro);
+static bool coro_switch(worker *worker, coro_ctx *from, coro *to);
+static void coro_after_switch();
+static void coro_block_after_switch(coro *coro);
+static void coro_main();
+static void coro_exit();
+static void coro_exit_after_switch(coro *coro);
+static void coro_pass_control(bool preempted);
+static void coro_yield_check(worker *worker);
+
+static void coro_chan_wait(coro_chan *chan, coro_chan_waiter **queue);
+static void coro_chan_wake(coro_chan_waiter **queue);
 
 /*!
  * Sets up the coroutine scheduler
  *
  * @param coro_pool_sz   [in] number of coroutines
  * @param target_latency [in] multitasking latency
+ * @param stack_sz       [in] size of each coroutine's stack
  *
  * @return true on success, false otherwise
  *
- * @note the scheduler manages an auxiliary coroutine for parking
+ * @note each of the scheduler's workers has an auxiliary context for parking
+ * @note coroutine stacks are taken from the stack pool when coroutines are first run and are released back to it as
+ * soon as they are done, so only the coroutines which are in progress hold a stack
+ * @note the scheduler owns the arena of large buffers (see coro_arena.h), which lives until the scheduler is cleaned up
  */
-bool scheduler_setup(size_t coro_pool_sz, double target_latency)
+bool scheduler_setup(size_t coro_pool_sz, double target_latency, size_t stack_sz)
 {
-    scheduler.curr_coro_id = 0;
-    scheduler.semaphore = coro_pool_sz;
-    scheduler.coro_pool_sz = coro_pool_sz + 1;
-    scheduler.time_quanta = target_latency / coro_pool_sz;
+    atomic_init(&scheduler.err, false);
+    atomic_init(&scheduler.semaphore, coro_pool_sz);
+    atomic_init(&scheduler.n_idle, 0);
+    atomic_flag_clear(&scheduler.blocked_lock);
+    scheduler.blocked = (coro_list) {.head = NULL, .tail = NULL, .len = 0};
+    atomic_flag_clear(&scheduler.spawn_lock);
+    scheduler.spawned = scheduler.free_coros = NULL;
+    scheduler.coro_pool_sz = coro_pool_sz;
+    scheduler.target_latency = target_latency;
 
-    if ((scheduler.coro_pool = calloc(scheduler.coro_pool_sz, sizeof(*scheduler.coro_pool))) == NULL) HANDLE_ERROR("calloc: ", { goto cleanup; });
-
-    for (size_t i = 1; i < scheduler.coro_pool_sz; ++i) {
-        if (getcontext(&scheduler.coro_pool[i].ctx) != 0) HANDLE_ERROR("getcontext: ", { goto cleanup; });
-        if (!setup_context_stack(&scheduler.coro_pool[i].ctx.uc_stack)) goto cleanup;
-        scheduler.coro_pool[i].ctx.uc_link = &scheduler.coro_pool[0].ctx;
-    }
+    if ((scheduler.coro_pool = calloc(scheduler.coro_pool_sz, sizeof(*scheduler.coro_pool))) == NULL) HANDLE_ERROR("calloc: ", { return false; });
+    if (!coro_clock_setup()) goto cleanup;
+    if (!coro_stack_pool_setup(stack_sz)) goto cleanup;
+    if (!coro_arena_setup()) goto cleanup;
+    if (!setup_stack_overflow_handler()) goto cleanup;
+    if (!coro_io_setup()) goto cleanup;
 
     return true;
 
@@ -65,44 +205,108 @@ cleanup:
 }
 
 /*!
- * Setups up a context stack
- *
- * @details allocates a buffer for the stack and registers it with sigaltstack
- *
- * @param stack [out]
+ * Sets up a SIGSEGV handler, which reports faults on coroutine stacks' guard pages
  *
  * @return true on success, false otherwise
+ *
+ * @note the handler runs on the alternate stack each worker sets up for its thread
  */
-bool setup_context_stack(stack_t *stack)
+bool setup_stack_overflow_handler()
 {
-    assert(stack != NULL);
-
-    if ((stack->ss_sp = calloc(SIGSTKSZ, sizeof(char))) == NULL) HANDLE_ERROR("calloc: ", { goto cleanup; });
-    stack->ss_size = SIGSTKSZ;
-    stack->ss_flags = 0;
-    if (sigaltstack(stack, NULL) != 0) HANDLE_ERROR("sigalt_stack: ", { goto cleanup; });
+    struct sigaction action = {.sa_sigaction = stack_overflow_handler, .sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND};
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, NULL) != 0) HANDLE_ERROR("sigaction: ", { return false; });
 
     return true;
+}
 
-cleanup:
-    free_and_null(&stack->ss_sp);
+/*!
+ * Restores the default SIGSEGV disposition
+ */
+void cleanup_stack_overflow_handler()
+{
+    signal(SIGSEGV, SIG_DFL);
+}
 
-    return false;
+/*!
+ * Reports a coroutine stack overflow, then lets the fault be raised again with the default disposition
+ */
+void stack_overflow_handler(int sig, siginfo_t *info, void *ucontext)
+{
+    static const char msg[] = "coroutine stack overflow\n";
+
+    worker *worker = this_worker;
+    if ((worker != NULL) && (worker->curr != NULL) && coro_stack_guard_hit(&worker->curr->stack, info->si_addr)) {
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    }
 }
+
 /*!
  * Cleans up the scheduler
  */
 void scheduler_cleanup()
 {
     if (scheduler.coro_pool != NULL) {
-        for (size_t i = 1; i < scheduler.coro_pool_sz; ++i) {
-            free_and_null(&scheduler.coro_pool[i].ctx.uc_stack.ss_sp);
+        for (size_t i = 0; i < scheduler.coro_pool_sz; ++i) {
+            coro_stack_release(&scheduler.coro_pool[i].stack);
         }
     }
 
+    while (scheduler.spawned != NULL) {
+        coro *spawned = scheduler.spawned;
+        scheduler.spawned = spawned->spawned_next;
+
+        coro_stack_release(&spawned->stack);
+        free(spawned);
+    }
+    scheduler.free_coros = NULL;
+
+    coro_io_cleanup();
+    cleanup_stack_overflow_handler();
+    if (scheduler.preemptive) {
+        signal(SIGALRM, SIG_DFL);
+        scheduler.preemptive = false;
+    }
+    coro_stack_pool_cleanup();
+    coro_arena_cleanup();
     free_and_null((void **) &scheduler.coro_pool);
 }
 
+/*!
+ * Enables preemption: each worker gets a timer ticking twice per time quantum, and the next coro_yield() after a tick
+ * passes control to next coroutine once the time quota has been exceeded
+ *
+ * @details coro_yield() calls remain the only points where coroutines get switched, the timer replaces the yield budget
+ * and the clock reads of cooperative scheduling: between ticks coro_yield() only checks a flag
+ *
+ * @return true on success, false otherwise
+ *
+ * @note must be called before running the scheduler
+ */
+bool scheduler_enable_preemption()
+{
+    struct sigaction action = {.sa_handler = preemption_handler, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGALRM, &action, NULL) != 0) HANDLE_ERROR("sigaction: ", { return false; });
+
+    scheduler.preemptive = true;
+
+    return true;
+}
+
+/*!
+ * Handles a tick of a worker's preemption timer by flagging it for the next coro_yield()
+ *
+ * @note the handler only stores to a sig_atomic_t, since the scheduler itself isn't async-signal-safe
+ */
+void preemption_handler(int sig)
+{
+    worker *worker = this_worker;
+    if (worker == NULL) return;
+
+    worker->preemption_tick = 1;
+}
+
 /*!
  * Registers the entry point for coroutines
  *
@@ -110,31 +314,161 @@ void scheduler_cleanup()
  */
 void scheduler_register_coro_entry_point(ctx_entry_point_func_t func)
 {
-    for (size_t i = 1; i < scheduler.coro_pool_sz; ++i) {
-        makecontext(&scheduler.coro_pool[i].ctx, func, 0);
-    }
+    scheduler.entry_point = func;
 }
 
 /*!
- * Runs the scheduler, executing the coroutines and waiting for the to finish
+ * Runs the scheduler on the calling thread, executing the coroutines and waiting for the to finish
  *
  * @return true on success, false otherwise
  */
 bool scheduler_run()
 {
-    scheduler.running = true;
-    coro_park();
-    scheduler.running = false;
+    return scheduler_run_workers(1);
+}
+
+/*!
+ * Runs the scheduler in M:N mode, executing the coroutines on n_workers threads and waiting for them to finish
+ *
+ * @details the calling thread becomes one of the workers; coroutines are initially spread among the workers' run
+ * queues round-robin, then each worker runs its own queue and steals from the others' when it runs out of coroutines
+ * @details there may be more workers than coroutines in the pool, the extra ones steal coroutines spawned meanwhile
+ *
+ * @param n_workers [in] number of workers
+ *
+ * @return true on success, false otherwise
+ */
+bool scheduler_run_workers(size_t n_workers)
+{
+    assert(scheduler.entry_point != NULL);
+
+    if (n_workers == 0) n_workers = 1;
+
+    size_t coros_per_worker = (scheduler.coro_pool_sz + n_workers - 1) / n_workers;
+    scheduler.time_quanta = coro_clock_us_to_ticks(scheduler.target_latency / (double) ((coros_per_worker != 0) ? coros_per_worker : 1));
+
+    if ((scheduler.workers = calloc(n_workers, sizeof(*scheduler.workers))) == NULL) HANDLE_ERROR("calloc: ", { return false; });
+    scheduler.n_workers = n_workers;
+    for (size_t i = 0; i < n_workers; ++i) {
+        atomic_flag_clear(&scheduler.workers[i].run_queue.lock);
+        scheduler.workers[i].steal_seed = (unsigned) i + 1;
+    }
+
+    for (size_t i = 0; i < scheduler.coro_pool_sz; ++i) {
+        run_queue_push(&scheduler.workers[i % n_workers].run_queue, &scheduler.coro_pool[i]);
+    }
+
+    size_t n_threads = 1;
+    for (; n_threads < n_workers; ++n_threads) {
+        errno = pthread_create(&scheduler.workers[n_threads].thread, NULL, worker_main, &scheduler.workers[n_threads]);
+        if (errno != 0) {
+            HANDLE_ERROR("pthread_create: ", {
+                atomic_store(&scheduler.err, true);
+                atomic_store(&scheduler.semaphore, 0);
+                coro_io_notify();
+                break;
+            });
+        }
+    }
+
+    worker_main(&scheduler.workers[0]);
+
+    for (size_t i = 1; i < n_threads; ++i) {
+        pthread_join(scheduler.workers[i].thread, NULL);
+    }
+
+    free_and_null((void **) &scheduler.workers);
+    scheduler.n_workers = 0;
+
+    return !atomic_load(&scheduler.err);
+}
+
+/*!
+ * Writes the metrics of the scheduler's coroutine pool as JSON
+ *
+ * @details the document holds the scheduler's target latency and time quantum, the upper bounds of the buckets of the
+ * slice histograms, and an array of the coroutines' metrics (see coro_metrics) along with their execution times and
+ * numbers of passes of control, all the times in microseconds
+ *
+ * @param file [in, out] file to write to
+ *
+ * @return true on success, false otherwise
+ *
+ * @note spawned coroutines are not included, their metrics are reset as they are recycled
+ * @attention must be called outside of the scheduler, between running it and cleaning it up
+ */
+bool scheduler_write_metrics(FILE *file)
+{
+    assert(file != NULL);
+    assert(this_worker == NULL);
+
+    fprintf(file, "{\n  \"target_latency_us\": %.17g,\n  \"time_quantum_us\": %.17g,\n  \"slice_bucket_bounds_us\": [",
+            scheduler.target_latency, coro_clock_ticks_to_us(scheduler.time_quanta));
+    for (size_t i = 0; i < CORO_SLICE_BUCKETS; ++i) {
+        if (i + 1 < CORO_SLICE_BUCKETS) {
+            fprintf(file, "%s%llu", (i != 0) ? ", " : "", 1ULL << i);
+        } else {
+            fprintf(file, ", null");
+        }
+    }
+    fprintf(file, "],\n  \"coroutines\": [\n");
+
+    for (size_t i = 0; i < scheduler.coro_pool_sz; ++i) {
+        coro_metrics_write(file, &scheduler.coro_pool[i], i + 1 == scheduler.coro_pool_sz);
+    }
+    fprintf(file, "  ]\n}\n");
+
+    if (ferror(file)) {
+        errno = EIO;
+        HANDLE_ERROR("scheduler_write_metrics: ", { return false; });
+    }
+
+    return true;
+}
+
+/*!
+ * Writes a coroutine's metrics as a JSON object, an element of the array of coroutines
+ *
+ * @param file [in, out]
+ * @param coro [in]
+ * @param last [in] whether it's the last element of the array
+ */
+void coro_metrics_write(FILE *file, const coro *coro, bool last)
+{
+    const coro_metrics *metrics = &coro->metrics;
+
+    size_t high_water = coro_stack_high_water(&coro->stack);
+    if (high_water < metrics->stack_high_water) high_water = metrics->stack_high_water;
+
+    fprintf(file, "    {\n      \"id\": %zu,\n      \"exec_time_us\": %.17g,\n      \"times_passed_control\": %u,\n",
+            (size_t) (coro - scheduler.coro_pool) + 1, coro->exec_time, coro->times_passed_control);
+
+    fprintf(file, "      \"slice_histogram\": [");
+    for (size_t i = 0; i < CORO_SLICE_BUCKETS; ++i) {
+        fprintf(file, "%s%lu", (i != 0) ? ", " : "", metrics->slice_histogram[i]);
+    }
+    fprintf(file, "],\n");
 
-    return !scheduler.err;
+    fprintf(file,
+            "      \"runnable_time_us\": %.17g,\n"
+            "      \"waiting_time_us\": %.17g,\n"
+            "      \"voluntary_switches\": %lu,\n"
+            "      \"preempted_switches\": %lu,\n"
+            "      \"max_resume_latency_us\": %.17g,\n"
+            "      \"stack_high_water_bytes\": %zu\n"
+            "    }%s\n",
+            metrics->runnable_time, metrics->waiting_time, metrics->n_voluntary_switches, metrics->n_preempted_switches,
+            metrics->max_resume_latency, high_water, last ? "" : ",");
 }
 
 /*!
- * @return current active coroutine
+ * @return current active coroutine, NULL outside of the scheduler
  */
 coro *scheduler_curr_coro()
 {
-    return &scheduler.coro_pool[scheduler.curr_coro_id];
+    worker *worker = curr_worker();
+
+    return (worker != NULL) ? worker->curr : NULL;
 }
 
 /*!
@@ -142,118 +476,1134 @@ coro *scheduler_curr_coro()
  */
 coro *scheduler_coro_pool()
 {
-    return scheduler.coro_pool + 1;
+    return scheduler.coro_pool;
+}
+
+/*!
+ * Pushes a coroutine to the tail of a list
+ *
+ * @param list [in, out]
+ * @param coro [in]
+ */
+void coro_list_push(coro_list *list, coro *coro)
+{
+    assert(list != NULL);
+    assert(coro != NULL);
+
+    coro->next = NULL;
+    coro->prev = list->tail;
+    if (list->tail != NULL) {
+        list->tail->next = coro;
+    } else {
+        list->head = coro;
+    }
+    list->tail = coro;
+    ++list->len;
 }
 
 /*!
- * Initially parks the scheduler's auxiliary, then all the rest of the coroutines get parked here, when they are done
+ * Pops a coroutine from the head of a list
+ *
+ * @param list [in, out]
+ *
+ * @return coroutine popped, NULL if the list is empty
  */
-void coro_park()
+coro *coro_list_pop(coro_list *list)
 {
-    static volatile bool once = false;
+    assert(list != NULL);
 
-    if (!once) {
-        once = true;
+    coro *coro = list->head;
+    if (coro != NULL) coro_list_remove(list, coro);
 
-        if (getcontext(&scheduler.coro_pool[0].ctx) != 0) HANDLE_ERROR("getcontext: ", { goto error; });
+    return coro;
+}
+
+/*!
+ * Removes a coroutine from a list
+ *
+ * @param list [in, out]
+ * @param coro [in, out] coroutine in the list
+ */
+void coro_list_remove(coro_list *list, coro *coro)
+{
+    assert(list != NULL);
+    assert(coro != NULL);
+
+    if (coro->prev != NULL) {
+        coro->prev->next = coro->next;
+    } else {
+        list->head = coro->next;
+    }
+    if (coro->next != NULL) {
+        coro->next->prev = coro->prev;
+    } else {
+        list->tail = coro->prev;
     }
+    coro->next = coro->prev = NULL;
+    --list->len;
+}
+
+/*!
+ * Moves all the coroutines of another list to the tail of a list
+ *
+ * @param list  [in, out]
+ * @param other [in, out] list emptied
+ */
+void coro_list_append(coro_list *list, coro_list *other)
+{
+    assert(list != NULL);
+    assert(other != NULL);
 
-    while (scheduler.semaphore) {
-        coro_pass_control();
+    if (other->head == NULL) return;
+
+    other->head->prev = list->tail;
+    if (list->tail != NULL) {
+        list->tail->next = other->head;
+    } else {
+        list->head = other->head;
     }
+    list->tail = other->tail;
+    list->len += other->len;
 
-error:
-    scheduler.err = false;
+    *other = (coro_list) {.head = NULL, .tail = NULL, .len = 0};
 }
 
 /*!
- * Indicate that a coroutine is done
+ * Acquires a spinlock
+ *
+ * @param lock [in, out]
  */
-void coro_done()
+void spin_lock(atomic_flag *lock)
 {
-    coro *this = scheduler_curr_coro();
-    assert(this != NULL);
+    while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {
+        sched_yield();
+    }
+}
 
-    --scheduler.semaphore;
-    this->done = true;
-    this->exec_time += time_elapsed_since_last_invocation();
+/*!
+ * Releases a spinlock
+ *
+ * @param lock [in, out]
+ */
+void spin_unlock(atomic_flag *lock)
+{
+    atomic_flag_clear_explicit(lock, memory_order_release);
 }
 
 /*!
- * Unconditionally passes control to next coroutine
+ * Pushes a coroutine to the tail of a run queue
+ *
+ * @param run_queue [in, out]
+ * @param coro      [in]
  */
-void coro_suspend()
+void run_queue_push(run_queue *run_queue, coro *coro)
+{
+    assert(run_queue != NULL);
+
+    spin_lock(&run_queue->lock);
+    coro_list_push(&run_queue->coros, coro);
+    spin_unlock(&run_queue->lock);
+}
+
+/*!
+ * Pops a coroutine from the head of a run queue
+ *
+ * @param run_queue [in, out]
+ *
+ * @return coroutine popped, NULL if the queue is empty
+ */
+coro *run_queue_pop(run_queue *run_queue)
 {
-    if (!scheduler.running) return;
+    assert(run_queue != NULL);
 
-    scheduler_curr_coro()->exec_time += time_elapsed_since_last_invocation();
+    spin_lock(&run_queue->lock);
+    coro *coro = coro_list_pop(&run_queue->coros);
+    spin_unlock(&run_queue->lock);
 
-    coro_pass_control();
+    return coro;
 }
 
 /*!
- * Passes control to next coroutine is the current one's time quota has been exceeded
+ * Steals up to a half of a run queue from its head
+ *
+ * @param run_queue [in, out]
+ *
+ * @return list of coroutines stolen
  */
-void coro_yield()
+coro_list run_queue_steal(run_queue *run_queue)
 {
-    if (!scheduler.running) return;
+    assert(run_queue != NULL);
+
+    coro_list stolen = {.head = NULL, .tail = NULL, .len = 0};
+
+    spin_lock(&run_queue->lock);
+    size_t n_stolen = (run_queue->coros.len + 1) / 2;
+    if (n_stolen != 0) {
+        coro *last = run_queue->coros.head;
+        for (size_t i = 1; i < n_stolen; ++i) {
+            last = last->next;
+        }
 
-    double time_elapsed = time_elapsed_since_last_invocation();
-    if (time_elapsed >= scheduler.time_quanta) {
-        scheduler_curr_coro()->exec_time += time_elapsed;
+        stolen.head = run_queue->coros.head;
+        stolen.tail = last;
+        stolen.len = n_stolen;
 
-        coro_pass_control();
+        run_queue->coros.head = last->next;
+        if (run_queue->coros.head != NULL) {
+            run_queue->coros.head->prev = NULL;
+        } else {
+            run_queue->coros.tail = NULL;
+        }
+        run_queue->coros.len -= n_stolen;
+        last->next = NULL;
     }
+    spin_unlock(&run_queue->lock);
+
+    return stolen;
+}
+
+/*!
+ * @return worker run by the current thread, NULL outside of the scheduler
+ *
+ * @note coroutines can migrate to another thread across any switch, so the compiler must not reuse the thread pointer
+ * it computed before a switch, hence the access is kept out of line
+ */
+__attribute__((noinline)) worker *curr_worker()
+{
+    __asm__ volatile("" ::: "memory");
+
+    return this_worker;
 }
 
 /*!
- * @return time elapsed since the last time control was switched to the current coroutine
+ * Runs a worker on the current thread until all the coroutines are done
+ *
+ * @param arg [in] worker
+ *
+ * @return NULL
  */
-double time_elapsed_since_last_invocation()
+void *worker_main(void *arg)
 {
-    struct timespec now;
-    timespec_get(&now, TIME_UTC);
+    worker *worker = arg;
+    assert(worker != NULL);
 
-    return (double) (now.tv_sec - scheduler.curr_coro_resume_time.tv_sec) * pow(10, 6) +
-           (double) (now.tv_nsec - scheduler.curr_coro_resume_time.tv_nsec) * pow(10, -3);
+    this_worker = worker;
+
+    if (worker_setup_sigaltstack(worker) && worker_setup_preemption_timer(worker)) {
+        worker_park(worker);
+    } else {
+        atomic_store(&scheduler.err, true);
+        atomic_store(&scheduler.semaphore, 0);
+        coro_io_notify();
+    }
+
+    worker_cleanup_preemption_timer(worker);
+    worker_cleanup_sigaltstack(worker);
+
+    this_worker = NULL;
+
+    return NULL;
 }
 
 /*!
- * Passes control to the next coroutine
+ * Sets up the alternate stack the stack overflow handler runs on
+ *
+ * @param worker [in, out]
+ *
+ * @return true on success, false otherwise
  */
-void coro_pass_control()
+bool worker_setup_sigaltstack(worker *worker)
 {
-    if (scheduler.err && (swapcontext(&scheduler_curr_coro()->ctx, &scheduler.coro_pool[0].ctx) != 0)) {
-        HANDLE_ERROR("swapcontext: ", { exit(EXIT_FAILURE); });
+    assert(worker != NULL);
+
+    if (!coro_stack_alloc(&worker->sigaltstack)) return false;
+
+    stack_t stack = {.ss_sp = worker->sigaltstack.base, .ss_size = worker->sigaltstack.sz, .ss_flags = 0};
+    if (sigaltstack(&stack, NULL) != 0) {
+        HANDLE_ERROR("sigaltstack: ", {
+            coro_stack_release(&worker->sigaltstack);
+            return false;
+        });
     }
 
-    ++scheduler_curr_coro()->times_passed_control;
+    return true;
+}
+
+/*!
+ * Disables and releases the alternate stack the stack overflow handler runs on
+ *
+ * @param worker [in, out]
+ */
+void worker_cleanup_sigaltstack(worker *worker)
+{
+    assert(worker != NULL);
+
+    if (worker->sigaltstack.base == NULL) return;
+
+    stack_t stack = {.ss_sp = NULL, .ss_size = 0, .ss_flags = SS_DISABLE};
+    if (sigaltstack(&stack, NULL) != 0) HANDLE_ERROR("sigaltstack: ", {});
+
+    coro_stack_release(&worker->sigaltstack);
+}
+
+/*!
+ * Sets up the timer preempting the worker's coroutines, if preemption is enabled
+ *
+ * @param worker [in, out]
+ *
+ * @return true on success, false otherwise
+ */
+bool worker_setup_preemption_timer(worker *worker)
+{
+    assert(worker != NULL);
+
+    if (!scheduler.preemptive) return true;
+
+    struct sigevent sigevent = {.sigev_notify = SIGEV_THREAD_ID, .sigev_signo = SIGALRM};
+    sigevent.sigev_notify_thread_id = gettid();
+    if (timer_create(CLOCK_MONOTONIC, &sigevent, &worker->preemption_timer) != 0) HANDLE_ERROR("timer_create: ", { return false; });
+    worker->preemption_timer_armed = true;
+
+    double period = coro_clock_ticks_to_us(scheduler.time_quanta) / 2;
+    if (period < MIN_PREEMPTION_PERIOD) period = MIN_PREEMPTION_PERIOD;
+
+    struct timespec interval = {.tv_sec = (time_t) (period / 1000000), .tv_nsec = (long) (period * 1000) % 1000000000};
+    struct itimerspec spec = {.it_interval = interval, .it_value = interval};
+    if (timer_settime(worker->preemption_timer, 0, &spec, NULL) != 0) HANDLE_ERROR("timer_settime: ", { return false; });
 
-    size_t prev_coro_id = scheduler.curr_coro_id;
+    return true;
+}
+
+/*!
+ * Deletes the timer preempting the worker's coroutines
+ *
+ * @param worker [in, out]
+ */
+void worker_cleanup_preemption_timer(worker *worker)
+{
+    assert(worker != NULL);
+
+    if (!worker->preemption_timer_armed) return;
+
+    if (timer_delete(worker->preemption_timer) != 0) HANDLE_ERROR("timer_delete: ", {});
+    worker->preemption_timer_armed = false;
+}
+
+/*!
+ * Initially parks the worker's auxiliary context, then coroutines get parked here when they are done or when there's
+ * no other coroutine to pass control to
+ *
+ * @param worker [in, out]
+ *
+ * @note a worker leaving the park wakes up the next idle one, so that all of them get to see the scheduler is done
+ */
+void worker_park(worker *worker)
+{
+    assert(worker != NULL);
 
-    for (size_t i = 1; i < scheduler.coro_pool_sz; ++i) {
-        scheduler.curr_coro_id = (scheduler.curr_coro_id + 1) % scheduler.coro_pool_sz;
-        if (!scheduler_curr_coro()->done) break;
+    while (atomic_load(&scheduler.semaphore) != 0) {
+        coro *next = worker_next_coro(worker);
+        if (next == NULL) {
+            worker_idle(worker);
+            continue;
+        }
+
+        if (!coro_switch(worker, &worker->park, next)) break;
+        coro_after_switch();
     }
 
-    coro *this = scheduler_curr_coro();
-    assert(this != NULL);
+    coro_io_notify();
+}
+
+/*!
+ * Picks the next coroutine to run, stealing from other workers if the worker's own run queue is empty
+ *
+ * @param worker [in, out]
+ *
+ * @return next coroutine to run, NULL if there's none
+ */
+coro *worker_next_coro(worker *worker)
+{
+    assert(worker != NULL);
 
-    if (timespec_get(&scheduler.curr_coro_resume_time, TIME_UTC) == 0) HANDLE_ERROR("timespec_get: ", { goto error; });
-    if (swapcontext(&scheduler.coro_pool[prev_coro_id].ctx, &this->ctx) != 0) HANDLE_ERROR("calloc: ", { goto error; });
+    coro_io_poll();
 
-    return;
+    coro *next = run_queue_pop(&worker->run_queue);
 
-error:
-    coro_error();
+    return (next != NULL) ? next : worker_steal(worker);
 }
 
 /*!
- * Sets the scheduler's semaphore to 0, causing immediate exit out of scheduler's park after passing control
+ * Steals coroutines from the first non-empty run queue of the other workers, starting from a random one
+ *
+ * @param thief [in, out] worker of the current thread
+ *
+ * @return coroutine to run next, the rest of the coroutines stolen are pushed to the thief's own run queue
  */
-void coro_error()
+coro *worker_steal(worker *thief)
 {
-    scheduler.err = true;
-    scheduler.semaphore = 0;
-    coro_pass_control();
+    assert(thief != NULL);
+
+    size_t victim_id = (size_t) rand_r(&thief->steal_seed);
+    for (size_t i = 0; i < scheduler.n_workers; ++i) {
+        worker *victim = &scheduler.workers[(victim_id + i) % scheduler.n_workers];
+        if (victim == thief) continue;
+
+        coro_list stolen = run_queue_steal(&victim->run_queue);
+        coro *next = coro_list_pop(&stolen);
+        if (next == NULL) continue;
+
+        if (stolen.len != 0) {
+            spin_lock(&thief->run_queue.lock);
+            coro_list_append(&thief->run_queue.coros, &stolen);
+            spin_unlock(&thief->run_queue.lock);
+        }
+
+        return next;
+    }
+
+    return NULL;
+}
+
+/*!
+ * Sleeps in the kernel while there's no coroutine to run, i.e. all of them are either running on other workers or
+ * blocked, until an I/O completion or a wakeup comes
+ *
+ * @details the worker announces itself idle before checking for runnable coroutines one last time, while coro_wake()
+ * checks for idle workers after pushing to a run queue, so either the worker sees the coroutine or it gets notified
+ *
+ * @param worker [in, out]
+ */
+void worker_idle(worker *worker)
+{
+    assert(worker != NULL);
+
+    atomic_fetch_add(&scheduler.n_idle, 1);
+    if ((atomic_load(&scheduler.semaphore) != 0) && !coro_io_poll() && !worker_runnable_exists()) coro_io_wait();
+    atomic_fetch_sub(&scheduler.n_idle, 1);
+}
+
+/*!
+ * @return whether any of the workers' run queues is non-empty
+ */
+bool worker_runnable_exists()
+{
+    for (size_t i = 0; i < scheduler.n_workers; ++i) {
+        run_queue *run_queue = &scheduler.workers[i].run_queue;
+
+        spin_lock(&run_queue->lock);
+        size_t len = run_queue->coros.len;
+        spin_unlock(&run_queue->lock);
+
+        if (len != 0) return true;
+    }
+
+    return false;
+}
+
+/*!
+ * Prepares a coroutine for its first run, taking a stack for it from the stack pool
+ *
+ * @param coro [in, out]
+ *
+ * @return true on success, false otherwise
+ */
+bool coro_start(coro *coro)
+{
+    assert(coro != NULL);
+
+    if (!coro_stack_alloc(&coro->stack)) return false;
+    if (!coro_ctx_init(&coro->ctx, coro->stack.base, coro->stack.sz, NULL)) return false;
+    coro_ctx_make(&coro->ctx, coro_main);
+
+    return true;
+}
+
+/*!
+ * Switches from the context being executed to a coroutine, starting it if it hasn't been run yet
+ *
+ * @param worker [in, out] worker of the current thread
+ * @param from   [out] context being executed
+ * @param to     [in] coroutine to switch to
+ *
+ * @return true on success, false otherwise (in which case the scheduler is stopped)
+ */
+bool coro_switch(worker *worker, coro_ctx *from, coro *to)
+{
+    assert(worker != NULL);
+    assert(from != NULL);
+    assert(to != NULL);
+
+    if ((to->stack.base == NULL) && !coro_start(to)) goto error;
+
+    worker->curr = to;
+    worker_start_slice(worker);
+    coro_metrics_resume(to, worker->curr_coro_resume_ticks);
+    if (!coro_ctx_switch(from, &to->ctx)) goto error;
+
+    return true;
+
+error:
+    atomic_store(&scheduler.err, true);
+    atomic_store(&scheduler.semaphore, 0);
+    coro_io_notify();
+
+    return false;
+}
+
+/*!
+ * Finishes a switch on behalf of the context switched away from, once its context is saved
+ */
+void coro_after_switch()
+{
+    worker *worker = curr_worker();
+    assert(worker != NULL);
+
+    if (worker->requeued != NULL) {
+        run_queue_push(&worker->run_queue, worker->requeued);
+        worker->requeued = NULL;
+    }
+
+    if (worker->blocked != NULL) {
+        coro_block_after_switch(worker->blocked);
+        worker->blocked = NULL;
+    }
+
+    if (worker->finished != NULL) {
+        coro_metrics *metrics = &worker->finished->metrics;
+        size_t high_water = coro_stack_high_water(&worker->finished->stack);
+        if (high_water > metrics->stack_high_water) metrics->stack_high_water = high_water;
+        coro_stack_release(&worker->finished->stack);
+        if (worker->finished->func != NULL) coro_exit_after_switch(worker->finished);
+        worker->finished = NULL;
+    }
+}
+
+/*!
+ * Entry point of all coroutines, running either the registered entry point or the spawned coroutine's function
+ *
+ * @note a spawned coroutine is done once its function returns, while a coroutine of the pool returning from the entry
+ * point without having called coro_done() fails the scheduler, since the scheduler would wait for it forever otherwise
+ */
+void coro_main()
+{
+    coro_after_switch();
+
+    coro *this = curr_worker()->curr;
+    if (this->func != NULL) {
+        this->func(this->arg);
+        coro_done();
+    } else {
+        scheduler.entry_point();
+        if (!this->done) coro_error();
+    }
+
+    coro_exit();
+}
+
+/*!
+ * Parks the current coroutine for good, its stack is released by the park
+ */
+void coro_exit()
+{
+    worker *worker = curr_worker();
+    assert(worker != NULL);
+
+    coro *this = worker->curr;
+    worker_end_slice(worker, false, false, false);
+    worker->curr = NULL;
+    worker->finished = this;
+    coro_ctx_switch(&this->ctx, &worker->park);
+
+    abort();
+}
+
+/*!
+ * Marks a spawned coroutine which has been parked for good as exited, waking up the coroutine joining it, if any
+ *
+ * @param coro [in, out] spawned coroutine, its stack already released
+ */
+void coro_exit_after_switch(coro *coro)
+{
+    assert(coro != NULL);
+
+    spin_lock(&scheduler.spawn_lock);
+    coro->exited = true;
+    struct coro *joiner = coro->joiner;
+    spin_unlock(&scheduler.spawn_lock);
+
+    if (joiner != NULL) coro_wake(joiner);
+}
+
+/*!
+ * Indicate that a coroutine is done
+ */
+void coro_done()
+{
+    worker *worker = curr_worker();
+    assert(worker != NULL);
+
+    coro *this = worker->curr;
+    assert(this != NULL);
+
+    if (atomic_fetch_sub(&scheduler.semaphore, 1) == 1) coro_io_notify();
+    this->done = true;
+    this->exec_time += time_elapsed_since_last_invocation(worker);
+}
+
+/*!
+ * Unconditionally passes control to next coroutine
+ */
+void coro_suspend()
+{
+    worker *worker = curr_worker();
+    if (worker == NULL) return;
+
+    worker->curr->exec_time += time_elapsed_since_last_invocation(worker);
+
+    coro_pass_control(false);
+}
+
+/*!
+ * Passes control to next coroutine is the current one's time quota has been exceeded
+ *
+ * @note only a yield budget is decremented here, the clock is read once the budget runs out or the preemption timer
+ * ticks
+ */
+void coro_yield()
+{
+    worker *worker = this_worker;
+    if ((worker == NULL) || ((--worker->yield_budget > 0) && !worker->preemption_tick)) return;
+
+    coro_yield_check(worker);
+}
+
+/*!
+ * Checks the current coroutine's time quota once its yield budget has run out or the preemption timer has ticked,
+ * passing control to next coroutine if the quota has been exceeded, refilling the budget otherwise
+ *
+ * @details the coroutine's rate of yields is measured over its time slice so far, and the budget is refilled with
+ * the number of yields expected in a half of the time left in the slice: the clock gets read a few times per slice,
+ * as the budget shrinks towards the end of the slice, yet it's read before the slice is over as long as the rate
+ * doesn't drop more than twice
+ *
+ * @param worker [in, out] worker of the current thread
+ */
+void coro_yield_check(worker *worker)
+{
+    coro *this = worker->curr;
+    assert(this != NULL);
+
+    bool ticked = worker->preemption_tick;
+    worker->preemption_tick = 0;
+
+    uint64_t elapsed = coro_clock_ticks() - worker->curr_coro_resume_ticks;
+    worker->yields_in_slice += worker->yield_budget_granted - worker->yield_budget;
+    if (elapsed != 0) this->yields_per_tick = (double) worker->yields_in_slice / (double) elapsed;
+
+    if (elapsed >= scheduler.time_quanta) {
+        this->exec_time += coro_clock_ticks_to_us(elapsed);
+
+        coro_pass_control(ticked);
+    } else {
+        worker_refill_yield_budget(worker, scheduler.time_quanta - elapsed);
+    }
+}
+
+/*!
+ * Starts a time slice of the worker's current coroutine
+ *
+ * @param worker [in, out]
+ */
+void worker_start_slice(worker *worker)
+{
+    assert(worker != NULL);
+
+    worker->curr_coro_resume_ticks = coro_clock_ticks();
+    worker->yields_in_slice = 0;
+    worker_refill_yield_budget(worker, scheduler.time_quanta);
+}
+
+/*!
+ * Refills the yield budget of the worker's current coroutine
+ *
+ * @details with preemption the budget is unlimited, it's the timer which makes coro_yield() read the clock
+ *
+ * @param worker     [in, out]
+ * @param ticks_left [in] time left in the current time slice
+ */
+void worker_refill_yield_budget(worker *worker, uint64_t ticks_left)
+{
+    assert(worker != NULL);
+    assert(worker->curr != NULL);
+
+    if (scheduler.preemptive) {
+        worker->yield_budget = LONG_MAX;
+        worker->yield_budget_granted = worker->yield_budget;
+
+        return;
+    }
+
+    double budget = worker->curr->yields_per_tick * (double) ticks_left / 2;
+    if (budget < 1) {
+        worker->yield_budget = 1;
+    } else if (budget > (double) LONG_MAX) {
+        worker->yield_budget = LONG_MAX;
+    } else {
+        worker->yield_budget = (long) budget;
+    }
+    worker->yield_budget_granted = worker->yield_budget;
+}
+
+/*!
+ * @param worker [in] worker of the current thread
+ *
+ * @return time elapsed since the last time control was switched to the current coroutine, in microseconds
+ */
+double time_elapsed_since_last_invocation(worker *worker)
+{
+    return coro_clock_ticks_to_us(coro_clock_ticks() - worker->curr_coro_resume_ticks);
+}
+
+/*!
+ * Records the end of the current coroutine's time slice in its metrics
+ *
+ * @param worker    [in] worker of the current thread
+ * @param switched  [in] whether the coroutine is being switched away from, rather than exiting
+ * @param blocked   [in] whether it's blocking, rather than staying runnable
+ * @param preempted [in] whether it's being preempted
+ */
+void worker_end_slice(worker *worker, bool switched, bool blocked, bool preempted)
+{
+    coro *this = worker->curr;
+    assert(this != NULL);
+
+    uint64_t now = coro_clock_ticks();
+    double slice = coro_clock_ticks_to_us(now - worker->curr_coro_resume_ticks);
+
+    size_t bucket = 0;
+    if (slice >= 1) bucket = (size_t) (64 - __builtin_clzll((unsigned long long) slice));
+    if (bucket >= CORO_SLICE_BUCKETS) bucket = CORO_SLICE_BUCKETS - 1;
+    ++this->metrics.slice_histogram[bucket];
+
+    if (!switched) return;
+
+    this->suspend_ticks = now;
+    this->suspend_blocked = blocked;
+    if (preempted) {
+        ++this->metrics.n_preempted_switches;
+    } else {
+        ++this->metrics.n_voluntary_switches;
+    }
+}
+
+/*!
+ * Records in a coroutine's metrics how long it was suspended, as it's being resumed
+ *
+ * @param coro [in, out]
+ * @param now  [in] time of the resumption, in ticks
+ */
+void coro_metrics_resume(coro *coro, uint64_t now)
+{
+    if (coro->suspend_ticks == 0) return;
+
+    double suspended = coro_clock_ticks_to_us(now - coro->suspend_ticks);
+    coro->suspend_ticks = 0;
+
+    if (coro->suspend_blocked) {
+        coro->metrics.waiting_time += suspended;
+    } else {
+        coro->metrics.runnable_time += suspended;
+        if (suspended > coro->metrics.max_resume_latency) coro->metrics.max_resume_latency = suspended;
+    }
+}
+
+/*!
+ * Blocks the current coroutine, keeping it off the run queues until coro_wake() is called on it
+ *
+ * @note a wakeup which comes before the coroutine blocks isn't lost: coro_block() returns right away then
+ */
+void coro_block()
+{
+    worker *worker = curr_worker();
+    assert(worker != NULL);
+
+    coro *this = worker->curr;
+    assert(this != NULL);
+
+    this->exec_time += time_elapsed_since_last_invocation(worker);
+    ++this->times_passed_control;
+
+    if (atomic_load(&scheduler.err)) coro_error();
+
+    worker->blocked = this;
+    worker_end_slice(worker, true, true, false);
+
+    coro *next = worker_next_coro(worker);
+    if (next == NULL) {
+        worker->curr = NULL;
+        coro_ctx_switch(&this->ctx, &worker->park);
+    } else if (!coro_switch(worker, &this->ctx, next)) {
+        run_queue_push(&worker->run_queue, next);
+        worker->blocked = NULL;
+        worker->curr = this;
+
+        coro_error();
+    }
+    coro_after_switch();
+}
+
+/*!
+ * Moves a blocked coroutine to the blocked set, or straight back to the run queue if it has been woken up meanwhile
+ *
+ * @param coro [in, out] coroutine which has blocked
+ */
+void coro_block_after_switch(coro *coro)
+{
+    assert(coro != NULL);
+
+    spin_lock(&scheduler.blocked_lock);
+    bool woken = coro->wakeup_pending;
+    if (woken) {
+        coro->wakeup_pending = false;
+    } else {
+        coro->blocked = true;
+        coro_list_push(&scheduler.blocked, coro);
+    }
+    spin_unlock(&scheduler.blocked_lock);
+
+    if (woken) run_queue_push(&curr_worker()->run_queue, coro);
+}
+
+/*!
+ * Wakes up a coroutine, moving it from the blocked set to the run queue of the current worker
+ *
+ * @param coro [in, out]
+ *
+ * @note if the coroutine hasn't blocked yet, its next coro_block() returns right away
+ * @note can be called outside of the scheduler as well, in which case the coroutine is moved to the first worker's
+ * run queue
+ * @note an idle worker is notified, so that the coroutine doesn't wait for a busy worker to get to it
+ */
+void coro_wake(coro *coro)
+{
+    assert(coro != NULL);
+
+    spin_lock(&scheduler.blocked_lock);
+    bool blocked = coro->blocked;
+    if (blocked) {
+        coro->blocked = false;
+        coro_list_remove(&scheduler.blocked, coro);
+    } else {
+        coro->wakeup_pending = true;
+    }
+    spin_unlock(&scheduler.blocked_lock);
+
+    if (!blocked) return;
+
+    worker *worker = curr_worker();
+    run_queue_push(&((worker != NULL) ? worker : &scheduler.workers[0])->run_queue, coro);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&scheduler.n_idle) != 0) coro_io_notify();
+}
+
+/*!
+ * Passes control to the next coroutine, keeping the current one running if there's no other coroutine to run
+ *
+ * @param preempted [in] whether the current coroutine is being preempted
+ */
+void coro_pass_control(bool preempted)
+{
+    worker *worker = curr_worker();
+    assert(worker != NULL);
+
+    coro *this = worker->curr;
+    assert(this != NULL);
+
+    ++this->times_passed_control;
+
+    if (atomic_load(&scheduler.err)) coro_error();
+
+    coro *next = worker_next_coro(worker);
+    if (next == NULL) {
+        worker_start_slice(worker);
+
+        return;
+    }
+
+    worker->requeued = this;
+    worker_end_slice(worker, true, false, preempted);
+    if (!coro_switch(worker, &this->ctx, next)) {
+        run_queue_push(&worker->run_queue, next);
+        worker->requeued = NULL;
+        worker->curr = this;
+
+        coro_error();
+    }
+    coro_after_switch();
+}
+
+/*!
+ * Sets the scheduler's semaphore to 0, causing immediate exit out of the workers' parks, and parks the current
+ * coroutine for good
+ */
+void coro_error()
+{
+    atomic_store(&scheduler.err, true);
+    atomic_store(&scheduler.semaphore, 0);
+    coro_io_notify();
+
+    worker *worker = curr_worker();
+    assert(worker != NULL);
+
+    coro *this = worker->curr;
+    worker->curr = NULL;
+    coro_ctx_switch(&this->ctx, &worker->park);
+
+    abort();
+}
+
+/*!
+ * Spawns a coroutine running a function, pushing it to the current worker's run queue
+ *
+ * @details coroutine objects are recycled through a free-list once joined and stacks come from the stack pool, so in
+ * steady state spawning allocates nothing
+ *
+ * @param func [in] function the coroutine runs, the coroutine is done once it returns
+ * @param arg  [in] argument passed to func
+ *
+ * @return join handle of the coroutine, NULL on failure
+ *
+ * @attention must be called from a coroutine; the spawned coroutine must not call coro_done() and must be joined with
+ * coro_join(), which invalidates the handle
+ */
+coro *coro_spawn(coro_func_t func, void *arg)
+{
+    assert(func != NULL);
+
+    worker *worker = curr_worker();
+    assert(worker != NULL);
+
+    spin_lock(&scheduler.spawn_lock);
+    coro *spawned = scheduler.free_coros;
+    if (spawned != NULL) scheduler.free_coros = spawned->next;
+    spin_unlock(&scheduler.spawn_lock);
+
+    bool fresh = (spawned == NULL);
+    if (fresh && ((spawned = malloc(sizeof(*spawned))) == NULL)) HANDLE_ERROR("malloc: ", { return NULL; });
+
+    *spawned = (coro) {.func = func, .arg = arg, .spawned_next = fresh ? NULL : spawned->spawned_next};
+    if (fresh) {
+        spin_lock(&scheduler.spawn_lock);
+        spawned->spawned_next = scheduler.spawned;
+        scheduler.spawned = spawned;
+        spin_unlock(&scheduler.spawn_lock);
+    }
+
+    atomic_fetch_add(&scheduler.semaphore, 1);
+    run_queue_push(&worker->run_queue, spawned);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&scheduler.n_idle) != 0) coro_io_notify();
+
+    return spawned;
+}
+
+/*!
+ * Blocks the current coroutine until a spawned coroutine exits, then recycles the latter
+ *
+ * @param coro [in, out] join handle returned by coro_spawn()
+ */
+void coro_join(coro *coro)
+{
+    assert(coro != NULL);
+    assert(coro->func != NULL);
+
+    struct coro *this = scheduler_curr_coro();
+    assert(this != NULL);
+
+    while (true) {
+        spin_lock(&scheduler.spawn_lock);
+        bool exited = coro->exited;
+        if (exited) {
+            coro->next = scheduler.free_coros;
+            scheduler.free_coros = coro;
+        } else {
+            coro->joiner = this;
+        }
+        spin_unlock(&scheduler.spawn_lock);
+
+        if (exited) return;
+
+        coro_block();
+    }
+}
+
+/*!
+ * Initializes a channel
+ *
+ * @param chan     [out]
+ * @param elem_sz  [in] size of each element
+ * @param capacity [in] number of elements the channel holds before senders get suspended, at least 1
+ *
+ * @return true on success, false otherwise
+ */
+bool coro_chan_init(coro_chan *chan, size_t elem_sz, size_t capacity)
+{
+    assert(chan != NULL);
+    assert(elem_sz != 0);
+    assert(capacity != 0);
+
+    *chan = (coro_chan) {.elem_sz = elem_sz, .capacity = capacity};
+    atomic_flag_clear(&chan->lock);
+
+    if ((chan->buf = malloc(elem_sz * capacity)) == NULL) HANDLE_ERROR("malloc: ", { return false; });
+
+    return true;
+}
+
+/*!
+ * Destroys a channel, dropping the elements left in it
+ *
+ * @param chan [in, out]
+ *
+ * @attention no coroutine may be waiting on the channel
+ */
+void coro_chan_destroy(coro_chan *chan)
+{
+    assert(chan != NULL);
+    assert((chan->senders == NULL) && (chan->receivers == NULL));
+
+    free_and_null((void **) &chan->buf);
+}
+
+/*!
+ * Sends an element to a channel, suspending the current coroutine while the channel is full
+ *
+ * @param chan [in, out]
+ * @param elem [in] element of the channel's element size, copied into the channel
+ *
+ * @return true on success, false if the channel is closed
+ */
+bool coro_chan_send(coro_chan *chan, const void *elem)
+{
+    assert(chan != NULL);
+    assert(elem != NULL);
+
+    spin_lock(&chan->lock);
+    while (!chan->closed && (chan->len == chan->capacity)) {
+        coro_chan_wait(chan, &chan->senders);
+    }
+
+    bool sent = !chan->closed;
+    if (sent) {
+        size_t tail = (chan->head + chan->len) % chan->capacity;
+        memcpy(chan->buf + tail * chan->elem_sz, elem, chan->elem_sz);
+        ++chan->len;
+        coro_chan_wake(&chan->receivers);
+    }
+    spin_unlock(&chan->lock);
+
+    return sent;
+}
+
+/*!
+ * Receives an element from a channel, suspending the current coroutine while the channel is empty
+ *
+ * @param chan [in, out]
+ * @param elem [out] buffer of the channel's element size
+ *
+ * @return true on success, false if the channel is closed and there's nothing left in it
+ */
+bool coro_chan_recv(coro_chan *chan, void *elem)
+{
+    assert(chan != NULL);
+    assert(elem != NULL);
+
+    spin_lock(&chan->lock);
+    while (!chan->closed && (chan->len == 0)) {
+        coro_chan_wait(chan, &chan->receivers);
+    }
+
+    bool received = (chan->len != 0);
+    if (received) {
+        memcpy(elem, chan->buf + chan->head * chan->elem_sz, chan->elem_sz);
+        chan->head = (chan->head + 1) % chan->capacity;
+        --chan->len;
+        coro_chan_wake(&chan->senders);
+    }
+    spin_unlock(&chan->lock);
+
+    return received;
+}
+
+/*!
+ * Closes a channel: sending to it fails from now on, receiving fails once the elements left in it are received
+ *
+ * @param chan [in, out]
+ *
+ * @note all the coroutines waiting on the channel are woken up
+ */
+void coro_chan_close(coro_chan *chan)
+{
+    assert(chan != NULL);
+
+    spin_lock(&chan->lock);
+    chan->closed = true;
+    while (chan->senders != NULL) {
+        coro_chan_wake(&chan->senders);
+    }
+    while (chan->receivers != NULL) {
+        coro_chan_wake(&chan->receivers);
+    }
+    spin_unlock(&chan->lock);
+}
+
+/*!
+ * Suspends the current coroutine in a channel's queue of waiters until it's woken up
+ *
+ * @details the waiter is linked into the tail of the queue from the coroutine's stack and the channel's lock is
+ * dropped while the coroutine is blocked; a coroutine woken up for a reason other than the channel unlinks itself
+ *
+ * @param chan  [in, out] channel, locked by the caller
+ * @param queue [in, out] channel's queue of senders or receivers
+ */
+void coro_chan_wait(coro_chan *chan, coro_chan_waiter **queue)
+{
+    coro_chan_waiter waiter = {.coro = scheduler_curr_coro(), .next = NULL, .woken = false};
+    assert(waiter.coro != NULL);
+
+    coro_chan_waiter **link = queue;
+    while (*link != NULL) {
+        link = &(*link)->next;
+    }
+    *link = &waiter;
+
+    spin_unlock(&chan->lock);
+    coro_block();
+    spin_lock(&chan->lock);
+
+    if (waiter.woken) return;
+
+    link = queue;
+    while (*link != &waiter) {
+        link = &(*link)->next;
+    }
+    *link = waiter.next;
+}
+
+/*!
+ * Wakes up the first coroutine of a channel's queue of waiters, if any
+ *
+ * @param queue [in, out] channel's queue of senders or receivers, its channel locked by the caller
+ */
+void coro_chan_wake(coro_chan_waiter **queue)
+{
+    coro_chan_waiter *waiter = *queue;
+    if (waiter == NULL) return;
+
+    *queue = waiter->next;
+    waiter->woken = true;
+    coro_wake(waiter->coro);
 }
@@ -1,38 +1,118 @@
 #ifndef CORO_H
 #define CORO_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <ucontext.h>
 
+#include "coro_ctx.h"
+#include "coro_stack.h"
 #include "merge_sort.h"
 
-/*!
- * Alias for context entry point function
- */
-typedef void (*ctx_entry_point_func_t)(void);
-
 #include "coro_data.h"
 #ifndef CORO_DATA
 #err "the parameters that coroutines receive must be specified by defining an anonymous struct as CORO_DATA in coro_data.h"
 #endif
 
 /*!
- * Abstract coroutine which the scheduler is based on
+ * Number of buckets of the histogram of time slice lengths
+ */
+enum { CORO_SLICE_BUCKETS = 16 };
+
+/*!
+ * Scheduling measurements of a coroutine, times in microseconds
+ *
+ * @details bucket 0 of the slice histogram counts slices shorter than 1 microsecond, bucket i counts slices from
+ * 2^(i-1) to 2^i microseconds, the last one counts all the longer ones too
+ * @details a coroutine is runnable while it waits in a run queue and waiting while it's blocked (on I/O, a channel, a
+ * join); the resume latency is how long it stayed runnable before being resumed
+ * @details a switch is voluntary when the coroutine yields past its time quota or blocks, and preempted when it yields
+ * on a tick of the scheduler's preemption timer
+ * @details the stack high-water mark is the depth of the lowest committed page of the stack, measured when the stack
+ * is released; since stacks are reused, it's an upper bound of the coroutine's own usage
  */
 typedef struct {
-    ucontext_t ctx;
+    unsigned long slice_histogram[CORO_SLICE_BUCKETS];
+    double runnable_time;
+    double waiting_time;
+    unsigned long n_voluntary_switches;
+    unsigned long n_preempted_switches;
+    double max_resume_latency;
+    size_t stack_high_water;
+} coro_metrics;
+
+/*!
+ * Alias for the function a spawned coroutine runs
+ */
+typedef void (*coro_func_t)(void *arg);
+
+/*!
+ * Abstract coroutine which the scheduler is based on
+ *
+ * @details coroutines of the pool run the registered entry point, spawned ones run their own function and are
+ * recycled once joined
+ */
+typedef struct coro {
+    coro_ctx ctx;
+    coro_stack stack;
+    struct coro *next;
+    struct coro *prev;
+    bool blocked;
+    bool wakeup_pending;
+    double yields_per_tick;
     unsigned times_passed_control;
     double exec_time;
     bool done;
 
+    coro_metrics metrics;
+    uint64_t suspend_ticks;
+    bool suspend_blocked;
+
+    coro_func_t func;
+    void *arg;
+    struct coro *joiner;
+    bool exited;
+    struct coro *spawned_next;
+
     CORO_DATA;
 } coro;
 
-bool scheduler_setup(size_t coro_pool_sz, double target_latency);
+/*!
+ * Coroutine waiting on a channel, linked into the channel's queue of senders or receivers from the coroutine's stack
+ */
+typedef struct coro_chan_waiter {
+    coro *coro;
+    struct coro_chan_waiter *next;
+    bool woken;
+} coro_chan_waiter;
+
+/*!
+ * Bounded FIFO channel of fixed-size elements between coroutines
+ *
+ * @details a ring buffer guarded by a spinlock: a sender suspends while the channel is full and a receiver suspends
+ * while it's empty, each woken up in FIFO order by the coroutine making room or sending an element
+ */
+typedef struct {
+    atomic_flag lock;
+    char *buf;
+    size_t elem_sz;
+    size_t capacity;
+    size_t head;
+    size_t len;
+    bool closed;
+
+    coro_chan_waiter *senders;
+    coro_chan_waiter *receivers;
+} coro_chan;
+
+bool scheduler_setup(size_t coro_pool_sz, double target_latency, size_t stack_sz);
 void scheduler_cleanup();
+bool scheduler_enable_preemption();
 void scheduler_register_coro_entry_point(ctx_entry_point_func_t func);
 bool scheduler_run();
+bool scheduler_run_workers(size_t n_workers);
+bool scheduler_write_metrics(FILE *file);
 coro *scheduler_curr_coro();
 coro *scheduler_coro_pool();
 
@@ -40,5 +120,15 @@ void coro_error();
 void coro_done();
 void coro_suspend();
 void coro_yield();
+void coro_block();
+void coro_wake(coro *coro);
+coro *coro_spawn(coro_func_t func, void *arg);
+void coro_join(coro *coro);
+
+bool coro_chan_init(coro_chan *chan, size_t elem_sz, size_t capacity);
+void coro_chan_destroy(coro_chan *chan);
+bool coro_chan_send(coro_chan *chan, const void *elem);
+bool coro_chan_recv(coro_chan *chan, void *elem);
+void coro_chan_close(coro_chan *chan);
 
 #endif /* CORO_H */
@@ -0,0 +1,244 @@
+#include "coro_arena.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "errors.h"
+
+/*
+ * Large buffers, such as the auxiliary arrays of the sort kernels, are taken from an arena owned by the scheduler
+ * rather than from malloc(). They are mapped aligned to the huge page size, so that transparent huge pages can back
+ * them, and they are handed out uninitialized: a released buffer goes back to the arena as it is and is reused by the
+ * next allocation it's large enough for, which then neither faults its pages in nor has them zeroed by the kernel
+ * again. Buffers are only unmapped once the arena runs out of buffers large enough, in which case the smaller free
+ * ones are unmapped before mapping a new one, so that they don't add to the peak memory usage for nothing.
+ *
+ * The arrays being sorted are scanned over and over, and with 4 KiB pages a scan of a multi-GiB array misses the TLB
+ * every few hundred elements. Buffers can be backed by huge pages instead, either by advising transparent huge pages
+ * (which the kernel may or may not provide, in which case nothing changes) or by mapping them from the hugetlbfs pool
+ * (which fails unless the pool has enough pages reserved, e.g. through vm.nr_hugepages, in which case the arena falls
+ * back to transparent huge pages).
+ */
+
+/*!
+ * Alignment and granularity of buffers, the size of a huge page on x86-64 and aarch64 with 4 KiB pages
+ */
+static const size_t HUGE_PAGE_SZ = 2 * 1024 * 1024;
+
+/*!
+ * Buffer mapped by the arena
+ */
+typedef struct arena_buf {
+    void *base;
+    size_t sz;
+    bool in_use;
+    struct arena_buf *next;
+} arena_buf;
+
+/*!
+ * Singleton arena
+ *
+ * @details buffers are shared by all the scheduler's workers, hence they are guarded by a lock
+ */
+struct {
+    pthread_mutex_t lock;
+    arena_buf *bufs;
+    huge_page_mode huge_pages;
+} static arena = {.lock = PTHREAD_MUTEX_INITIALIZER, .huge_pages = HUGE_PAGES_OFF};
+
+static arena_buf *arena_take(size_t sz);
+static void arena_unmap_free(size_t sz);
+static void *arena_map(size_t sz);
+
+/*!
+ * Sets up the arena
+ *
+ * @return true on success, false otherwise
+ */
+bool coro_arena_setup()
+{
+    arena.bufs = NULL;
+
+    return true;
+}
+
+/*!
+ * Cleans up the arena, unmapping all the buffers
+ *
+ * @attention buffers which were not released are unmapped as well
+ */
+void coro_arena_cleanup()
+{
+    while (arena.bufs != NULL) {
+        arena_buf *buf = arena.bufs;
+        arena.bufs = buf->next;
+
+        if (munmap(buf->base, buf->sz) != 0) HANDLE_ERROR("munmap: ", {});
+        free(buf);
+    }
+}
+
+/*!
+ * Sets how buffers mapped from now on are backed by huge pages
+ *
+ * @param mode [in]
+ */
+void coro_arena_use_huge_pages(huge_page_mode mode)
+{
+    arena.huge_pages = mode;
+}
+
+/*!
+ * Allocates an uninitialized buffer, reusing a released one if possible
+ *
+ * @param sz [in] size of the buffer, rounded up to the huge page size
+ *
+ * @return buffer aligned to the huge page size, NULL on failure
+ */
+void *coro_arena_alloc(size_t sz)
+{
+    sz = (sz != 0) ? (sz + HUGE_PAGE_SZ - 1) / HUGE_PAGE_SZ * HUGE_PAGE_SZ : HUGE_PAGE_SZ;
+
+    pthread_mutex_lock(&arena.lock);
+    arena_buf *buf = arena_take(sz);
+    if (buf == NULL) arena_unmap_free(sz);
+    pthread_mutex_unlock(&arena.lock);
+
+    if (buf != NULL) return buf->base;
+
+    if ((buf = malloc(sizeof(*buf))) == NULL) HANDLE_ERROR("malloc: ", { return NULL; });
+    if ((buf->base = arena_map(sz)) == NULL) {
+        free(buf);
+        return NULL;
+    }
+    buf->sz = sz;
+    buf->in_use = true;
+
+    pthread_mutex_lock(&arena.lock);
+    buf->next = arena.bufs;
+    arena.bufs = buf;
+    pthread_mutex_unlock(&arena.lock);
+
+    return buf->base;
+}
+
+/*!
+ * Releases a buffer back to the arena
+ *
+ * @param buf [in] buffer allocated from the arena, or NULL
+ */
+void coro_arena_release(void *buf)
+{
+    if (buf == NULL) return;
+
+    pthread_mutex_lock(&arena.lock);
+    arena_buf *curr = arena.bufs;
+    while ((curr != NULL) && (curr->base != buf)) {
+        curr = curr->next;
+    }
+    assert((curr != NULL) && curr->in_use);
+    curr->in_use = false;
+    pthread_mutex_unlock(&arena.lock);
+}
+
+/*!
+ * Advises the kernel to back a buffer with transparent huge pages, if the arena uses huge pages
+ *
+ * @details only the part of the buffer made of whole huge pages is advised; the advice is merely a hint, so it failing
+ * (e.g. with a kernel built without transparent huge pages) isn't an error
+ *
+ * @param buf [in] buffer, not necessarily from the arena
+ * @param sz  [in] size of the buffer
+ */
+void coro_arena_advise(void *buf, size_t sz)
+{
+    if ((arena.huge_pages == HUGE_PAGES_OFF) || (buf == NULL)) return;
+
+    uintptr_t begin = ((uintptr_t) buf + HUGE_PAGE_SZ - 1) & ~(uintptr_t) (HUGE_PAGE_SZ - 1);
+    uintptr_t end = ((uintptr_t) buf + sz) & ~(uintptr_t) (HUGE_PAGE_SZ - 1);
+    if (begin >= end) return;
+
+    signed saved_errno = errno;
+    madvise((void *) begin, end - begin, MADV_HUGEPAGE);
+    errno = saved_errno;
+}
+
+/*!
+ * Takes the smallest free buffer large enough
+ *
+ * @param sz [in]
+ *
+ * @return buffer marked in use, NULL if there's none
+ *
+ * @note must be called with the arena's lock held
+ */
+arena_buf *arena_take(size_t sz)
+{
+    arena_buf *best = NULL;
+    for (arena_buf *buf = arena.bufs; buf != NULL; buf = buf->next) {
+        if (!buf->in_use && (buf->sz >= sz) && ((best == NULL) || (buf->sz < best->sz))) best = buf;
+    }
+
+    if (best != NULL) best->in_use = true;
+
+    return best;
+}
+
+/*!
+ * Unmaps the free buffers smaller than a size, which no allocation of that size can reuse
+ *
+ * @param sz [in]
+ *
+ * @note must be called with the arena's lock held
+ */
+void arena_unmap_free(size_t sz)
+{
+    arena_buf **link = &arena.bufs;
+    while (*link != NULL) {
+        arena_buf *buf = *link;
+        if (buf->in_use || (buf->sz >= sz)) {
+            link = &buf->next;
+            continue;
+        }
+
+        *link = buf->next;
+        if (munmap(buf->base, buf->sz) != 0) HANDLE_ERROR("munmap: ", {});
+        free(buf);
+    }
+}
+
+/*!
+ * Maps memory aligned to the huge page size, backed by huge pages as the arena is set to
+ *
+ * @details the mapping is made one huge page larger than requested, then its misaligned head and the rest of its tail
+ * are unmapped; hugetlbfs mappings are aligned by the kernel
+ *
+ * @param sz [in] size, a multiple of the huge page size
+ *
+ * @return mapped memory, NULL on failure
+ */
+void *arena_map(size_t sz)
+{
+    if (arena.huge_pages == HUGE_PAGES_HUGETLB) {
+        void *map = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map != MAP_FAILED) return map;
+    }
+
+    char *map = mmap(NULL, sz + HUGE_PAGE_SZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) HANDLE_ERROR("mmap: ", { return NULL; });
+
+    char *base = (char *) (((uintptr_t) map + HUGE_PAGE_SZ - 1) & ~(uintptr_t) (HUGE_PAGE_SZ - 1));
+    size_t head = (size_t) (base - map);
+    if ((head != 0) && (munmap(map, head) != 0)) HANDLE_ERROR("munmap: ", {});
+    if (munmap(base + sz, HUGE_PAGE_SZ - head) != 0) HANDLE_ERROR("munmap: ", {});
+
+    coro_arena_advise(base, sz);
+
+    return base;
+}
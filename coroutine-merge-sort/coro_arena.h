@@ -0,0 +1,23 @@
+#ifndef CORO_ARENA_H
+#define CORO_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*!
+ * Ways of backing large buffers with huge pages
+ */
+typedef enum {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_THP,
+    HUGE_PAGES_HUGETLB,
+} huge_page_mode;
+
+bool coro_arena_setup();
+void coro_arena_cleanup();
+void coro_arena_use_huge_pages(huge_page_mode mode);
+void *coro_arena_alloc(size_t sz);
+void coro_arena_release(void *buf);
+void coro_arena_advise(void *buf, size_t sz);
+
+#endif /* CORO_ARENA_H */
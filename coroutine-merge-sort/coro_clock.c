@@ -0,0 +1,82 @@
+#include "coro_clock.h"
+
+#include <stdio.h>
+
+#include "errors.h"
+
+/*!
+ * Number of the scheduler's clock ticks per microsecond
+ */
+static double ticks_per_us = 1000;
+
+#if !defined(CORO_CLOCK_MONOTONIC) && defined(__x86_64__)
+/*!
+ * Time spent calibrating the cycle counter against CLOCK_MONOTONIC, in nanoseconds
+ */
+static const uint64_t CALIBRATION_NS = 2 * 1000 * 1000;
+
+static uint64_t monotonic_ns();
+#endif
+
+/*!
+ * Sets up the scheduler's clock, calibrating the cycle counter if need be
+ *
+ * @return true on success, false otherwise
+ */
+bool coro_clock_setup()
+{
+#if defined(CORO_CLOCK_MONOTONIC)
+    ticks_per_us = 1000;
+#elif defined(__x86_64__)
+    uint64_t start_ns = monotonic_ns();
+    uint64_t start_ticks = coro_clock_ticks();
+    if (start_ns == 0) return false;
+
+    uint64_t now_ns = start_ns;
+    while (now_ns - start_ns < CALIBRATION_NS) {
+        if ((now_ns = monotonic_ns()) == 0) return false;
+    }
+
+    ticks_per_us = (double) (coro_clock_ticks() - start_ticks) * 1000 / (double) (now_ns - start_ns);
+#else
+    uint64_t freq;
+    __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+
+    ticks_per_us = (double) freq / 1000000;
+#endif
+
+    return true;
+}
+
+/*!
+ * @param ticks [in]
+ *
+ * @return ticks converted to microseconds
+ */
+double coro_clock_ticks_to_us(uint64_t ticks)
+{
+    return (double) ticks / ticks_per_us;
+}
+
+/*!
+ * @param us [in]
+ *
+ * @return microseconds converted to ticks
+ */
+uint64_t coro_clock_us_to_ticks(double us)
+{
+    return (us > 0) ? (uint64_t) (us * ticks_per_us) : 0;
+}
+
+#if !defined(CORO_CLOCK_MONOTONIC) && defined(__x86_64__)
+/*!
+ * @return CLOCK_MONOTONIC timestamp in nanoseconds, 0 on failure
+ */
+uint64_t monotonic_ns()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) HANDLE_ERROR("clock_gettime: ", { return 0; });
+
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+#endif
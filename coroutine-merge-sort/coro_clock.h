@@ -0,0 +1,43 @@
+#ifndef CORO_CLOCK_H
+#define CORO_CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * The scheduler's clock is the CPU's cycle counter where there's a constant-rate one (the TSC on x86-64, the generic
+ * timer on aarch64), reading which takes a few nanoseconds and no syscall. Defining CORO_CLOCK_MONOTONIC (or building
+ * for any other architecture) falls back to clock_gettime(CLOCK_MONOTONIC) with nanosecond ticks.
+ */
+#if !defined(CORO_CLOCK_MONOTONIC) && defined(__x86_64__)
+#include <x86intrin.h>
+#elif !defined(CORO_CLOCK_MONOTONIC) && !defined(__aarch64__)
+#define CORO_CLOCK_MONOTONIC
+#endif
+
+bool coro_clock_setup();
+double coro_clock_ticks_to_us(uint64_t ticks);
+uint64_t coro_clock_us_to_ticks(double us);
+
+/*!
+ * @return current value of the scheduler's clock, in ticks
+ */
+static inline uint64_t coro_clock_ticks()
+{
+#if defined(CORO_CLOCK_MONOTONIC)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+#elif defined(__x86_64__)
+    return __rdtsc();
+#else
+    uint64_t ticks;
+    __asm__ volatile("isb; mrs %0, cntvct_el0" : "=r"(ticks));
+
+    return ticks;
+#endif
+}
+
+#endif /* CORO_CLOCK_H */
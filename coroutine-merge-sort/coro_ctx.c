@@ -0,0 +1,282 @@
+#include "coro_ctx.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "errors.h"
+
+#ifdef CORO_CTX_ASM
+
+void coro_ctx_switch_asm(void **from_sp, void *to_sp);
+void coro_ctx_trampoline(void);
+
+static __attribute__((used, noreturn)) void coro_ctx_start(coro_ctx *ctx);
+
+#if defined(__x86_64__)
+
+/*
+ * Saves the callee-saved registers (rbp, rbx, r12-r15) along with the MXCSR and x87 control words on the current
+ * stack, stores the stack pointer to *from_sp (rdi), loads to_sp (rsi) and restores the same set from there
+ */
+__asm__(
+    ".text\n"
+    ".globl coro_ctx_switch_asm\n"
+    ".hidden coro_ctx_switch_asm\n"
+    ".type coro_ctx_switch_asm, @function\n"
+    "coro_ctx_switch_asm:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coro_ctx_switch_asm, .-coro_ctx_switch_asm\n"
+    "\n"
+    ".globl coro_ctx_trampoline\n"
+    ".hidden coro_ctx_trampoline\n"
+    ".type coro_ctx_trampoline, @function\n"
+    "coro_ctx_trampoline:\n"
+    "    movq %rbx, %rdi\n"
+    "    call coro_ctx_start\n"
+    "    ud2\n"
+    ".size coro_ctx_trampoline, .-coro_ctx_trampoline\n"
+);
+
+enum {
+    CTX_FRAME_SZ = 8 * sizeof(uint64_t),
+    CTX_FRAME_CTL = 0,
+    CTX_FRAME_ARG = 5,
+    CTX_FRAME_FP = 6,
+    CTX_FRAME_RET = 7,
+};
+
+/* MXCSR with all exceptions masked and x87 control word with extended precision, as set up at process start */
+static const uint64_t ctx_frame_ctl_default = 0x1F80 | ((uint64_t) 0x037F << 32);
+
+#elif defined(__aarch64__)
+
+/*
+ * Saves the callee-saved registers (x19-x30, d8-d15) along with FPCR on the current stack, stores the stack pointer
+ * to *from_sp (x0), loads to_sp (x1) and restores the same set from there
+ */
+__asm__(
+    ".text\n"
+    ".globl coro_ctx_switch_asm\n"
+    ".hidden coro_ctx_switch_asm\n"
+    ".type coro_ctx_switch_asm, %function\n"
+    "coro_ctx_switch_asm:\n"
+    "    sub sp, sp, #176\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mrs x9, fpcr\n"
+    "    str x9, [sp, #160]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    ldr x9, [sp, #160]\n"
+    "    msr fpcr, x9\n"
+    "    add sp, sp, #176\n"
+    "    ret\n"
+    ".size coro_ctx_switch_asm, .-coro_ctx_switch_asm\n"
+    "\n"
+    ".globl coro_ctx_trampoline\n"
+    ".hidden coro_ctx_trampoline\n"
+    ".type coro_ctx_trampoline, %function\n"
+    "coro_ctx_trampoline:\n"
+    "    mov x0, x19\n"
+    "    bl coro_ctx_start\n"
+    "    brk #0\n"
+    ".size coro_ctx_trampoline, .-coro_ctx_trampoline\n"
+);
+
+enum {
+    CTX_FRAME_SZ = 22 * sizeof(uint64_t),
+    CTX_FRAME_ARG = 0,
+    CTX_FRAME_FP = 10,
+    CTX_FRAME_RET = 11,
+    CTX_FRAME_CTL = 20,
+};
+
+/* FPCR with round-to-nearest and no traps enabled */
+static const uint64_t ctx_frame_ctl_default = 0;
+
+#endif
+
+/*!
+ * Initializes a context to run on the given stack
+ *
+ * @param ctx      [out]
+ * @param stack    [in] lowest address of the stack
+ * @param stack_sz [in]
+ * @param link     [in] context resumed when the entry point returns, NULL if it never returns
+ *
+ * @return true on success, false otherwise
+ */
+bool coro_ctx_init(coro_ctx *ctx, void *stack, size_t stack_sz, coro_ctx *link)
+{
+    assert(ctx != NULL);
+    assert(stack != NULL);
+
+    ctx->sp = NULL;
+    ctx->stack = stack;
+    ctx->stack_sz = stack_sz;
+    ctx->func = NULL;
+    ctx->link = link;
+
+    return true;
+}
+
+/*!
+ * Sets the entry point of a context, so that the next switch to it starts executing the entry point from scratch
+ *
+ * @details lays out a frame on top of the stack, which looks exactly like the one left by coro_ctx_switch_asm, so that
+ * restoring it returns into the trampoline with the context in a callee-saved register
+ *
+ * @param ctx  [in, out]
+ * @param func [in] entry point
+ */
+void coro_ctx_make(coro_ctx *ctx, ctx_entry_point_func_t func)
+{
+    assert(ctx != NULL);
+    assert(func != NULL);
+
+    uintptr_t top = ((uintptr_t) ctx->stack + ctx->stack_sz) & ~(uintptr_t) 15;
+    uint64_t *frame = (uint64_t *) (top - CTX_FRAME_SZ);
+    memset(frame, 0, CTX_FRAME_SZ);
+
+    frame[CTX_FRAME_CTL] = ctx_frame_ctl_default;
+    frame[CTX_FRAME_ARG] = (uintptr_t) ctx;
+    frame[CTX_FRAME_FP] = 0;
+    frame[CTX_FRAME_RET] = (uintptr_t) coro_ctx_trampoline;
+
+    ctx->func = func;
+    ctx->sp = frame;
+}
+
+/*!
+ * Saves the current context to from and resumes to
+ *
+ * @param from [out]
+ * @param to   [in]
+ *
+ * @return true on success, false otherwise
+ */
+bool coro_ctx_switch(coro_ctx *from, coro_ctx *to)
+{
+    assert(from != NULL);
+    assert(to != NULL);
+
+    coro_ctx_switch_asm(&from->sp, to->sp);
+
+    return true;
+}
+
+/*!
+ * Runs the context's entry point and resumes the linked context once it returns
+ *
+ * @param ctx [in]
+ */
+void coro_ctx_start(coro_ctx *ctx)
+{
+    ctx->func();
+    if (ctx->link != NULL) coro_ctx_switch_asm(&ctx->sp, ctx->link->sp);
+
+    abort();
+}
+
+#else
+
+/*!
+ * Initializes a context to run on the given stack
+ *
+ * @param ctx      [out]
+ * @param stack    [in] lowest address of the stack
+ * @param stack_sz [in]
+ * @param link     [in] context resumed when the entry point returns, NULL if it never returns
+ *
+ * @return true on success, false otherwise
+ */
+bool coro_ctx_init(coro_ctx *ctx, void *stack, size_t stack_sz, coro_ctx *link)
+{
+    assert(ctx != NULL);
+    assert(stack != NULL);
+
+    if (getcontext(&ctx->uc) != 0) HANDLE_ERROR("getcontext: ", { return false; });
+    ctx->uc.uc_stack.ss_sp = stack;
+    ctx->uc.uc_stack.ss_size = stack_sz;
+    ctx->uc.uc_stack.ss_flags = 0;
+    ctx->uc.uc_link = (link != NULL) ? &link->uc : NULL;
+    ctx->link = link;
+
+    return true;
+}
+
+/*!
+ * Sets the entry point of a context, so that the next switch to it starts executing the entry point from scratch
+ *
+ * @param ctx  [in, out]
+ * @param func [in] entry point
+ */
+void coro_ctx_make(coro_ctx *ctx, ctx_entry_point_func_t func)
+{
+    assert(ctx != NULL);
+    assert(func != NULL);
+
+    makecontext(&ctx->uc, func, 0);
+}
+
+/*!
+ * Saves the current context to from and resumes to
+ *
+ * @param from [out]
+ * @param to   [in]
+ *
+ * @return true on success, false otherwise
+ */
+bool coro_ctx_switch(coro_ctx *from, coro_ctx *to)
+{
+    assert(from != NULL);
+    assert(to != NULL);
+
+    if (swapcontext(&from->uc, &to->uc) != 0) HANDLE_ERROR("swapcontext: ", { return false; });
+
+    return true;
+}
+
+#endif
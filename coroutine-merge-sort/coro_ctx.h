@@ -0,0 +1,45 @@
+#ifndef CORO_CTX_H
+#define CORO_CTX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * The context switch backend is picked at build time:
+ *  - by default, on x86-64 and aarch64 a hand-rolled switch is used, which saves only callee-saved registers and
+ *    doesn't issue any syscalls;
+ *  - defining CORO_CTX_UCONTEXT (or building for any other architecture) falls back to getcontext/swapcontext.
+ */
+#if !defined(CORO_CTX_UCONTEXT) && (defined(__x86_64__) || defined(__aarch64__))
+#define CORO_CTX_ASM
+#define CORO_CTX_BACKEND "asm"
+#else
+#include <ucontext.h>
+#define CORO_CTX_BACKEND "ucontext"
+#endif
+
+/*!
+ * Alias for context entry point function
+ */
+typedef void (*ctx_entry_point_func_t)(void);
+
+/*!
+ * Execution context of a coroutine
+ */
+typedef struct coro_ctx {
+#ifdef CORO_CTX_ASM
+    void *sp;
+    void *stack;
+    size_t stack_sz;
+    ctx_entry_point_func_t func;
+#else
+    ucontext_t uc;
+#endif
+    struct coro_ctx *link;
+} coro_ctx;
+
+bool coro_ctx_init(coro_ctx *ctx, void *stack, size_t stack_sz, coro_ctx *link);
+void coro_ctx_make(coro_ctx *ctx, ctx_entry_point_func_t func);
+bool coro_ctx_switch(coro_ctx *from, coro_ctx *to);
+
+#endif /* CORO_CTX_H */
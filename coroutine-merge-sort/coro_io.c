@@ -0,0 +1,483 @@
+#include "coro_io.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "coro.h"
+#include "errors.h"
+
+/*!
+ * Number of submission queue entries of the ring
+ */
+static const unsigned RING_ENTRIES = 256;
+
+/*!
+ * Singleton I/O reactor integrated with the scheduler
+ *
+ * @details reads and writes are submitted to an io_uring, whose completions are signalled through an eventfd; workers
+ * which run out of coroutines reap the completions, waking up the coroutines which submitted the requests, and sleep on
+ * the eventfd while there's nothing to reap
+ * @details where io_uring is not available (e.g. disallowed by seccomp), requests are submitted as POSIX AIO, with
+ * completion notifications waking up the coroutines and signalling the eventfd from glibc's helper threads
+ */
+struct {
+    signed event_fd;
+    bool uring;
+
+    signed ring_fd;
+    pthread_mutex_t sq_lock;
+    pthread_mutex_t cq_lock;
+
+    void *sq_ring;
+    size_t sq_ring_sz;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+
+    void *cq_ring;
+    size_t cq_ring_sz;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+} static reactor = {.event_fd = -1, .ring_fd = -1, .sq_lock = PTHREAD_MUTEX_INITIALIZER, .cq_lock = PTHREAD_MUTEX_INITIALIZER};
+
+static bool ring_setup();
+static void ring_cleanup();
+static bool io_submit(coro_io_req *req, bool writing, int fd, void *buf, size_t nbytes, off_t offset);
+static bool ring_submit(coro_io_req *req, bool writing, int fd, void *buf, size_t nbytes, off_t offset);
+static bool aio_submit(coro_io_req *req, bool writing, int fd, void *buf, size_t nbytes, off_t offset);
+static void aio_complete(union sigval sigval);
+static void io_req_complete(coro_io_req *req, ssize_t res);
+
+/*!
+ * Sets up the I/O reactor, falling back to POSIX AIO if io_uring can't be set up
+ *
+ * @return true on success, false otherwise
+ */
+bool coro_io_setup()
+{
+    if ((reactor.event_fd = eventfd(0, EFD_CLOEXEC)) == -1) HANDLE_ERROR("eventfd: ", { return false; });
+
+    reactor.uring = ring_setup();
+
+    return true;
+}
+
+/*!
+ * Cleans up the I/O reactor
+ *
+ * @attention there must be no requests in flight
+ */
+void coro_io_cleanup()
+{
+    if (reactor.uring) ring_cleanup();
+    reactor.uring = false;
+
+    if (reactor.event_fd != -1) close(reactor.event_fd);
+    reactor.event_fd = -1;
+}
+
+/*!
+ * Sets up the io_uring, with its completions signalled through the eventfd
+ *
+ * @return true on success, false otherwise
+ */
+bool ring_setup()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    if ((reactor.ring_fd = (signed) syscall(__NR_io_uring_setup, RING_ENTRIES, &params)) == -1) return false;
+
+    reactor.sq_ring_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    reactor.cq_ring_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (reactor.cq_ring_sz > reactor.sq_ring_sz) reactor.sq_ring_sz = reactor.cq_ring_sz;
+        reactor.cq_ring_sz = reactor.sq_ring_sz;
+    }
+    reactor.sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    reactor.sq_ring = mmap(NULL, reactor.sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           reactor.ring_fd, IORING_OFF_SQ_RING);
+    if (reactor.sq_ring == MAP_FAILED) HANDLE_ERROR("mmap: ", { goto cleanup; });
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        reactor.cq_ring = reactor.sq_ring;
+    } else {
+        reactor.cq_ring = mmap(NULL, reactor.cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               reactor.ring_fd, IORING_OFF_CQ_RING);
+        if (reactor.cq_ring == MAP_FAILED) HANDLE_ERROR("mmap: ", { goto cleanup; });
+    }
+
+    reactor.sqes = mmap(NULL, reactor.sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        reactor.ring_fd, IORING_OFF_SQES);
+    if (reactor.sqes == MAP_FAILED) HANDLE_ERROR("mmap: ", { goto cleanup; });
+
+    char *sq_ring = reactor.sq_ring;
+    reactor.sq_head = (_Atomic unsigned *) (sq_ring + params.sq_off.head);
+    reactor.sq_tail = (_Atomic unsigned *) (sq_ring + params.sq_off.tail);
+    reactor.sq_mask = *(unsigned *) (sq_ring + params.sq_off.ring_mask);
+    reactor.sq_entries = *(unsigned *) (sq_ring + params.sq_off.ring_entries);
+    reactor.sq_array = (unsigned *) (sq_ring + params.sq_off.array);
+
+    char *cq_ring = reactor.cq_ring;
+    reactor.cq_head = (_Atomic unsigned *) (cq_ring + params.cq_off.head);
+    reactor.cq_tail = (_Atomic unsigned *) (cq_ring + params.cq_off.tail);
+    reactor.cq_mask = *(unsigned *) (cq_ring + params.cq_off.ring_mask);
+    reactor.cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+    if (syscall(__NR_io_uring_register, reactor.ring_fd, IORING_REGISTER_EVENTFD, &reactor.event_fd, 1) != 0) {
+        HANDLE_ERROR("io_uring_register: ", { goto cleanup; });
+    }
+
+    return true;
+
+cleanup:
+    ring_cleanup();
+
+    return false;
+}
+
+/*!
+ * Unmaps the io_uring's queues and closes it
+ */
+void ring_cleanup()
+{
+    if ((reactor.sqes != NULL) && (reactor.sqes != MAP_FAILED)) munmap(reactor.sqes, reactor.sqes_sz);
+    if ((reactor.cq_ring != NULL) && (reactor.cq_ring != MAP_FAILED) && (reactor.cq_ring != reactor.sq_ring)) {
+        munmap(reactor.cq_ring, reactor.cq_ring_sz);
+    }
+    if ((reactor.sq_ring != NULL) && (reactor.sq_ring != MAP_FAILED)) munmap(reactor.sq_ring, reactor.sq_ring_sz);
+    reactor.sqes = NULL;
+    reactor.cq_ring = reactor.sq_ring = NULL;
+
+    if (reactor.ring_fd != -1) close(reactor.ring_fd);
+    reactor.ring_fd = -1;
+}
+
+/*!
+ * Reads from a file descriptor at an offset, blocking the current coroutine until the read is completed
+ *
+ * @details the coroutine is kept off the run queues while the read is in flight; outside of the scheduler the read
+ * is done synchronously
+ *
+ * @param fd     [in]
+ * @param buf    [out]
+ * @param nbytes [in]
+ * @param offset [in]
+ *
+ * @return number of bytes read, -1 on failure (with errno set)
+ */
+ssize_t coro_io_read(int fd, void *buf, size_t nbytes, off_t offset)
+{
+    coro_io_req req;
+    if (!coro_io_submit_read(&req, fd, buf, nbytes, offset)) return -1;
+
+    return coro_io_await(&req);
+}
+
+/*!
+ * Submits a read from a file descriptor at an offset without waiting for it to complete, so that the current
+ * coroutine can go on meanwhile
+ *
+ * @param req    [out] request, which must not go out of scope before it's awaited
+ * @param fd     [in]
+ * @param buf    [out] buffer, which must not be touched before the request is awaited
+ * @param nbytes [in]
+ * @param offset [in]
+ *
+ * @return true on success, false otherwise (with errno set)
+ *
+ * @note outside of the scheduler the read is done synchronously
+ */
+bool coro_io_submit_read(coro_io_req *req, int fd, void *buf, size_t nbytes, off_t offset)
+{
+    return io_submit(req, false, fd, buf, nbytes, offset);
+}
+
+/*!
+ * Writes to a file descriptor at an offset, blocking the current coroutine until the write is completed
+ *
+ * @details the coroutine is kept off the run queues while the write is in flight; outside of the scheduler the write
+ * is done synchronously
+ *
+ * @param fd     [in]
+ * @param buf    [in]
+ * @param nbytes [in]
+ * @param offset [in]
+ *
+ * @return number of bytes written, -1 on failure (with errno set)
+ */
+ssize_t coro_io_write(int fd, const void *buf, size_t nbytes, off_t offset)
+{
+    coro_io_req req;
+    if (!coro_io_submit_write(&req, fd, buf, nbytes, offset)) return -1;
+
+    return coro_io_await(&req);
+}
+
+/*!
+ * Submits a write to a file descriptor at an offset without waiting for it to complete, so that the current
+ * coroutine can go on meanwhile
+ *
+ * @param req    [out] request, which must not go out of scope before it's awaited
+ * @param fd     [in]
+ * @param buf    [in] buffer, which must not be modified before the request is awaited
+ * @param nbytes [in]
+ * @param offset [in]
+ *
+ * @return true on success, false otherwise (with errno set)
+ *
+ * @note outside of the scheduler the write is done synchronously
+ */
+bool coro_io_submit_write(coro_io_req *req, int fd, const void *buf, size_t nbytes, off_t offset)
+{
+    return io_submit(req, true, fd, (void *) buf, nbytes, offset);
+}
+
+/*!
+ * Submits a read or a write
+ *
+ * @param req     [out]
+ * @param writing [in] whether to write rather than read
+ * @param fd      [in]
+ * @param buf     [in, out]
+ * @param nbytes  [in]
+ * @param offset  [in]
+ *
+ * @return true on success, false otherwise (with errno set)
+ */
+bool io_submit(coro_io_req *req, bool writing, int fd, void *buf, size_t nbytes, off_t offset)
+{
+    assert(req != NULL);
+
+    req->coro = scheduler_curr_coro();
+    req->res = 0;
+    atomic_init(&req->done, false);
+
+    req->writing = writing;
+    req->fd = fd;
+    req->buf = buf;
+    req->nbytes = nbytes;
+    req->offset = offset;
+
+    if (req->coro == NULL) {
+        ssize_t res = writing ? pwrite(fd, buf, nbytes, offset) : pread(fd, buf, nbytes, offset);
+        req->res = (res != -1) ? res : -errno;
+        atomic_store_explicit(&req->done, true, memory_order_release);
+
+        return true;
+    }
+
+    return reactor.uring ? ring_submit(req, writing, fd, buf, nbytes, offset) : aio_submit(req, writing, fd, buf, nbytes, offset);
+}
+
+/*!
+ * Waits for a submitted request to complete, blocking the current coroutine meanwhile
+ *
+ * @details requests the io_uring cancels are resubmitted: a request the ring hands off to its kernel worker threads
+ * is cancelled if none can be started, which fails spuriously while a signal is pending on the submitting thread, as
+ * preemption timer signals often are
+ *
+ * @param req [in, out]
+ *
+ * @return number of bytes read or written, -1 on failure (with errno set)
+ */
+ssize_t coro_io_await(coro_io_req *req)
+{
+    assert(req != NULL);
+
+    while (true) {
+        while (!atomic_load_explicit(&req->done, memory_order_acquire)) {
+            coro_block();
+        }
+
+        if (!reactor.uring || (req->res != -ECANCELED)) break;
+        if (!io_submit(req, req->writing, req->fd, req->buf, req->nbytes, req->offset)) return -1;
+    }
+
+    if (req->res < 0) {
+        errno = (signed) -req->res;
+
+        return -1;
+    }
+
+    return req->res;
+}
+
+/*!
+ * Submits a read or a write to the io_uring
+ *
+ * @param req     [in, out]
+ * @param writing [in] whether to write rather than read
+ * @param fd      [in]
+ * @param buf     [in, out]
+ * @param nbytes  [in]
+ * @param offset  [in]
+ *
+ * @return true on success, false otherwise (with errno set)
+ */
+bool ring_submit(coro_io_req *req, bool writing, int fd, void *buf, size_t nbytes, off_t offset)
+{
+    pthread_mutex_lock(&reactor.sq_lock);
+
+    unsigned tail = atomic_load_explicit(reactor.sq_tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(reactor.sq_head, memory_order_acquire) == reactor.sq_entries) {
+        pthread_mutex_unlock(&reactor.sq_lock);
+        coro_suspend();
+        pthread_mutex_lock(&reactor.sq_lock);
+
+        tail = atomic_load_explicit(reactor.sq_tail, memory_order_relaxed);
+    }
+
+    unsigned idx = tail & reactor.sq_mask;
+    struct io_uring_sqe *sqe = &reactor.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = writing ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = (nbytes > UINT32_MAX) ? UINT32_MAX : (uint32_t) nbytes;
+    sqe->off = (uint64_t) offset;
+    sqe->user_data = (uintptr_t) req;
+
+    reactor.sq_array[idx] = idx;
+    atomic_store_explicit(reactor.sq_tail, tail + 1, memory_order_release);
+
+    long submitted = syscall(__NR_io_uring_enter, reactor.ring_fd, 1, 0, 0, NULL, 0);
+    pthread_mutex_unlock(&reactor.sq_lock);
+
+    if (submitted != 1) {
+        if (submitted >= 0) errno = EAGAIN;
+
+        HANDLE_ERROR("io_uring_enter: ", { return false; });
+    }
+
+    return true;
+}
+
+/*!
+ * Submits a read or a write as POSIX AIO, with its completion notified on one of glibc's helper threads
+ *
+ * @param req     [in, out]
+ * @param writing [in] whether to write rather than read
+ * @param fd      [in]
+ * @param buf     [in, out]
+ * @param nbytes  [in]
+ * @param offset  [in]
+ *
+ * @return true on success, false otherwise (with errno set)
+ */
+bool aio_submit(coro_io_req *req, bool writing, int fd, void *buf, size_t nbytes, off_t offset)
+{
+    memset(&req->aiocb, 0, sizeof(req->aiocb));
+    req->aiocb.aio_fildes = fd;
+    req->aiocb.aio_offset = offset;
+    req->aiocb.aio_buf = buf;
+    req->aiocb.aio_nbytes = nbytes;
+    req->aiocb.aio_sigevent.sigev_notify = SIGEV_THREAD;
+    req->aiocb.aio_sigevent.sigev_notify_function = aio_complete;
+    req->aiocb.aio_sigevent.sigev_value.sival_ptr = req;
+
+    if (writing) {
+        if (aio_write(&req->aiocb) != 0) HANDLE_ERROR("aio_write: ", { return false; });
+    } else {
+        if (aio_read(&req->aiocb) != 0) HANDLE_ERROR("aio_read: ", { return false; });
+    }
+
+    return true;
+}
+
+/*!
+ * Completes a request submitted as POSIX AIO
+ *
+ * @param sigval [in] request
+ */
+void aio_complete(union sigval sigval)
+{
+    coro_io_req *req = sigval.sival_ptr;
+
+    signed err = aio_error(&req->aiocb);
+    io_req_complete(req, (err == 0) ? aio_return(&req->aiocb) : -err);
+}
+
+/*!
+ * Completes a request, waking up the coroutine which submitted it
+ *
+ * @param req [in, out]
+ * @param res [in] number of bytes read or written, negated errno on failure
+ *
+ * @note the request may go out of scope as soon as it's marked as done
+ */
+void io_req_complete(coro_io_req *req, ssize_t res)
+{
+    coro *coro = req->coro;
+
+    req->res = res;
+    atomic_store_explicit(&req->done, true, memory_order_release);
+
+    coro_wake(coro);
+}
+
+/*!
+ * Reaps the io_uring's completions, waking up the coroutines whose requests are completed
+ *
+ * @return whether any completions were reaped
+ *
+ * @note cheap enough to be called on every switch: the completion queue is only locked if it isn't empty
+ */
+bool coro_io_poll()
+{
+    if (!reactor.uring) return false;
+
+    unsigned head = atomic_load_explicit(reactor.cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(reactor.cq_tail, memory_order_acquire)) return false;
+    if (pthread_mutex_trylock(&reactor.cq_lock) != 0) return false;
+
+    bool reaped = false;
+
+    head = atomic_load_explicit(reactor.cq_head, memory_order_relaxed);
+    for (unsigned tail = atomic_load_explicit(reactor.cq_tail, memory_order_acquire); head != tail; ++head) {
+        struct io_uring_cqe *cqe = &reactor.cqes[head & reactor.cq_mask];
+        io_req_complete((coro_io_req *) (uintptr_t) cqe->user_data, cqe->res);
+        reaped = true;
+    }
+    atomic_store_explicit(reactor.cq_head, head, memory_order_release);
+
+    pthread_mutex_unlock(&reactor.cq_lock);
+
+    return reaped;
+}
+
+/*!
+ * Sleeps until either a request is completed or coro_io_notify() is called
+ */
+void coro_io_wait()
+{
+    uint64_t cnt;
+    while ((read(reactor.event_fd, &cnt, sizeof(cnt)) == -1) && (errno == EINTR));
+}
+
+/*!
+ * Wakes up a worker sleeping in coro_io_wait()
+ */
+void coro_io_notify()
+{
+    uint64_t cnt = 1;
+    while ((write(reactor.event_fd, &cnt, sizeof(cnt)) == -1) && (errno == EINTR));
+}
@@ -0,0 +1,44 @@
+#ifndef CORO_IO_H
+#define CORO_IO_H
+
+#include <aio.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+/*!
+ * Read or write request of a coroutine
+ *
+ * @details keeps what it was submitted with, so that it can be resubmitted if the kernel cancels it
+ *
+ * @attention must stay alive until it's awaited, i.e. until coro_io_await() returns
+ */
+typedef struct {
+    struct coro *coro;
+    ssize_t res;
+    atomic_bool done;
+
+    bool writing;
+    signed fd;
+    void *buf;
+    size_t nbytes;
+    off_t offset;
+
+    struct aiocb aiocb;
+} coro_io_req;
+
+bool coro_io_setup();
+void coro_io_cleanup();
+ssize_t coro_io_read(int fd, void *buf, size_t nbytes, off_t offset);
+bool coro_io_submit_read(coro_io_req *req, int fd, void *buf, size_t nbytes, off_t offset);
+ssize_t coro_io_write(int fd, const void *buf, size_t nbytes, off_t offset);
+bool coro_io_submit_write(coro_io_req *req, int fd, const void *buf, size_t nbytes, off_t offset);
+ssize_t coro_io_await(coro_io_req *req);
+
+bool coro_io_poll();
+void coro_io_wait();
+void coro_io_notify();
+
+#endif /* CORO_IO_H */
@@ -0,0 +1,285 @@
+#include "coro_stack.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "dynamic_memory_management.h"
+#include "errors.h"
+
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
+
+/*!
+ * Minimum stack size: a signal frame alone takes several KiB on machines with wide vector registers
+ */
+static const size_t MIN_STACK_SZ = 16 * 1024;
+
+/*!
+ * Number of stacks carved out of a slab
+ */
+enum { SLAB_STACKS = 64 };
+
+/*!
+ * Mapping which stacks are carved out of, each with its guard page right below it
+ */
+typedef struct coro_stack_slab {
+    void *map;
+    struct coro_stack_slab *next;
+} coro_stack_slab;
+
+/*!
+ * Singleton pool of coroutine stacks
+ *
+ * @details fresh stacks are carved out of slabs of SLAB_STACKS stacks, whose guard pages are installed with
+ * MADV_GUARD_INSTALL (Linux 6.13+): unlike mprotect(), it doesn't split the mapping, so a slab takes a single one of
+ * the vm.max_map_count memory mappings a process may have, instead of two per stack
+ * @details released stacks are kept on a free-list, linked through their topmost word: the top page is the first one
+ * committed by a running coroutine, so linking through it doesn't commit any memory on its own
+ * @details the slabs and the free-list are shared by all the scheduler's workers, hence they're guarded by a lock
+ */
+struct {
+    size_t page_sz;
+    size_t stack_sz;
+    bool guard_regions;
+
+    pthread_mutex_t lock;
+    void *free_list;
+    coro_stack_slab *slabs;
+    char *slab_next;
+    size_t slab_left;
+} static pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void **free_list_link(void *base);
+static bool slab_alloc();
+static bool guard_install(void *guard);
+
+/*!
+ * Sets up the stack pool
+ *
+ * @param stack_sz [in] usable size of each stack, rounded up to the page size and clamped to MIN_STACK_SZ
+ *
+ * @return true on success, false otherwise
+ */
+bool coro_stack_pool_setup(size_t stack_sz)
+{
+    long page_sz = sysconf(_SC_PAGESIZE);
+    if (page_sz <= 0) HANDLE_ERROR("sysconf: ", { return false; });
+
+    if (stack_sz < MIN_STACK_SZ) stack_sz = MIN_STACK_SZ;
+
+    pool.page_sz = (size_t) page_sz;
+    pool.stack_sz = (stack_sz + pool.page_sz - 1) / pool.page_sz * pool.page_sz;
+    pool.guard_regions = true;
+    pool.free_list = NULL;
+    pool.slabs = NULL;
+    pool.slab_next = NULL;
+    pool.slab_left = 0;
+
+    return true;
+}
+
+/*!
+ * Cleans up the stack pool, unmapping all the slabs
+ *
+ * @attention all the stacks must have been released
+ */
+void coro_stack_pool_cleanup()
+{
+    while (pool.slabs != NULL) {
+        coro_stack_slab *slab = pool.slabs;
+        pool.slabs = slab->next;
+
+        if (munmap(slab->map, SLAB_STACKS * (pool.stack_sz + pool.page_sz)) != 0) HANDLE_ERROR("munmap: ", {});
+        free_and_null((void **) &slab);
+    }
+
+    pool.free_list = NULL;
+    pool.slab_next = NULL;
+    pool.slab_left = 0;
+}
+
+/*!
+ * Allocates a stack, reusing a released one if possible
+ *
+ * @details fresh stacks are carved out of slabs mapped with MAP_NORESERVE, so that only the pages actually touched by
+ * the coroutine get committed, and the page right below each stack is a guard page, so that an overrun faults instead
+ * of silently corrupting the neighbouring memory
+ *
+ * @note on kernels without MADV_GUARD_INSTALL guard pages are made with mprotect(), so every stack takes two memory
+ * mappings, and running more than about vm.max_map_count / 2 coroutines at once requires raising vm.max_map_count
+ *
+ * @param stack [out]
+ *
+ * @return true on success, false otherwise
+ */
+bool coro_stack_alloc(coro_stack *stack)
+{
+    assert(stack != NULL);
+
+    stack->sz = pool.stack_sz;
+
+    pthread_mutex_lock(&pool.lock);
+    stack->base = pool.free_list;
+    if (stack->base != NULL) {
+        pool.free_list = *free_list_link(stack->base);
+    } else if ((pool.slab_left != 0) || slab_alloc()) {
+        if (guard_install(pool.slab_next)) {
+            stack->base = pool.slab_next + pool.page_sz;
+            pool.slab_next += pool.stack_sz + pool.page_sz;
+            --pool.slab_left;
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return stack->base != NULL;
+}
+
+/*!
+ * Releases a stack to the free-list
+ *
+ * @param stack [in, out]
+ *
+ * @attention the stack must not be in use anymore, i.e. its coroutine must have switched away for good
+ */
+void coro_stack_release(coro_stack *stack)
+{
+    assert(stack != NULL);
+
+    if (stack->base == NULL) return;
+
+    pthread_mutex_lock(&pool.lock);
+    *free_list_link(stack->base) = pool.free_list;
+    pool.free_list = stack->base;
+    pthread_mutex_unlock(&pool.lock);
+
+    stack->base = NULL;
+}
+
+/*!
+ * @param stack [in]
+ * @param addr  [in] faulting address
+ *
+ * @return whether the address lies within the stack's guard page
+ */
+bool coro_stack_guard_hit(const coro_stack *stack, const void *addr)
+{
+    assert(stack != NULL);
+
+    if (stack->base == NULL) return false;
+
+    const char *guard = (const char *) stack->base - pool.page_sz;
+
+    return ((const char *) addr >= guard) && ((const char *) addr < (const char *) stack->base);
+}
+
+/*!
+ * Measures how deep a stack has been used, from the lowest of its pages committed
+ *
+ * @param stack [in]
+ *
+ * @return distance from the top of the stack to the bottom of its lowest committed page, 0 on failure
+ *
+ * @note pages of a stack are never decommitted, so a reused stack reports the deepest use by any of its coroutines
+ */
+size_t coro_stack_high_water(const coro_stack *stack)
+{
+    assert(stack != NULL);
+
+    if (stack->base == NULL) return 0;
+
+    enum { VEC_SZ = 64 };
+    unsigned char vec[VEC_SZ];
+
+    size_t n_pages = stack->sz / pool.page_sz;
+    for (size_t page = 0; page < n_pages; page += VEC_SZ) {
+        size_t n = (n_pages - page < VEC_SZ) ? n_pages - page : VEC_SZ;
+        if (mincore((char *) stack->base + page * pool.page_sz, n * pool.page_sz, vec) != 0) {
+            HANDLE_ERROR("mincore: ", { return 0; });
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            if (vec[i] & 1) return (n_pages - page - i) * pool.page_sz;
+        }
+    }
+
+    return 0;
+}
+
+/*!
+ * Maps a new slab for stacks to be carved out of
+ *
+ * @return true on success, false otherwise
+ *
+ * @note expects the pool's lock to be held
+ */
+bool slab_alloc()
+{
+    coro_stack_slab *slab = malloc(sizeof(*slab));
+    if (slab == NULL) HANDLE_ERROR("malloc: ", { return false; });
+
+    slab->map = mmap(NULL, SLAB_STACKS * (pool.stack_sz + pool.page_sz), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (slab->map == MAP_FAILED) {
+        HANDLE_ERROR("mmap: ", {
+            free_and_null((void **) &slab);
+            return false;
+        });
+    }
+
+    slab->next = pool.slabs;
+    pool.slabs = slab;
+    pool.slab_next = slab->map;
+    pool.slab_left = SLAB_STACKS;
+
+    return true;
+}
+
+/*!
+ * Turns a page of a slab into a guard page
+ *
+ * @details falls back to mprotect() for good the first time MADV_GUARD_INSTALL turns out not to be supported
+ *
+ * @param guard [in] page right below a stack
+ *
+ * @return true on success, false otherwise
+ *
+ * @note expects the pool's lock to be held
+ */
+bool guard_install(void *guard)
+{
+    if (pool.guard_regions) {
+        if (madvise(guard, pool.page_sz, MADV_GUARD_INSTALL) == 0) return true;
+        if (errno != EINVAL) HANDLE_ERROR("madvise: ", { return false; });
+
+        pool.guard_regions = false;
+    }
+
+    if (mprotect(guard, pool.page_sz, PROT_NONE) != 0) {
+        if (errno == ENOMEM) {
+            HANDLE_ERROR("mprotect (out of memory mappings, raise vm.max_map_count to run more coroutines at once): ", {
+                return false;
+            });
+        }
+
+        HANDLE_ERROR("mprotect: ", { return false; });
+    }
+
+    return true;
+}
+
+/*!
+ * @param base [in] lowest usable address of a stack
+ *
+ * @return address of the free-list link stored in the stack's topmost word
+ */
+void **free_list_link(void *base)
+{
+    return (void **) ((char *) base + pool.stack_sz) - 1;
+}
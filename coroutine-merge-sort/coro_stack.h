@@ -0,0 +1,22 @@
+#ifndef CORO_STACK_H
+#define CORO_STACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*!
+ * Coroutine stack, mapped lazily with a PROT_NONE guard page right below it
+ */
+typedef struct {
+    void *base;
+    size_t sz;
+} coro_stack;
+
+bool coro_stack_pool_setup(size_t stack_sz);
+void coro_stack_pool_cleanup();
+bool coro_stack_alloc(coro_stack *stack);
+void coro_stack_release(coro_stack *stack);
+bool coro_stack_guard_hit(const coro_stack *stack, const void *addr);
+size_t coro_stack_high_water(const coro_stack *stack);
+
+#endif /* CORO_STACK_H */
@@ -1,9 +1,141 @@
 #ifndef ELEM_H
 #define ELEM_H
 
+#include <endian.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The type of elements is chosen at compile time by defining one of ELEM_INT64, ELEM_UINT64, ELEM_DOUBLE or
+ * ELEM_RECORD (ELEM_INT32 by default), and every module is specialized for it: the traits below are inlined into the
+ * inner loops of sorting and merging, and parsing, formatting and the binary run format pick their code for the type
+ * by the same macros. Records are a signed 64-bit key followed by an unsigned 64-bit payload, ordered by key alone.
+ *
+ * Every type maps to an unsigned key of 32 or 64 bits ordered the same way as the elements, which radix sort and the
+ * merges of runs work with. Doubles are ordered by their keys too, i.e. totally: -0 goes before +0 and NaNs of either
+ * sign go to the ends.
+ */
+
+#if defined(ELEM_INT32) + defined(ELEM_INT64) + defined(ELEM_UINT64) + defined(ELEM_DOUBLE) + defined(ELEM_RECORD) > 1
+#error "at most one element type may be chosen"
+#endif
+
+#if !defined(ELEM_INT64) && !defined(ELEM_UINT64) && !defined(ELEM_DOUBLE) && !defined(ELEM_RECORD) && \
+    !defined(ELEM_INT32)
+#define ELEM_INT32
+#endif
+
+#if defined(ELEM_INT32)
 /*!
  * Alias for the type of elements being sorted
  */
 typedef int elem_t;
 
+/*!
+ * Unsigned key ordered as elements are
+ */
+typedef uint32_t elem_key_t;
+#elif defined(ELEM_INT64)
+typedef int64_t elem_t;
+typedef uint64_t elem_key_t;
+#elif defined(ELEM_UINT64)
+typedef uint64_t elem_t;
+typedef uint64_t elem_key_t;
+#elif defined(ELEM_DOUBLE)
+typedef double elem_t;
+typedef uint64_t elem_key_t;
+#elif defined(ELEM_RECORD)
+typedef struct {
+    int64_t key;
+    uint64_t payload;
+} elem_t;
+typedef uint64_t elem_key_t;
+
+_Static_assert(sizeof(elem_t) == 16, "records must not be padded");
+#endif
+
+/*!
+ * Whether elements are written as integers in text
+ */
+#if defined(ELEM_INT32) || defined(ELEM_INT64) || defined(ELEM_UINT64)
+#define ELEM_INTEGER
+#endif
+
+/*!
+ * Number of bits in a key
+ */
+#if defined(ELEM_INT32)
+#define ELEM_KEY_BITS 32
+#else
+#define ELEM_KEY_BITS 64
+#endif
+
+_Static_assert(sizeof(elem_key_t) * 8 == ELEM_KEY_BITS, "keys must take ELEM_KEY_BITS bits");
+
+/*!
+ * @param elem [in]
+ *
+ * @return unsigned key ordered as elements are
+ */
+static inline elem_key_t elem_key(elem_t elem)
+{
+#if defined(ELEM_INT32)
+    return (uint32_t) elem ^ UINT32_C(0x80000000);
+#elif defined(ELEM_INT64)
+    return (uint64_t) elem ^ UINT64_C(0x8000000000000000);
+#elif defined(ELEM_UINT64)
+    return elem;
+#elif defined(ELEM_DOUBLE)
+    uint64_t bits;
+    memcpy(&bits, &elem, sizeof(bits));
+
+    return (bits & UINT64_C(0x8000000000000000)) ? ~bits : bits | UINT64_C(0x8000000000000000);
+#elif defined(ELEM_RECORD)
+    return (uint64_t) elem.key ^ UINT64_C(0x8000000000000000);
+#endif
+}
+
+/*!
+ * @param a [in]
+ * @param b [in]
+ *
+ * @return whether a goes before b
+ */
+static inline bool elem_less(elem_t a, elem_t b)
+{
+#if defined(ELEM_DOUBLE)
+    return elem_key(a) < elem_key(b);
+#elif defined(ELEM_RECORD)
+    return a.key < b.key;
+#else
+    return a < b;
+#endif
+}
+
+/*!
+ * Converts an element between the host's byte order and little-endian, either way
+ *
+ * @param elem [in]
+ *
+ * @return elem with its bytes swapped on big-endian hosts
+ */
+static inline elem_t elem_swap_le(elem_t elem)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return elem;
+#elif defined(ELEM_INT32)
+    return (elem_t) htole32((uint32_t) elem);
+#elif defined(ELEM_RECORD)
+    return (elem_t) {.key = (int64_t) htole64((uint64_t) elem.key), .payload = htole64(elem.payload)};
+#else
+    uint64_t bits;
+    memcpy(&bits, &elem, sizeof(bits));
+    bits = htole64(bits);
+    memcpy(&elem, &bits, sizeof(elem));
+
+    return elem;
+#endif
+}
+
 #endif /* ELEM_H */
@@ -0,0 +1,463 @@
+#include "elem_parser.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if !defined(ELEM_PARSER_SCALAR) && defined(__x86_64__) && !defined(ELEM_DOUBLE)
+#include <immintrin.h>
+#else
+#ifndef ELEM_PARSER_SCALAR
+#define ELEM_PARSER_SCALAR
+#endif
+#endif
+
+#include "coro.h"
+#include "coro_arena.h"
+#include "dynamic_memory_management.h"
+#include "errors.h"
+
+/*
+ * Chunks are parsed in a single pass: on x86-64 a window of 64 bytes is classified at once, with SSE4.1 or AVX2, into
+ * a digit mask; every number lying entirely within the window is then located by the mask and converted with a few
+ * SIMD multiply-adds (digit by digit if it's longer than 16 digits), and the window moves on to the number reaching
+ * its end, if any. The tail of a chunk and a number carried over between chunks are parsed by the scalar loop. The
+ * instruction set is picked at runtime; defining ELEM_PARSER_SCALAR (or building for any other architecture) leaves
+ * just the scalar loop.
+ */
+
+/*!
+ * Initial capacity of the parsed array
+ */
+static const size_t MIN_CAPACITY = 1024;
+
+#ifndef ELEM_PARSER_SCALAR
+/*!
+ * Number of bytes classified at once
+ */
+enum { WINDOW_SZ = 64 };
+#endif
+
+static const char *elem_parser_feed_scalar(elem_parser *parser, const char *reader, const char *end);
+#ifndef ELEM_PARSER_SCALAR
+static const char *elem_parser_feed_sse41(elem_parser *parser, const char *chunk, const char *reader, const char *end);
+static const char *elem_parser_feed_avx2(elem_parser *parser, const char *chunk, const char *reader, const char *end);
+static int window_parse(elem_parser *parser, const char *chunk, const char *window, uint64_t digits);
+static uint64_t digits_to_u64(const char *digits, unsigned len);
+#endif
+static bool elem_parser_grow(elem_parser *parser);
+static bool elem_parser_store(elem_parser *parser, elem_t elem);
+#ifndef ELEM_DOUBLE
+static bool elem_parser_append(elem_parser *parser, bool negative, uint64_t value);
+#endif
+static bool elem_parser_push(elem_parser *parser);
+
+/*!
+ * @param parser [out]
+ */
+void elem_parser_init(elem_parser *parser)
+{
+    assert(parser != NULL);
+
+    parser->elems = NULL;
+    parser->sz = parser->capacity = 0;
+    parser->in_number = parser->negative = false;
+    parser->value = 0;
+#if defined(ELEM_DOUBLE)
+    parser->token_len = 0;
+#elif defined(ELEM_RECORD)
+    parser->has_key = false;
+    parser->key = 0;
+#endif
+}
+
+/*!
+ * Makes the parser append to an array from its start, carrying over a number being parsed
+ *
+ * @details lets a caller parse input of any size into arrays of its own, one after another, e.g. to keep memory bounded
+ *
+ * @param parser   [in, out]
+ * @param elems    [in] array to append to, which the parser reallocates if it gets full, so the caller is expected to
+ *                 take it back from parser->elems
+ * @param capacity [in]
+ */
+void elem_parser_reset(elem_parser *parser, elem_t *elems, size_t capacity)
+{
+    assert(parser != NULL);
+    assert((elems != NULL) || (capacity == 0));
+
+    parser->elems = elems;
+    parser->sz = 0;
+    parser->capacity = capacity;
+}
+
+/*!
+ * Parses a chunk of text, yielding after each number
+ *
+ * @details numbers are optionally signed sequences of decimal digits, any other character is a delimiter; a number
+ * is negative if the character right before it is a minus
+ * @details doubles are maximal sequences of digits, signs, decimal points and exponent marks, read by strtod() as
+ * many times as it takes, any other character is a delimiter
+ *
+ * @param parser [in, out]
+ * @param chunk  [in]
+ * @param len    [in]
+ *
+ * @return true on success, false otherwise
+ */
+bool elem_parser_feed(elem_parser *parser, const char *chunk, size_t len)
+{
+    assert(parser != NULL);
+    assert(chunk != NULL);
+
+    const char *reader = chunk;
+    const char *end = chunk + len;
+
+#ifdef ELEM_DOUBLE
+    return elem_parser_feed_scalar(parser, reader, end) != NULL;
+#endif
+
+    if (parser->in_number) {
+        while ((reader != end) && (*reader >= '0') && (*reader <= '9')) {
+            parser->value = parser->value * 10 + (unsigned long) (*(reader++) - '0');
+        }
+        if (reader == end) return true;
+
+        if (!elem_parser_push(parser)) return false;
+        coro_yield();
+    }
+
+#ifndef ELEM_PARSER_SCALAR
+    if (__builtin_cpu_supports("avx2")) {
+        reader = elem_parser_feed_avx2(parser, chunk, reader, end);
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        reader = elem_parser_feed_sse41(parser, chunk, reader, end);
+    }
+    if (reader == NULL) return false;
+
+    if (reader != chunk) parser->negative = (reader[-1] == '-');
+#endif
+
+    return elem_parser_feed_scalar(parser, reader, end) != NULL;
+}
+
+/*!
+ * Parses text one character at a time
+ *
+ * @param parser [in, out]
+ * @param reader [in] beginning of the text
+ * @param end    [in] end of the text
+ *
+ * @return end of the text, NULL on failure
+ */
+const char *elem_parser_feed_scalar(elem_parser *parser, const char *reader, const char *end)
+{
+    for (; reader != end; ++reader) {
+        char c = *reader;
+
+#ifdef ELEM_DOUBLE
+        if (((c >= '0') && (c <= '9')) || (c == '.') || (c == 'e') || (c == 'E') || (c == '+') || (c == '-')) {
+            if (parser->token_len == ELEM_PARSER_TOKEN_MAX - 1) {
+                errno = ERANGE;
+                HANDLE_ERROR("elem_parser_feed: ", { return NULL; });
+            }
+
+            parser->token[parser->token_len++] = c;
+            parser->in_number = true;
+            continue;
+        }
+#else
+        if ((c >= '0') && (c <= '9')) {
+            parser->value = parser->value * 10 + (unsigned long) (c - '0');
+            parser->in_number = true;
+            continue;
+        }
+#endif
+
+        if (parser->in_number) {
+            if (!elem_parser_push(parser)) return NULL;
+            coro_yield();
+        }
+        parser->negative = (c == '-');
+    }
+
+    return end;
+}
+
+#ifndef ELEM_PARSER_SCALAR
+/*!
+ * Parses text 64 bytes at a time with SSE4.1, up to where the loads would run past its end
+ *
+ * @param parser [in, out] parser, which must not be in the middle of a number
+ * @param chunk  [in] beginning of the chunk
+ * @param reader [in] beginning of the text, either the chunk's or right after a delimiter
+ * @param end    [in] end of the text
+ *
+ * @return where parsing has stopped (not in the middle of a number), NULL on failure
+ */
+__attribute__((target("sse4.1"))) const char *elem_parser_feed_sse41(elem_parser *parser, const char *chunk,
+                                                                      const char *reader, const char *end)
+{
+    while (end - reader >= WINDOW_SZ + 16) {
+        uint64_t digits = 0;
+        for (unsigned i = 0; i < WINDOW_SZ; i += 16) {
+            __m128i bytes = _mm_sub_epi8(_mm_loadu_si128((const __m128i *) (reader + i)), _mm_set1_epi8('0'));
+            digits |= (uint64_t) (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(bytes, _mm_set1_epi8(9)), bytes)) << i;
+        }
+
+        int consumed = window_parse(parser, chunk, reader, digits);
+        if (consumed == -1) return NULL;
+        if (consumed == 0) break;
+
+        reader += consumed;
+    }
+
+    return reader;
+}
+
+/*!
+ * Parses text 64 bytes at a time with AVX2, up to where the loads would run past its end
+ *
+ * @param parser [in, out] parser, which must not be in the middle of a number
+ * @param chunk  [in] beginning of the chunk
+ * @param reader [in] beginning of the text, either the chunk's or right after a delimiter
+ * @param end    [in] end of the text
+ *
+ * @return where parsing has stopped (not in the middle of a number), NULL on failure
+ */
+__attribute__((target("avx2"))) const char *elem_parser_feed_avx2(elem_parser *parser, const char *chunk,
+                                                                   const char *reader, const char *end)
+{
+    while (end - reader >= WINDOW_SZ + 16) {
+        uint64_t digits = 0;
+        for (unsigned i = 0; i < WINDOW_SZ; i += 32) {
+            __m256i bytes = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *) (reader + i)), _mm256_set1_epi8('0'));
+            digits |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(bytes, _mm256_set1_epi8(9)), bytes)) << i;
+        }
+
+        int consumed = window_parse(parser, chunk, reader, digits);
+        if (consumed == -1) return NULL;
+        if (consumed == 0) break;
+
+        reader += consumed;
+    }
+
+    return reader;
+}
+
+/*!
+ * Parses the numbers lying entirely within a window
+ *
+ * @details the numbers' first and last digits are found by comparing the digit mask with itself shifted, so that
+ * walking from one number to the next only takes a couple of bit operations on the masks
+ *
+ * @param parser [in, out]
+ * @param chunk  [in] beginning of the chunk
+ * @param window [in] beginning of the window, not in the middle of a number; 16 more bytes past its end must be readable
+ * @param digits [in] bit mask of the window's bytes which are digits
+ *
+ * @return number of bytes consumed: up to the number reaching the window's end, if any, or the whole window otherwise;
+ * 0 if the window is entirely digits, -1 on failure
+ */
+__attribute__((target("sse4.1"), always_inline)) inline int window_parse(elem_parser *parser, const char *chunk,
+                                                                          const char *window, uint64_t digits)
+{
+    uint64_t firsts = digits & ~(digits << 1);
+    uint64_t lasts = digits & ~((digits >> 1) | (1ull << (WINDOW_SZ - 1)));
+
+    for (; lasts != 0; firsts &= firsts - 1, lasts &= lasts - 1) {
+        unsigned first = (unsigned) __builtin_ctzll(firsts);
+        unsigned len = (unsigned) __builtin_ctzll(lasts) - first + 1;
+
+        const char *number = window + first;
+        bool negative = (number != chunk) ? (number[-1] == '-') : parser->negative;
+
+        uint64_t value = 0;
+        if (len <= 16) {
+            value = digits_to_u64(number, len);
+        } else {
+            for (unsigned i = 0; i < len; ++i) {
+                value = value * 10 + (uint64_t) (number[i] - '0');
+            }
+        }
+
+        if (!elem_parser_append(parser, negative, value)) return -1;
+        coro_yield();
+    }
+
+    return (firsts != 0) ? __builtin_ctzll(firsts) : WINDOW_SZ;
+}
+
+/*!
+ * Converts up to 16 decimal digits at once
+ *
+ * @details the digits are right-aligned within a vector, then neighbouring ones are combined by multiply-adds into
+ * 2-, 4- and finally two 8-digit numbers
+ *
+ * @param digits [in] digits, 16 bytes must be readable
+ * @param len    [in] number of digits, from 1 to 16
+ *
+ * @return value of the digits
+ */
+__attribute__((target("sse4.1"), always_inline)) inline uint64_t digits_to_u64(const char *digits, unsigned len)
+{
+    __m128i bytes = _mm_sub_epi8(_mm_loadu_si128((const __m128i *) digits), _mm_set1_epi8('0'));
+
+    __m128i align = _mm_add_epi8(_mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                 _mm_set1_epi8((char) (len - 16)));
+    bytes = _mm_shuffle_epi8(bytes, align);
+
+    __m128i pairs = _mm_maddubs_epi16(bytes, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1));
+    __m128i quads = _mm_madd_epi16(pairs, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+    __m128i octets = _mm_madd_epi16(_mm_packus_epi32(quads, quads), _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1, 10000, 1));
+
+    return (uint64_t) (uint32_t) _mm_cvtsi128_si32(octets) * 100000000 + (uint32_t) _mm_extract_epi32(octets, 1);
+}
+#endif
+
+/*!
+ * Parses the number the text ended with, if any, and hands the parsed array over to the caller
+ *
+ * @param parser [in, out] parser, reset afterwards
+ * @param elems  [out] parsed array, NULL if there are no numbers
+ * @param sz     [out] number of elements parsed
+ *
+ * @return true on success, false otherwise
+ *
+ * @attention the caller is responsible for freeing the parsed array
+ */
+bool elem_parser_finish(elem_parser *parser, elem_t **elems, size_t *sz)
+{
+    assert(parser != NULL);
+    assert(elems != NULL);
+    assert(sz != NULL);
+
+    if (parser->in_number && !elem_parser_push(parser)) return false;
+#ifdef ELEM_RECORD
+    if (parser->has_key) {
+        errno = EINVAL;
+        HANDLE_ERROR("elem_parser_finish: ", { return false; });
+    }
+#endif
+
+    *elems = parser->elems;
+    *sz = parser->sz;
+    elem_parser_init(parser);
+
+    return true;
+}
+
+/*!
+ * Frees the parsed array
+ *
+ * @param parser [in, out]
+ */
+void elem_parser_cleanup(elem_parser *parser)
+{
+    assert(parser != NULL);
+
+    free_and_null((void **) &parser->elems);
+    elem_parser_init(parser);
+}
+
+/*!
+ * Doubles the capacity of the parsed array
+ *
+ * @details the array is advised to be backed by huge pages before its new part is touched (see coro_arena_advise())
+ *
+ * @param parser [in, out]
+ *
+ * @return true on success, false otherwise
+ */
+bool elem_parser_grow(elem_parser *parser)
+{
+    size_t capacity = (parser->capacity != 0) ? parser->capacity * 2 : MIN_CAPACITY;
+    elem_t *elems = realloc(parser->elems, capacity * sizeof(*elems));
+    if (elems == NULL) HANDLE_ERROR("realloc: ", { return false; });
+
+    parser->elems = elems;
+    parser->capacity = capacity;
+    coro_arena_advise(elems, capacity * sizeof(*elems));
+
+    return true;
+}
+
+/*!
+ * Appends an element to the parsed array
+ *
+ * @param parser [in, out]
+ * @param elem   [in]
+ *
+ * @return true on success, false otherwise
+ */
+inline bool elem_parser_store(elem_parser *parser, elem_t elem)
+{
+    if ((parser->sz == parser->capacity) && !elem_parser_grow(parser)) return false;
+
+    parser->elems[parser->sz++] = elem;
+
+    return true;
+}
+
+#ifndef ELEM_DOUBLE
+/*!
+ * Appends a number to the parsed array, or to the record being parsed
+ *
+ * @param parser   [in, out]
+ * @param negative [in]
+ * @param value    [in] absolute value, wrapped around to elem_t (or to the record's field)
+ *
+ * @return true on success, false otherwise
+ */
+inline bool elem_parser_append(elem_parser *parser, bool negative, uint64_t value)
+{
+#ifdef ELEM_RECORD
+    if (!parser->has_key) {
+        parser->key = (int64_t) (negative ? -value : value);
+        parser->has_key = true;
+
+        return true;
+    }
+    parser->has_key = false;
+
+    return elem_parser_store(parser, (elem_t) {.key = parser->key, .payload = negative ? -value : value});
+#else
+    return elem_parser_store(parser, (elem_t) (negative ? -value : value));
+#endif
+}
+#endif
+
+/*!
+ * Appends the number being parsed by the scalar loop to the array
+ *
+ * @param parser [in, out]
+ *
+ * @return true on success, false otherwise
+ */
+bool elem_parser_push(elem_parser *parser)
+{
+#ifdef ELEM_DOUBLE
+    parser->token[parser->token_len] = '\0';
+    for (char *reader = parser->token; *reader != '\0';) {
+        char *next = NULL;
+        double value = strtod(reader, &next);
+        if (next == reader) {
+            ++reader;
+            continue;
+        }
+
+        if (!elem_parser_store(parser, value)) return false;
+        reader = next;
+    }
+    parser->token_len = 0;
+#else
+    if (!elem_parser_append(parser, parser->negative, parser->value)) return false;
+#endif
+
+    parser->in_number = parser->negative = false;
+    parser->value = 0;
+
+    return true;
+}
@@ -0,0 +1,45 @@
+#ifndef ELEM_PARSER_H
+#define ELEM_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "elem.h"
+
+#ifdef ELEM_DOUBLE
+/*!
+ * Maximum length of a number's text, when parsing doubles
+ */
+enum { ELEM_PARSER_TOKEN_MAX = 256 };
+#endif
+
+/*!
+ * Incremental parser of whitespace-separated decimal numbers into a growable array
+ *
+ * @details text is fed chunk by chunk, a number split across chunks is carried over to the next chunk
+ * @details a record is parsed from two numbers in a row, its key and its payload
+ */
+typedef struct {
+    elem_t *elems;
+    size_t sz;
+    size_t capacity;
+
+    bool in_number;
+    bool negative;
+    unsigned long value;
+#if defined(ELEM_DOUBLE)
+    char token[ELEM_PARSER_TOKEN_MAX];
+    size_t token_len;
+#elif defined(ELEM_RECORD)
+    bool has_key;
+    int64_t key;
+#endif
+} elem_parser;
+
+void elem_parser_init(elem_parser *parser);
+void elem_parser_reset(elem_parser *parser, elem_t *elems, size_t capacity);
+bool elem_parser_feed(elem_parser *parser, const char *chunk, size_t len);
+bool elem_parser_finish(elem_parser *parser, elem_t **elems, size_t *sz);
+void elem_parser_cleanup(elem_parser *parser);
+
+#endif /* ELEM_PARSER_H */
@@ -0,0 +1,932 @@
+#include "external_sort.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "coro_arena.h"
+#include "coro_io.h"
+#include "dynamic_memory_management.h"
+#include "elem_parser.h"
+#include "errors.h"
+#include "loser_tree.h"
+#include "run_file.h"
+#include "stream_reader.h"
+#include "text_writer.h"
+
+/*
+ * Sorting with bounded memory goes in two phases. First, every input file is cut into runs which fit its share of the
+ * budget; each run is sorted and spilled to an unlinked temporary file through the scheduler's I/O reactor while the
+ * next run is being parsed, so spills overlap with parsing and sorting. Then the runs are merged through a loser tree,
+ * each run streamed in blocks through a double-buffered reader; when there are more runs than blocks fitting the
+ * budget, groups of runs are merged into longer runs first, pass after pass. Sorted binary runs given as input are
+ * merged straight from their files.
+ */
+
+/*!
+ * Size of each of the two buffers text input files are streamed through
+ */
+static const size_t READ_CHUNK_SZ = 1024 * 1024;
+
+/*!
+ * Minimum number of elements of a spilled run, however small the budget
+ */
+static const size_t MIN_RUN_SZ = 64 * 1024;
+
+/*!
+ * Minimum size of the blocks runs are merged in, which bounds the number of runs merged at once
+ */
+static const size_t MIN_BLOCK_SZ = 256 * 1024;
+
+/*!
+ * Alignment of block sizes
+ */
+static const size_t BLOCK_ALIGNMENT = 4096;
+
+/*!
+ * Number of elements popped out of the loser tree at once before being formatted, when merging into text
+ */
+static const size_t TEXT_BATCH_SZ = 64 * 1024;
+
+/*!
+ * Writer of a sequence of sorted runs into a spill file, each run written asynchronously while the next one is built
+ */
+typedef struct {
+    spill_set *set;
+    sort_func sort;
+    size_t file;
+    size_t n_runs;
+
+    signed fd;
+    off_t offset;
+
+    elem_t *bufs[2];
+    elem_t *aux;
+    size_t capacity;
+    unsigned curr;
+
+    coro_io_req req;
+    bool in_flight;
+    const char *flight_buf;
+    size_t flight_nbytes;
+    off_t flight_offset;
+} run_builder;
+
+/*!
+ * Writer of raw elements at an offset, writing one block asynchronously while the next one is filled
+ */
+typedef struct {
+    signed fd;
+    off_t offset;
+
+    elem_t *bufs[2];
+    size_t capacity;
+    size_t len;
+    unsigned curr;
+
+    coro_io_req req;
+    bool in_flight;
+    const char *flight_buf;
+    size_t flight_nbytes;
+    off_t flight_offset;
+} block_writer;
+
+static bool spill_set_add_run(spill_set *set, spill_run run);
+static bool spill_set_add_fd(spill_set *set, int fd);
+static void spill_set_swap(spill_set *a, spill_set *b);
+static void spill_set_sort(spill_set *set);
+static signed spill_run_cmp(const void *a, const void *b);
+static signed spill_file_create(spill_set *set);
+
+static bool sort_text(int fd, run_builder *builder);
+static bool sort_run(int fd, size_t sz, bool sorted, run_builder *builder);
+
+static bool run_builder_open(run_builder *builder, spill_set *set, sort_func sort, size_t file, size_t capacity);
+static bool run_builder_spill(run_builder *builder, size_t sz, bool sorted);
+static bool run_builder_close(run_builder *builder);
+
+static bool merge_runs(const spill_run *runs, size_t k, size_t budget, int fd, off_t offset, bool text);
+static bool merge_refill(loser_tree *tree, stream_reader *readers);
+
+static bool block_writer_open(block_writer *writer, int fd, off_t offset, size_t capacity);
+static bool block_writer_flush(block_writer *writer);
+static bool block_writer_close(block_writer *writer);
+
+static bool write_submit(coro_io_req *req, int fd, const char *buf, size_t nbytes, off_t offset);
+static bool write_await(coro_io_req *req, int fd, const char *buf, size_t nbytes, off_t offset);
+static bool read_full(int fd, void *buf, size_t nbytes, off_t offset);
+static void elems_to_le(elem_t *elems, size_t sz);
+static void elems_from_le(elem_t *elems, size_t sz);
+
+/*!
+ * @param set [out]
+ *
+ * @return true on success, false otherwise
+ */
+bool spill_set_init(spill_set *set)
+{
+    assert(set != NULL);
+
+    set->runs = NULL;
+    set->n_runs = set->runs_capacity = 0;
+    set->fds = NULL;
+    set->n_fds = set->fds_capacity = 0;
+
+    errno = pthread_mutex_init(&set->lock, NULL);
+    if (errno != 0) HANDLE_ERROR("pthread_mutex_init: ", { return false; });
+
+    return true;
+}
+
+/*!
+ * Cleans up a set, closing the files its runs are stored in
+ *
+ * @param set [in, out]
+ */
+void spill_set_cleanup(spill_set *set)
+{
+    assert(set != NULL);
+
+    for (size_t i = 0; i < set->n_fds; ++i) {
+        if (close(set->fds[i]) != 0) HANDLE_ERROR("close: ", {});
+    }
+
+    free_and_null((void **) &set->runs);
+    free_and_null((void **) &set->fds);
+    set->n_runs = set->runs_capacity = 0;
+    set->n_fds = set->fds_capacity = 0;
+
+    pthread_mutex_destroy(&set->lock);
+}
+
+/*!
+ * Cuts a file into sorted runs fitting a memory budget and spills them, to be merged by external_merge()
+ *
+ * @details binary runs which are sorted already are added to the set as they are, without being read
+ *
+ * @param fd     [in] file descriptor of an input file, either a binary run (see run_file.h) or text to be parsed
+ * @param file   [in] index of the input file, which orders its runs among the other files' ones
+ * @param budget [in] memory available to the calling coroutine, in bytes
+ * @param sort   [in] sort kernel
+ * @param set    [in, out] set to add the runs to
+ *
+ * @return true on success, false otherwise
+ *
+ * @attention must be called from a coroutine; the set may keep a duplicate of fd
+ */
+bool external_sort_file(int fd, size_t file, size_t budget, sort_func sort, spill_set *set)
+{
+    assert(sort != NULL);
+    assert(set != NULL);
+
+    run_header header;
+    ssize_t header_sz = coro_io_read(fd, &header, sizeof(header), 0);
+    if (header_sz == -1) HANDLE_ERROR("coro_io_read: ", { return false; });
+
+    size_t sz = 0;
+    bool sorted = false;
+    bool run = run_header_is_run(&header, (size_t) header_sz);
+    if (run && !run_header_decode(&header, &sz, &sorted)) return false;
+
+    if (run && sorted) {
+        signed dup_fd = dup(fd);
+        if (dup_fd == -1) HANDLE_ERROR("dup: ", { return false; });
+        if (!spill_set_add_fd(set, dup_fd)) {
+            close(dup_fd);
+
+            return false;
+        }
+
+        return spill_set_add_run(set, (spill_run) {.fd = dup_fd, .offset = sizeof(header), .sz = sz, .file = file});
+    }
+
+    size_t reserved = run ? 0 : 2 * READ_CHUNK_SZ;
+    size_t capacity = (budget > reserved) ? (budget - reserved) / (3 * sizeof(elem_t)) : 0;
+    if (capacity < MIN_RUN_SZ) capacity = MIN_RUN_SZ;
+    if (run && (capacity > sz)) capacity = (sz != 0) ? sz : 1;
+
+    run_builder builder;
+    if (!run_builder_open(&builder, set, sort, file, capacity)) return false;
+
+    bool ok = run ? sort_run(fd, sz, sorted, &builder) : sort_text(fd, &builder);
+
+    return run_builder_close(&builder) && ok;
+}
+
+/*!
+ * Merges spilled runs within a memory budget, writing the result as text or as a binary run
+ *
+ * @details merges as many runs at once as there are blocks of at least MIN_BLOCK_SZ fitting the budget, two per run
+ * being read and two for the output; while there are more runs than that, groups of consecutive runs are merged into
+ * runs spilled to a new file, and the set is replaced by the runs of the new file
+ * @details the runs are put in the order of their files first, the loser tree breaking ties by run, so the merge is
+ * stable
+ *
+ * @param set    [in, out] runs to merge
+ * @param budget [in] memory available to the merge, in bytes
+ * @param fd     [in] file descriptor of a regular file to write to, at its beginning
+ * @param binary [in] whether to write a binary run (see run_file.h) instead of text
+ *
+ * @return true on success, false otherwise
+ *
+ * @attention must be called from a coroutine
+ */
+bool external_merge(spill_set *set, size_t budget, int fd, bool binary)
+{
+    assert(set != NULL);
+
+    size_t fan_in = budget / (2 * MIN_BLOCK_SZ);
+    fan_in = (fan_in > 3) ? fan_in - 1 : 2;
+
+    spill_set_sort(set);
+
+    while (set->n_runs > fan_in) {
+        spill_set next;
+        if (!spill_set_init(&next)) return false;
+
+        signed spill_fd = spill_file_create(&next);
+        if (spill_fd == -1) goto cleanup_next;
+
+        size_t n_groups = (set->n_runs + fan_in - 1) / fan_in;
+        off_t offset = 0;
+        for (size_t i = 0; i < n_groups; ++i) {
+            size_t begin = set->n_runs * i / n_groups;
+            size_t end = set->n_runs * (i + 1) / n_groups;
+
+            size_t sz = 0;
+            for (size_t j = begin; j < end; ++j) {
+                sz += set->runs[j].sz;
+            }
+
+            if (!merge_runs(set->runs + begin, end - begin, budget, spill_fd, offset, false)) goto cleanup_next;
+            spill_run run = {.fd = spill_fd, .offset = offset, .sz = sz, .seq = i};
+            if (!spill_set_add_run(&next, run)) goto cleanup_next;
+            offset += (off_t) (sz * sizeof(elem_t));
+        }
+
+        spill_set_swap(set, &next);
+        spill_set_cleanup(&next);
+        continue;
+
+    cleanup_next:
+        spill_set_cleanup(&next);
+
+        return false;
+    }
+
+    if (!binary) return merge_runs(set->runs, set->n_runs, budget, fd, 0, true);
+
+    size_t sz = 0;
+    for (size_t i = 0; i < set->n_runs; ++i) {
+        sz += set->runs[i].sz;
+    }
+    if (!run_write_header(fd, sz, true)) return false;
+
+    return merge_runs(set->runs, set->n_runs, budget, fd, sizeof(run_header), false);
+}
+
+/*!
+ * @param set [in, out]
+ * @param run [in]
+ *
+ * @return true on success, false otherwise
+ */
+bool spill_set_add_run(spill_set *set, spill_run run)
+{
+    bool ok = true;
+
+    pthread_mutex_lock(&set->lock);
+    if (set->n_runs == set->runs_capacity) {
+        size_t capacity = (set->runs_capacity != 0) ? set->runs_capacity * 2 : 16;
+        spill_run *runs = realloc(set->runs, capacity * sizeof(*runs));
+        if (runs == NULL) {
+            HANDLE_ERROR("realloc: ", { ok = false; });
+        } else {
+            set->runs = runs;
+            set->runs_capacity = capacity;
+        }
+    }
+    if (ok) set->runs[set->n_runs++] = run;
+    pthread_mutex_unlock(&set->lock);
+
+    return ok;
+}
+
+/*!
+ * Hands a file descriptor over to a set
+ *
+ * @param set [in, out]
+ * @param fd  [in]
+ *
+ * @return true on success, false otherwise, in which case the file descriptor is left to the caller
+ */
+bool spill_set_add_fd(spill_set *set, int fd)
+{
+    bool ok = true;
+
+    pthread_mutex_lock(&set->lock);
+    if (set->n_fds == set->fds_capacity) {
+        size_t capacity = (set->fds_capacity != 0) ? set->fds_capacity * 2 : 16;
+        signed *fds = realloc(set->fds, capacity * sizeof(*fds));
+        if (fds == NULL) {
+            HANDLE_ERROR("realloc: ", { ok = false; });
+        } else {
+            set->fds = fds;
+            set->fds_capacity = capacity;
+        }
+    }
+    if (ok) set->fds[set->n_fds++] = fd;
+    pthread_mutex_unlock(&set->lock);
+
+    return ok;
+}
+
+/*!
+ * Swaps the runs and the files of two sets
+ *
+ * @param a [in, out]
+ * @param b [in, out]
+ */
+void spill_set_swap(spill_set *a, spill_set *b)
+{
+    spill_set tmp = *a;
+
+    a->runs = b->runs;
+    a->n_runs = b->n_runs;
+    a->runs_capacity = b->runs_capacity;
+    a->fds = b->fds;
+    a->n_fds = b->n_fds;
+    a->fds_capacity = b->fds_capacity;
+
+    b->runs = tmp.runs;
+    b->n_runs = tmp.n_runs;
+    b->runs_capacity = tmp.runs_capacity;
+    b->fds = tmp.fds;
+    b->n_fds = tmp.n_fds;
+    b->fds_capacity = tmp.fds_capacity;
+}
+
+/*!
+ * Puts the runs of a set in the order of their files and of their positions within the files
+ *
+ * @param set [in, out]
+ */
+void spill_set_sort(spill_set *set)
+{
+    qsort(set->runs, set->n_runs, sizeof(*set->runs), spill_run_cmp);
+}
+
+/*!
+ * @param a [in] pointer to a spill_run
+ * @param b [in] pointer to a spill_run
+ *
+ * @return negative, zero or positive as a goes before, along with or after b in the input
+ */
+signed spill_run_cmp(const void *a, const void *b)
+{
+    const spill_run *run_a = a;
+    const spill_run *run_b = b;
+
+    if (run_a->file != run_b->file) return (run_a->file < run_b->file) ? -1 : 1;
+    if (run_a->seq != run_b->seq) return (run_a->seq < run_b->seq) ? -1 : 1;
+    return 0;
+}
+
+/*!
+ * Creates a temporary file in $TMPDIR (or /tmp) and unlinks it right away, so that it's gone once it's closed
+ *
+ * @param set [in, out] set to hand the file over to
+ *
+ * @return file descriptor, -1 on failure
+ */
+signed spill_file_create(spill_set *set)
+{
+    const char *dir = getenv("TMPDIR");
+    if ((dir == NULL) || (*dir == '\0')) dir = "/tmp";
+
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s/cms-spill-XXXXXX", dir) >= (signed) sizeof(path)) {
+        errno = ENAMETOOLONG;
+        HANDLE_ERROR("snprintf: ", { return -1; });
+    }
+
+    signed fd = mkstemp(path);
+    if (fd == -1) HANDLE_ERROR("mkstemp: ", { return -1; });
+    if (unlink(path) != 0) HANDLE_ERROR("unlink: ", {});
+
+    if (!spill_set_add_fd(set, fd)) {
+        close(fd);
+
+        return -1;
+    }
+
+    return fd;
+}
+
+/*!
+ * Parses a text file into runs
+ *
+ * @details chunks are fed to the parser in parts short enough for the numbers they complete to fit the run, a number
+ * taking at least two bytes with its delimiter
+ *
+ * @param fd      [in]
+ * @param builder [in, out]
+ *
+ * @return true on success, false otherwise
+ */
+bool sort_text(int fd, run_builder *builder)
+{
+    stream_reader reader;
+    if (!stream_reader_open(&reader, fd, READ_CHUNK_SZ)) return false;
+
+    elem_parser parser;
+    elem_parser_init(&parser);
+    elem_parser_reset(&parser, builder->bufs[builder->curr], builder->capacity);
+
+    bool ok = false;
+    const char *chunk = NULL;
+    ssize_t chunk_sz = 0;
+    while ((chunk_sz = stream_reader_next(&reader, &chunk)) > 0) {
+        for (size_t fed = 0; fed < (size_t) chunk_sz;) {
+            size_t room = builder->capacity - parser.sz;
+            builder->bufs[builder->curr] = parser.elems;
+
+            if (room == 0) {
+                if (!run_builder_spill(builder, parser.sz, false)) goto cleanup;
+                elem_parser_reset(&parser, builder->bufs[builder->curr], builder->capacity);
+                continue;
+            }
+
+            size_t len = ((size_t) chunk_sz - fed < 2 * room - 1) ? (size_t) chunk_sz - fed : 2 * room - 1;
+            if (!elem_parser_feed(&parser, chunk + fed, len)) goto cleanup;
+            fed += len;
+        }
+    }
+    if (chunk_sz == -1) goto cleanup;
+
+    builder->bufs[builder->curr] = parser.elems;
+    if (parser.sz == builder->capacity) {
+        if (!run_builder_spill(builder, parser.sz, false)) goto cleanup;
+        elem_parser_reset(&parser, builder->bufs[builder->curr], builder->capacity);
+    }
+
+    elem_t *elems = NULL;
+    size_t sz = 0;
+    if (!elem_parser_finish(&parser, &elems, &sz)) goto cleanup;
+    builder->bufs[builder->curr] = elems;
+
+    ok = run_builder_spill(builder, sz, false);
+
+cleanup:
+    if (parser.elems != NULL) builder->bufs[builder->curr] = parser.elems;
+    stream_reader_close(&reader);
+
+    return ok;
+}
+
+/*!
+ * Reads a binary run into runs
+ *
+ * @param fd      [in] file descriptor of a run file
+ * @param sz      [in] number of elements of the run
+ * @param sorted  [in] whether the run is sorted
+ * @param builder [in, out]
+ *
+ * @return true on success, false otherwise
+ */
+bool sort_run(int fd, size_t sz, bool sorted, run_builder *builder)
+{
+    for (size_t done = 0; done < sz;) {
+        size_t n = (sz - done < builder->capacity) ? sz - done : builder->capacity;
+        elem_t *buf = builder->bufs[builder->curr];
+
+        if (!read_full(fd, buf, n * sizeof(*buf), (off_t) (sizeof(run_header) + done * sizeof(*buf)))) return false;
+        elems_from_le(buf, n);
+        if (!run_builder_spill(builder, n, sorted)) return false;
+
+        done += n;
+    }
+
+    return true;
+}
+
+/*!
+ * @param builder  [out]
+ * @param set      [in, out] set to add runs to
+ * @param sort     [in] sort kernel
+ * @param file     [in] index of the input file the runs are cut from
+ * @param capacity [in] maximum number of elements of a run
+ *
+ * @return true on success, false otherwise
+ */
+bool run_builder_open(run_builder *builder, spill_set *set, sort_func sort, size_t file, size_t capacity)
+{
+    builder->set = set;
+    builder->sort = sort;
+    builder->file = file;
+    builder->n_runs = 0;
+    builder->fd = -1;
+    builder->offset = 0;
+    builder->capacity = capacity;
+    builder->curr = 0;
+    builder->in_flight = false;
+
+    builder->bufs[0] = malloc(capacity * sizeof(elem_t));
+    builder->bufs[1] = malloc(capacity * sizeof(elem_t));
+    if ((builder->bufs[0] == NULL) || (builder->bufs[1] == NULL)) {
+        HANDLE_ERROR("malloc: ", {
+            free_and_null((void **) &builder->bufs[0]);
+            free_and_null((void **) &builder->bufs[1]);
+            return false;
+        });
+    }
+    if ((builder->aux = coro_arena_alloc(capacity * sizeof(elem_t))) == NULL) {
+        free_and_null((void **) &builder->bufs[0]);
+        free_and_null((void **) &builder->bufs[1]);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * Sorts the run in the current buffer and submits its write, switching to the other buffer once its own write, if
+ * any, is completed
+ *
+ * @param builder [in, out]
+ * @param sz      [in] number of elements in the current buffer
+ * @param sorted  [in] whether they are sorted already
+ *
+ * @return true on success, false otherwise
+ */
+bool run_builder_spill(run_builder *builder, size_t sz, bool sorted)
+{
+    if (sz == 0) return true;
+
+    elem_t *run = builder->bufs[builder->curr];
+    if (!sorted) builder->sort(run, builder->aux, sz);
+    elems_to_le(run, sz);
+
+    if ((builder->fd == -1) && ((builder->fd = spill_file_create(builder->set)) == -1)) return false;
+    spill_run spilled = {
+        .fd = builder->fd, .offset = builder->offset, .sz = sz, .file = builder->file, .seq = builder->n_runs++
+    };
+    if (!spill_set_add_run(builder->set, spilled)) return false;
+
+    if (builder->in_flight) {
+        builder->in_flight = false;
+        if (!write_await(&builder->req, builder->fd, builder->flight_buf, builder->flight_nbytes, builder->flight_offset)) {
+            return false;
+        }
+    }
+
+    builder->flight_buf = (const char *) run;
+    builder->flight_nbytes = sz * sizeof(*run);
+    builder->flight_offset = builder->offset;
+    if (!write_submit(&builder->req, builder->fd, builder->flight_buf, builder->flight_nbytes, builder->offset)) {
+        return false;
+    }
+    builder->in_flight = true;
+
+    builder->offset += (off_t) builder->flight_nbytes;
+    builder->curr ^= 1;
+
+    return true;
+}
+
+/*!
+ * Waits for the write in flight, if any, and frees the builder's buffers
+ *
+ * @param builder [in, out]
+ *
+ * @return true on success, false otherwise
+ */
+bool run_builder_close(run_builder *builder)
+{
+    bool ok = true;
+    if (builder->in_flight) {
+        ok = write_await(&builder->req, builder->fd, builder->flight_buf, builder->flight_nbytes, builder->flight_offset);
+    }
+    builder->in_flight = false;
+
+    free_and_null((void **) &builder->bufs[0]);
+    free_and_null((void **) &builder->bufs[1]);
+    coro_arena_release(builder->aux);
+    builder->aux = NULL;
+
+    return ok;
+}
+
+/*!
+ * Merges runs through a loser tree, streaming each of them in blocks
+ *
+ * @param runs   [in]
+ * @param k      [in] number of runs
+ * @param budget [in] memory available to the merge, in bytes
+ * @param fd     [in] file descriptor to write to
+ * @param offset [in] offset at which to write
+ * @param text   [in] whether to write text rather than raw little-endian elements
+ *
+ * @return true on success, false otherwise
+ */
+bool merge_runs(const spill_run *runs, size_t k, size_t budget, int fd, off_t offset, bool text)
+{
+    size_t block_sz = budget / (2 * (k + 1)) / BLOCK_ALIGNMENT * BLOCK_ALIGNMENT;
+    if (block_sz < BLOCK_ALIGNMENT) block_sz = BLOCK_ALIGNMENT;
+
+    bool ok = false;
+    size_t n_open = 0;
+    merge_run *heads = calloc(k + 1, sizeof(*heads));
+    stream_reader *readers = calloc(k + 1, sizeof(*readers));
+    if ((heads == NULL) || (readers == NULL)) HANDLE_ERROR("calloc: ", { goto cleanup; });
+
+    for (; n_open < k; ++n_open) {
+        off_t begin = runs[n_open].offset;
+        off_t end = begin + (off_t) (runs[n_open].sz * sizeof(elem_t));
+        if (!stream_reader_open_range(&readers[n_open], runs[n_open].fd, block_sz, begin, end)) goto cleanup;
+    }
+    for (size_t i = 0; i < k; ++i) {
+        const char *chunk = NULL;
+        ssize_t chunk_sz = stream_reader_next(&readers[i], &chunk);
+        if ((chunk_sz == -1) || (chunk_sz % sizeof(elem_t) != 0)) goto cleanup;
+
+        elems_from_le((elem_t *) chunk, (size_t) chunk_sz / sizeof(elem_t));
+        heads[i] = (chunk_sz != 0) ? (merge_run) {.begin = (const elem_t *) chunk, .end = (const elem_t *) (chunk + chunk_sz)}
+                                   : (merge_run) {.begin = NULL, .end = NULL};
+    }
+
+    loser_tree tree;
+    size_t drained = 0;
+    if (!loser_tree_init(&tree, heads, k)) goto cleanup;
+
+    if (text) {
+        text_writer writer;
+        elem_t *batch = malloc(TEXT_BATCH_SZ * sizeof(*batch));
+        if (batch == NULL) HANDLE_ERROR("malloc: ", { goto cleanup_tree; });
+        if (!text_writer_open(&writer, fd, offset, false)) {
+            free(batch);
+            goto cleanup_tree;
+        }
+
+        for (ok = true; ok;) {
+            size_t n_popped = loser_tree_pop(&tree, batch, TEXT_BATCH_SZ);
+            ok = text_writer_write(&writer, batch, n_popped);
+            if (ok && loser_tree_drained(&tree, &drained)) {
+                ok = merge_refill(&tree, readers);
+            } else if (n_popped < TEXT_BATCH_SZ) {
+                break;
+            }
+        }
+
+        if (!text_writer_close(&writer)) ok = false;
+        free(batch);
+    } else {
+        block_writer writer;
+        if (!block_writer_open(&writer, fd, offset, block_sz / sizeof(elem_t))) goto cleanup_tree;
+
+        for (ok = true; ok;) {
+            size_t max = writer.capacity - writer.len;
+            size_t n_popped = loser_tree_pop(&tree, writer.bufs[writer.curr] + writer.len, max);
+            writer.len += n_popped;
+
+            if (writer.len == writer.capacity) ok = block_writer_flush(&writer);
+            if (ok && loser_tree_drained(&tree, &drained)) {
+                ok = merge_refill(&tree, readers);
+            } else if (n_popped < max) {
+                break;
+            }
+        }
+
+        if (!block_writer_close(&writer)) ok = false;
+    }
+
+cleanup_tree:
+    loser_tree_cleanup(&tree);
+
+cleanup:
+    for (size_t i = 0; i < n_open; ++i) {
+        stream_reader_close(&readers[i]);
+    }
+    free_and_null((void **) &readers);
+    free_and_null((void **) &heads);
+
+    return ok;
+}
+
+/*!
+ * Refills the run drained by the last pop with its next block, leaving it exhausted at its end
+ *
+ * @param tree    [in, out]
+ * @param readers [in, out] readers of the runs
+ *
+ * @return true on success, false otherwise
+ */
+bool merge_refill(loser_tree *tree, stream_reader *readers)
+{
+    size_t run = 0;
+    loser_tree_drained(tree, &run);
+
+    const char *chunk = NULL;
+    ssize_t chunk_sz = stream_reader_next(&readers[run], &chunk);
+    if (chunk_sz == -1) return false;
+    if (chunk_sz % sizeof(elem_t) != 0) {
+        errno = EIO;
+        HANDLE_ERROR("spilled run: ", { return false; });
+    }
+    if (chunk_sz == 0) return true;
+
+    elems_from_le((elem_t *) chunk, (size_t) chunk_sz / sizeof(elem_t));
+    loser_tree_refill(tree, (const elem_t *) chunk, (const elem_t *) (chunk + chunk_sz));
+
+    return true;
+}
+
+/*!
+ * @param writer   [out]
+ * @param fd       [in]
+ * @param offset   [in] offset at which to start writing
+ * @param capacity [in] number of elements of each of the two blocks
+ *
+ * @return true on success, false otherwise
+ */
+bool block_writer_open(block_writer *writer, int fd, off_t offset, size_t capacity)
+{
+    writer->fd = fd;
+    writer->offset = offset;
+    writer->capacity = capacity;
+    writer->len = 0;
+    writer->curr = 0;
+    writer->in_flight = false;
+
+    writer->bufs[0] = malloc(capacity * sizeof(elem_t));
+    writer->bufs[1] = malloc(capacity * sizeof(elem_t));
+    if ((writer->bufs[0] == NULL) || (writer->bufs[1] == NULL)) {
+        HANDLE_ERROR("malloc: ", {
+            free_and_null((void **) &writer->bufs[0]);
+            free_and_null((void **) &writer->bufs[1]);
+            return false;
+        });
+    }
+
+    return true;
+}
+
+/*!
+ * Submits the write of the current block once the write of the other one is completed, then switches to the other one
+ *
+ * @param writer [in, out]
+ *
+ * @return true on success, false otherwise
+ */
+bool block_writer_flush(block_writer *writer)
+{
+    if (writer->in_flight) {
+        writer->in_flight = false;
+        if (!write_await(&writer->req, writer->fd, writer->flight_buf, writer->flight_nbytes, writer->flight_offset)) {
+            return false;
+        }
+    }
+    if (writer->len == 0) return true;
+
+    elem_t *block = writer->bufs[writer->curr];
+    elems_to_le(block, writer->len);
+
+    writer->flight_buf = (const char *) block;
+    writer->flight_nbytes = writer->len * sizeof(*block);
+    writer->flight_offset = writer->offset;
+    if (!write_submit(&writer->req, writer->fd, writer->flight_buf, writer->flight_nbytes, writer->offset)) return false;
+    writer->in_flight = true;
+
+    writer->offset += (off_t) writer->flight_nbytes;
+    writer->len = 0;
+    writer->curr ^= 1;
+
+    return true;
+}
+
+/*!
+ * Writes out the current block, waits for the writes in flight and frees the writer's blocks
+ *
+ * @param writer [in, out]
+ *
+ * @return true on success, false otherwise
+ */
+bool block_writer_close(block_writer *writer)
+{
+    bool ok = block_writer_flush(writer);
+    if (writer->in_flight) {
+        if (!write_await(&writer->req, writer->fd, writer->flight_buf, writer->flight_nbytes, writer->flight_offset)) {
+            ok = false;
+        }
+    }
+    writer->in_flight = false;
+
+    free_and_null((void **) &writer->bufs[0]);
+    free_and_null((void **) &writer->bufs[1]);
+
+    return ok;
+}
+
+/*!
+ * Submits a write through the scheduler's I/O reactor
+ *
+ * @param req    [out]
+ * @param fd     [in]
+ * @param buf    [in]
+ * @param nbytes [in]
+ * @param offset [in]
+ *
+ * @return true on success, false otherwise
+ */
+bool write_submit(coro_io_req *req, int fd, const char *buf, size_t nbytes, off_t offset)
+{
+    if (!coro_io_submit_write(req, fd, buf, nbytes, offset)) HANDLE_ERROR("coro_io_submit_write: ", { return false; });
+
+    return true;
+}
+
+/*!
+ * Waits for a submitted write, then writes whatever it left out
+ *
+ * @param req    [in, out]
+ * @param fd     [in]
+ * @param buf    [in] buffer of the submitted write
+ * @param nbytes [in] size of the submitted write
+ * @param offset [in] offset of the submitted write
+ *
+ * @return true on success, false otherwise
+ */
+bool write_await(coro_io_req *req, int fd, const char *buf, size_t nbytes, off_t offset)
+{
+    for (ssize_t n_written = coro_io_await(req);; n_written = coro_io_write(fd, buf, nbytes, offset)) {
+        if (n_written == -1) HANDLE_ERROR("coro_io_write: ", { return false; });
+
+        buf += n_written;
+        nbytes -= (size_t) n_written;
+        offset += n_written;
+        if (nbytes == 0) return true;
+    }
+}
+
+/*!
+ * Reads a buffer in full through the scheduler's I/O reactor
+ *
+ * @param fd     [in]
+ * @param buf    [out]
+ * @param nbytes [in]
+ * @param offset [in]
+ *
+ * @return true on success, false otherwise (including a premature end of the file)
+ */
+bool read_full(int fd, void *buf, size_t nbytes, off_t offset)
+{
+    for (char *reader = buf; nbytes != 0;) {
+        ssize_t n_read = coro_io_read(fd, reader, nbytes, offset);
+        if (n_read == -1) HANDLE_ERROR("coro_io_read: ", { return false; });
+        if (n_read == 0) {
+            errno = EPROTO;
+            HANDLE_ERROR("run size: ", { return false; });
+        }
+
+        reader += n_read;
+        nbytes -= (size_t) n_read;
+        offset += n_read;
+    }
+
+    return true;
+}
+
+/*!
+ * Converts elements to little-endian in place
+ *
+ * @param elems [in, out]
+ * @param sz    [in]
+ */
+void elems_to_le(elem_t *elems, size_t sz)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    for (size_t i = 0; i < sz; ++i) {
+        elems[i] = elem_swap_le(elems[i]);
+    }
+#endif
+}
+
+/*!
+ * Converts elements from little-endian in place
+ *
+ * @param elems [in, out]
+ * @param sz    [in]
+ */
+void elems_from_le(elem_t *elems, size_t sz)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    for (size_t i = 0; i < sz; ++i) {
+        elems[i] = elem_swap_le(elems[i]);
+    }
+#endif
+}
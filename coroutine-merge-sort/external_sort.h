@@ -0,0 +1,54 @@
+#ifndef EXTERNAL_SORT_H
+#define EXTERNAL_SORT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+#include "elem.h"
+
+/*!
+ * Sorted run spilled to a file, its elements stored as raw little-endian values (as in binary runs, see run_file.h)
+ *
+ * @details runs are merged in the order of their input files and of their positions within the files, so that equal
+ * elements keep their input order whichever coroutine spilled its runs first
+ */
+typedef struct {
+    signed fd;
+    off_t offset;
+    size_t sz;
+    size_t file;
+    size_t seq;
+} spill_run;
+
+/*!
+ * Set of spilled runs, which coroutines on any of the scheduler's workers add runs to
+ *
+ * @details owns the file descriptors the runs are stored in
+ */
+typedef struct {
+    pthread_mutex_t lock;
+
+    spill_run *runs;
+    size_t n_runs;
+    size_t runs_capacity;
+
+    signed *fds;
+    size_t n_fds;
+    size_t fds_capacity;
+} spill_set;
+
+/*!
+ * Sort kernel, which leaves the result in arr
+ */
+typedef void (*sort_func)(elem_t *restrict arr, elem_t *restrict aux, size_t sz);
+
+bool spill_set_init(spill_set *set);
+void spill_set_cleanup(spill_set *set);
+
+bool external_sort_file(int fd, size_t file, size_t budget, sort_func sort, spill_set *set);
+bool external_merge(spill_set *set, size_t budget, int fd, bool binary);
+
+#endif /* EXTERNAL_SORT_H */
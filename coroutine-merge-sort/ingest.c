@@ -0,0 +1,200 @@
+#include "ingest.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "coro_arena.h"
+#include "coro_io.h"
+#include "elem_parser.h"
+#include "errors.h"
+#include "run_file.h"
+#include "stream_reader.h"
+
+/*!
+ * Largest size of each of the two buffers input files are streamed through
+ */
+static const size_t MAX_CHUNK_SZ = 1024 * 1024;
+
+/*!
+ * Smallest size of each of the two buffers input files are streamed through
+ */
+static const size_t MIN_CHUNK_SZ = 64 * 1024;
+
+/*!
+ * Memory shared by the buffers of the files streamed at once, unless they are given MIN_CHUNK_SZ already
+ */
+static const size_t STREAM_BUDGET = 16 * 1024 * 1024;
+
+/*!
+ * Size of each of the two buffers input files are streamed through (see ingest_share_budget())
+ */
+static size_t chunk_sz = MAX_CHUNK_SZ;
+
+/*!
+ * Sizes the buffers input files are streamed through, so that all of them fit the streaming budget together
+ *
+ * @details every file being streamed holds two buffers, which are halved from MAX_CHUNK_SZ down to MIN_CHUNK_SZ
+ * until they fit
+ *
+ * @param n_files [in] number of files streamed at once
+ */
+void ingest_share_budget(size_t n_files)
+{
+    chunk_sz = MAX_CHUNK_SZ;
+    while ((chunk_sz > MIN_CHUNK_SZ) && (2 * chunk_sz * n_files > STREAM_BUDGET)) {
+        chunk_sz /= 2;
+    }
+}
+
+/*!
+ * Gets numbers from a file, which is either a binary run (see run_file.h) or text to be parsed
+ *
+ * @param mode   [in] how to get the file into memory
+ * @param fd     [in] file descriptor to read from
+ * @param elems  [out] numbers, expected to be NULL
+ * @param sz     [out] number of numbers
+ * @param sorted [out] whether the numbers are known to be sorted already
+ *
+ * @return true on success, false otherwise
+ *
+ * @attention dynamically allocates elems, therefore the caller is responsible for freeing it
+ */
+bool ingest_file(ingest_mode mode, int fd, elem_t **elems, size_t *sz, bool *sorted)
+{
+    switch (mode) {
+        case INGEST_MMAP:
+            return ingest_mmap(fd, elems, sz, sorted);
+        case INGEST_STREAM:
+        default:
+            return ingest_stream(fd, elems, sz, sorted);
+    }
+}
+
+/*!
+ * Streams a file through the scheduler's I/O reactor chunk by chunk, parsing each chunk while the next one is read
+ *
+ * @param fd     [in] file descriptor to read from
+ * @param elems  [out] numbers, expected to be NULL
+ * @param sz     [out] number of numbers
+ * @param sorted [out] whether the numbers are known to be sorted already
+ *
+ * @return true on success, false otherwise
+ *
+ * @note binary runs are read straight into the array
+ *
+ * @attention dynamically allocates elems, therefore the caller is responsible for freeing it
+ */
+bool ingest_stream(int fd, elem_t **elems, size_t *sz, bool *sorted)
+{
+    assert(elems != NULL);
+    assert(*elems == NULL);
+    assert(sz != NULL);
+    assert(sorted != NULL);
+
+    run_header header;
+    ssize_t header_sz = coro_io_read(fd, &header, sizeof(header), 0);
+    if (header_sz == -1) HANDLE_ERROR("coro_io_read: ", { return false; });
+    if (run_header_is_run(&header, (size_t) header_sz)) return run_read(fd, elems, sz, sorted);
+
+    *sorted = false;
+
+    stream_reader reader;
+    if (!stream_reader_open(&reader, fd, chunk_sz)) return false;
+
+    elem_parser parser;
+    elem_parser_init(&parser);
+
+    const char *chunk = NULL;
+    ssize_t n_read = 0;
+    while ((n_read = stream_reader_next(&reader, &chunk)) > 0) {
+        if (!elem_parser_feed(&parser, chunk, (size_t) n_read)) goto cleanup;
+    }
+    if (n_read == -1) goto cleanup;
+    if (!elem_parser_finish(&parser, elems, sz)) goto cleanup;
+
+    stream_reader_close(&reader);
+
+    return true;
+
+cleanup:
+    elem_parser_cleanup(&parser);
+    stream_reader_close(&reader);
+
+    return false;
+}
+
+/*!
+ * Maps a file and parses it straight from the page cache, skipping the copy into a read buffer
+ *
+ * @param fd     [in] file descriptor of a regular file
+ * @param elems  [out] numbers, expected to be NULL
+ * @param sz     [out] number of numbers
+ * @param sorted [out] whether the numbers are known to be sorted already
+ *
+ * @return true on success, false otherwise
+ *
+ * @note binary runs are copied out of the mapping as they are
+ *
+ * @attention dynamically allocates elems, therefore the caller is responsible for freeing it
+ * @attention page faults on the mapping are served synchronously, stalling the worker rather than just the coroutine,
+ * so this mode suits files which are local and mostly cached; MADV_SEQUENTIAL makes the kernel read ahead aggressively
+ * and drop pages behind the parser
+ */
+bool ingest_mmap(int fd, elem_t **elems, size_t *sz, bool *sorted)
+{
+    assert(elems != NULL);
+    assert(*elems == NULL);
+    assert(sz != NULL);
+    assert(sorted != NULL);
+
+    *sorted = false;
+
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) HANDLE_ERROR("fstat: ", { return false; });
+    size_t file_sz = (size_t) stat_buf.st_size;
+
+    if (file_sz == 0) {
+        *sz = 0;
+
+        return true;
+    }
+
+    const char *map = mmap(NULL, file_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) HANDLE_ERROR("mmap: ", { return false; });
+    if (madvise((void *) map, file_sz, MADV_SEQUENTIAL) != 0) HANDLE_ERROR("madvise: ", {});
+
+    if (run_header_is_run(map, file_sz)) {
+        munmap((void *) map, file_sz);
+
+        run_mapping mapping;
+        if (!run_map(fd, &mapping)) return false;
+
+        bool ok = (*elems = malloc((mapping.sz != 0) ? mapping.sz * sizeof(**elems) : 1)) != NULL;
+        if (ok) {
+            coro_arena_advise(*elems, mapping.sz * sizeof(**elems));
+            memcpy(*elems, mapping.elems, mapping.sz * sizeof(**elems));
+            *sz = mapping.sz;
+            *sorted = mapping.sorted;
+        } else {
+            HANDLE_ERROR("malloc: ", {});
+        }
+        run_unmap(&mapping);
+
+        return ok;
+    }
+
+    elem_parser parser;
+    elem_parser_init(&parser);
+
+    bool ok = elem_parser_feed(&parser, map, file_sz) && elem_parser_finish(&parser, elems, sz);
+    if (!ok) elem_parser_cleanup(&parser);
+
+    if (munmap((void *) map, file_sz) != 0) HANDLE_ERROR("munmap: ", {});
+
+    return ok;
+}
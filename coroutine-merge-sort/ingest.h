@@ -0,0 +1,22 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "elem.h"
+
+/*!
+ * Ways of getting input files into memory
+ */
+typedef enum {
+    INGEST_STREAM,
+    INGEST_MMAP,
+} ingest_mode;
+
+void ingest_share_budget(size_t n_files);
+bool ingest_file(ingest_mode mode, int fd, elem_t **elems, size_t *sz, bool *sorted);
+bool ingest_stream(int fd, elem_t **elems, size_t *sz, bool *sorted);
+bool ingest_mmap(int fd, elem_t **elems, size_t *sz, bool *sorted);
+
+#endif /* INGEST_H */
@@ -0,0 +1,200 @@
+#include "loser_tree.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dynamic_memory_management.h"
+#include "errors.h"
+
+/*
+ * A key orders runs by their heads, then by their indices, so that the merge is stable, while exhausted runs lose to
+ * every other run: the top bit flags an exhausted run, the next 32 or 64 bits hold the key of the head (see elem.h)
+ * and the low bits hold the index. Keys of 64-bit elements take 128 bits, which still compare without branches.
+ */
+
+static const unsigned KEY_INDEX_BITS = 31;
+static const tree_key KEY_INDEX_MASK = ((tree_key) 1 << 31) - 1;
+static const tree_key KEY_EXHAUSTED = (tree_key) 1 << (sizeof(tree_key) * 8 - 1);
+
+_Static_assert(ELEM_KEY_BITS + 31 < sizeof(tree_key) * 8, "run keys must fit a head's key, an index and a flag");
+
+static inline tree_key run_key(const loser_tree *tree, size_t run);
+static inline tree_key replay(loser_tree *tree, size_t run);
+
+/*!
+ * Sets up a tree, playing the initial tournament
+ *
+ * @param tree [out]
+ * @param runs [in] sorted runs to merge, copied into the tree
+ * @param k    [in] number of runs, below 2^31
+ *
+ * @return true on success, false otherwise
+ *
+ * @attention the runs' elements are not copied, therefore they must stay alive until the tree is cleaned up
+ */
+bool loser_tree_init(loser_tree *tree, const merge_run *runs, size_t k)
+{
+    assert(tree != NULL);
+    assert((runs != NULL) || (k == 0));
+    assert(k <= KEY_INDEX_MASK);
+
+    tree->k = k;
+    tree->winner = KEY_EXHAUSTED;
+    tree->drained = false;
+    tree->runs = NULL;
+    tree->losers = NULL;
+    if (k == 0) return true;
+
+    tree_key *winners = NULL;
+    if ((tree->runs = calloc(k, sizeof(*tree->runs))) == NULL) HANDLE_ERROR("calloc: ", { goto cleanup; });
+    if ((tree->losers = calloc(k, sizeof(*tree->losers))) == NULL) HANDLE_ERROR("calloc: ", { goto cleanup; });
+    if ((winners = calloc(2 * k, sizeof(*winners))) == NULL) HANDLE_ERROR("calloc: ", { goto cleanup; });
+
+    memcpy(tree->runs, runs, k * sizeof(*runs));
+
+    for (size_t i = 0; i < k; ++i) {
+        winners[k + i] = run_key(tree, i);
+    }
+    for (size_t node = k - 1; node >= 1; --node) {
+        tree_key a = winners[2 * node];
+        tree_key b = winners[2 * node + 1];
+
+        winners[node] = (a < b) ? a : b;
+        tree->losers[node] = (a < b) ? b : a;
+    }
+    tree->winner = winners[1];
+
+    free_and_null((void **) &winners);
+
+    return true;
+
+cleanup:
+    loser_tree_cleanup(tree);
+
+    return false;
+}
+
+/*!
+ * Pops the smallest elements out of the tree, in sorted order
+ *
+ * @param tree [in, out]
+ * @param out  [out] array to which the elements are written
+ * @param max  [in] maximum number of elements to pop
+ *
+ * @return number of elements popped, less than max if a run was drained (see loser_tree_drained()), 0 once all the
+ * runs are exhausted
+ */
+size_t loser_tree_pop(loser_tree *tree, elem_t *restrict out, size_t max)
+{
+    assert(tree != NULL);
+    assert((out != NULL) || (max == 0));
+
+    tree_key winner = tree->winner;
+    if (tree->drained) {
+        winner = replay(tree, (size_t) (winner & KEY_INDEX_MASK));
+        tree->drained = false;
+    }
+
+    size_t n_popped = 0;
+    while ((n_popped < max) && !(winner & KEY_EXHAUSTED)) {
+        size_t run = (size_t) (winner & KEY_INDEX_MASK);
+
+        out[n_popped++] = *tree->runs[run].begin++;
+        if (tree->runs[run].begin == tree->runs[run].end) {
+            tree->drained = true;
+            break;
+        }
+
+        winner = replay(tree, run);
+    }
+
+    tree->winner = winner;
+
+    return n_popped;
+}
+
+/*!
+ * @param tree [in]
+ * @param run  [out] index of the run drained by the last pop
+ *
+ * @return whether the last pop stopped because it drained a run, which is considered exhausted by the next pop unless
+ * it's refilled with loser_tree_refill() first
+ */
+bool loser_tree_drained(const loser_tree *tree, size_t *run)
+{
+    assert(tree != NULL);
+    assert(run != NULL);
+
+    *run = (size_t) (tree->winner & KEY_INDEX_MASK);
+
+    return tree->drained;
+}
+
+/*!
+ * Gives more elements to the run drained by the last pop
+ *
+ * @param tree  [in, out]
+ * @param begin [in]
+ * @param end   [in]
+ *
+ * @attention the elements must not go before the ones already popped out of the run
+ */
+void loser_tree_refill(loser_tree *tree, const elem_t *begin, const elem_t *end)
+{
+    assert(tree != NULL);
+    assert(tree->drained);
+
+    tree->runs[tree->winner & KEY_INDEX_MASK] = (merge_run) {.begin = begin, .end = end};
+}
+
+/*!
+ * Cleans up a tree
+ *
+ * @param tree [in, out]
+ */
+void loser_tree_cleanup(loser_tree *tree)
+{
+    assert(tree != NULL);
+
+    free_and_null((void **) &tree->runs);
+    free_and_null((void **) &tree->losers);
+    tree->k = 0;
+}
+
+/*!
+ * @param tree [in]
+ * @param run  [in] index of a run
+ *
+ * @return key of the run's head
+ */
+tree_key run_key(const loser_tree *tree, size_t run)
+{
+    const merge_run *merge_run = &tree->runs[run];
+    if (merge_run->begin == merge_run->end) return KEY_EXHAUSTED | run;
+
+    return ((tree_key) elem_key(*merge_run->begin) << KEY_INDEX_BITS) | run;
+}
+
+/*!
+ * Replays the matches on the path of a run whose head changed
+ *
+ * @param tree [in, out]
+ * @param run  [in] index of the run, which must be the last winner
+ *
+ * @return key of the new winner
+ */
+tree_key replay(loser_tree *tree, size_t run)
+{
+    tree_key *losers = tree->losers;
+    tree_key winner = run_key(tree, run);
+
+    for (size_t node = (run + tree->k) / 2; node >= 1; node /= 2) {
+        tree_key loser = losers[node];
+        losers[node] = (loser < winner) ? winner : loser;
+        winner = (loser < winner) ? loser : winner;
+    }
+
+    return winner;
+}
@@ -0,0 +1,51 @@
+#ifndef LOSER_TREE_H
+#define LOSER_TREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "elem.h"
+
+/*!
+ * Sorted run being merged, consumed from begin to end
+ */
+typedef struct {
+    const elem_t *begin;
+    const elem_t *end;
+} merge_run;
+
+/*!
+ * Key of a run within a tree, wide enough for an element's key, a run's index and a flag
+ */
+#if ELEM_KEY_BITS == 32
+typedef uint64_t tree_key;
+#else
+typedef unsigned __int128 tree_key;
+#endif
+
+/*!
+ * Tournament tree of losers merging k sorted runs
+ *
+ * @details internal nodes 1..k-1 hold the runs which lost the match played at them, leaves k..2k-1 stand for the runs
+ * themselves, so popping the overall winner replays only the matches on its path to the root
+ * @details nodes hold keys packing a run's head with the run's index rather than the index alone, so that a match is
+ * a single integer comparison which doesn't touch the runs
+ * @details popping stops whenever a run is drained, so that runs streamed in blocks can be refilled before they're
+ * considered exhausted
+ */
+typedef struct {
+    merge_run *runs;
+    tree_key *losers;
+    size_t k;
+    tree_key winner;
+    bool drained;
+} loser_tree;
+
+bool loser_tree_init(loser_tree *tree, const merge_run *runs, size_t k);
+size_t loser_tree_pop(loser_tree *tree, elem_t *restrict out, size_t max);
+bool loser_tree_drained(const loser_tree *tree, size_t *run);
+void loser_tree_refill(loser_tree *tree, const elem_t *begin, const elem_t *end);
+void loser_tree_cleanup(loser_tree *tree);
+
+#endif /* LOSER_TREE_H */
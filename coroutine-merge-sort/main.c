@@ -1,65 +1,243 @@
-#include <aio.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
-#include <sys/stat.h>
-
 #include "coro.h"
+#include "coro_arena.h"
 #include "dynamic_memory_management.h"
 #include "errors.h"
+#include "external_sort.h"
+#include "ingest.h"
+#include "loser_tree.h"
+#include "merge_path.h"
+#include "run_file.h"
+#include "sort_kernel.h"
+#include "text_writer.h"
+
+/*!
+ * Default size of coroutine stacks, in KiB (stacks are committed lazily, so this mostly reserves address space)
+ */
+static const size_t DEFAULT_STACK_SZ_KIB = 256;
+
+/*!
+ * Whether coroutines are preempted by the scheduler's timer, so that yielding doesn't need to read the clock
+ */
+static bool preemptive = false;
+
+/*!
+ * How input files are read
+ */
+static ingest_mode input_mode = INGEST_STREAM;
+
+/*!
+ * How the arrays being sorted are backed by huge pages (see coro_arena.h)
+ */
+static huge_page_mode huge_pages = HUGE_PAGES_OFF;
+
+/*!
+ * File to write the scheduler's metrics to as JSON (see scheduler_write_metrics()), NULL not to write them
+ */
+static const char *metrics_file_name = NULL;
+
+/*!
+ * Whether the result is written as a binary run (see run_file.h) to 'result.bin' instead of as text to 'result.txt'
+ */
+static bool binary_output = false;
+
+/*!
+ * Memory budget of the external sort, in bytes, 0 to sort in memory
+ *
+ * @details with a budget, every file's coroutine spills sorted runs fitting its share of the budget, and one more
+ * coroutine merges them into the result once all the files are done
+ */
+static size_t memory_budget = 0;
+
+/*!
+ * Whether the sorted files are merged in the background while the rest of the files are still being sorted
+ *
+ * @details one more coroutine merges the files' arrays in groups as soon as they are sorted, until only the last file
+ * is left, so that the final merge has fewer arrays left to merge; it has no effect on the external sort
+ */
+static bool incremental = false;
+
+/*!
+ * Number of arrays merged at once by the incremental merge
+ */
+enum { INCREMENTAL_FAN_IN = 8 };
+
+/*!
+ * Number of levels of groups merged by the incremental merge, the groups of the top level are merged in place
+ */
+enum { INCREMENTAL_LEVELS = 8 };
+
+/*!
+ * Number of numbers merged by the incremental merge between calls to coro_yield()
+ */
+enum { INCREMENTAL_BATCH_SZ = 1024 };
+
+/*!
+ * Indices of the files sorted, sent by their coroutines to the incremental merge
+ */
+static coro_chan sorted_files;
+
+/*!
+ * Slots for sorting in memory, one per worker, taken by the files' coroutines for as long as they hold an aux array
+ *
+ * @details sorting is bound by the CPU, so that sorting more files at once than there are workers gains nothing, while
+ * every file sorted holds an aux array as large as the file's array; with the slots, the arena hands the same few aux
+ * arrays from file to file
+ */
+static coro_chan sort_slots;
 
+/*!
+ * Runs spilled by the external sort
+ */
+static spill_set spills;
+
+/*!
+ * Number of files still being cut into runs by the external sort
+ */
+static atomic_size_t n_files_spilling;
+
+/*!
+ * Coroutine merging the runs spilled by the external sort, or the files sorted by the incremental merge
+ */
+static coro *merger = NULL;
+
+static bool setup_sort_slots(size_t n_workers);
 static void setup_coro_data(const char *file_names[], size_t n_files);
 static void coroutine();
+static void external_sort_coroutine(size_t n_files);
+static void external_merge_coroutine();
+static void incremental_merge_coroutine(size_t n_files);
+static bool merge_group(coro *group[], size_t n);
 void cleanup_coro_data(size_t n_files);
-static bool setup_aiocb(struct aiocb *aiocb, int fd);
-static size_t str_cnt_whitespaces(const char *str);
 
-static bool merge_sorted_files(size_t n_files, elem_t **storage_address, size_t *storage_sz);
-static bool print_result(struct timespec *program_start, size_t n_files, elem_t *storage, size_t storage_sz);
+static bool write_metrics();
+static bool write_merged_files(int fd, size_t n_files, size_t n_writers);
+static bool print_result(struct timespec *program_start, size_t n_files, size_t n_writers);
 
 signed main(signed argc, const char *argv[])
 {
     struct timespec program_start;
     if (timespec_get(&program_start, TIME_UTC) == 0) HANDLE_ERROR("timespec_get: ", { return EXIT_FAILURE; });
 
-    --argc;
+    size_t stack_sz = DEFAULT_STACK_SZ_KIB * 1024;
+    size_t n_workers = 1;
+
+    signed opt = 0;
+    while ((opt = getopt(argc, (char *const *) argv, "bH:ij:mM:ps:w:")) != -1) {
+        switch (opt) {
+            case 'b':
+                binary_output = true;
+                break;
+            case 'H':
+                if (strcmp(optarg, "thp") == 0) {
+                    huge_pages = HUGE_PAGES_THP;
+                } else if (strcmp(optarg, "hugetlb") == 0) {
+                    huge_pages = HUGE_PAGES_HUGETLB;
+                } else {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'i':
+                incremental = true;
+                break;
+            case 'j':
+                metrics_file_name = optarg;
+                break;
+            case 'm':
+                input_mode = INGEST_MMAP;
+                break;
+            case 'M':
+                memory_budget = strtoull(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case 'p':
+                preemptive = true;
+                break;
+            case 's':
+                stack_sz = strtoull(optarg, NULL, 10) * 1024;
+                break;
+            case 'w':
+                n_workers = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
     if (argc <= 1) return EXIT_FAILURE;
-    double target_latency = strtod(argv[1], NULL);
+    double target_latency = strtod(argv[0], NULL);
     size_t n_files = argc - 1;
 
-    if (!scheduler_setup(n_files, target_latency)) return EXIT_FAILURE;
-    setup_coro_data(argv + 2, n_files);
+    bool external = (memory_budget != 0);
+    incremental = incremental && !external && (n_files > 1);
+    if (external && !spill_set_init(&spills)) return EXIT_FAILURE;
+    if (incremental && !coro_chan_init(&sorted_files, sizeof(size_t), n_files)) goto cleanup_spills;
+    if (!external && !setup_sort_slots(n_workers)) goto cleanup_spills;
+    ingest_share_budget(n_files);
+    atomic_init(&n_files_spilling, n_files);
+
+    if (!scheduler_setup(n_files + (external || incremental), target_latency, stack_sz)) goto cleanup_spills;
+    coro_arena_use_huge_pages(huge_pages);
+    if (preemptive && !scheduler_enable_preemption()) goto cleanup_scheduler;
+    setup_coro_data(argv + 1, n_files);
+    if (external || incremental) merger = &scheduler_coro_pool()[n_files];
     scheduler_register_coro_entry_point(coroutine);
 
-    if (!scheduler_run()) goto cleanup_scheduler;
+    if (!scheduler_run_workers(n_workers)) goto cleanup_scheduler;
 
-    elem_t *storage = NULL;
-    size_t storage_sz = 0;
-    if (!merge_sorted_files(n_files, &storage, &storage_sz)) goto cleanup_scheduler;
-
-    if (!print_result(&program_start, n_files, storage, storage_sz)) goto cleanup;
-    free_and_null((void **) &storage);
+    if (!print_result(&program_start, n_files, n_workers)) goto cleanup_scheduler;
+    if ((metrics_file_name != NULL) && !write_metrics()) goto cleanup_scheduler;
+    cleanup_coro_data(n_files);
     scheduler_cleanup();
+    if (external) spill_set_cleanup(&spills);
+    if (incremental) coro_chan_destroy(&sorted_files);
+    if (!external) coro_chan_destroy(&sort_slots);
 
     return EXIT_SUCCESS;
 
-cleanup:
-    free_and_null((void **) &storage);
-
 cleanup_scheduler:
     cleanup_coro_data(n_files);
     scheduler_cleanup();
 
+cleanup_spills:
+    if (external) spill_set_cleanup(&spills);
+    if (incremental) coro_chan_destroy(&sorted_files);
+    if (!external) coro_chan_destroy(&sort_slots);
+
     return EXIT_FAILURE;
 }
 
+/*!
+ * Sets up the slots for sorting in memory, all of them free
+ *
+ * @param n_workers [in] number of workers, hence of slots
+ *
+ * @return true on success, false otherwise
+ */
+bool setup_sort_slots(size_t n_workers)
+{
+    if (n_workers == 0) n_workers = 1;
+    if (!coro_chan_init(&sort_slots, sizeof(bool), n_workers)) return false;
+
+    for (size_t i = 0; i < n_workers; ++i) {
+        bool slot = true;
+        coro_chan_send(&sort_slots, &slot);
+    }
+
+    return true;
+}
+
 /*!
  * Sets up data for the scheduler's coroutine pool
  *
@@ -88,66 +266,59 @@ void coroutine()
     assert(this != NULL);
     coro_yield();
 
-    int fd = 0;
-    coro_yield();
-    if ((fd = open(this->file_name, O_RDONLY)) == -1) HANDLE_ERROR("open: ", { return; });
-    coro_yield();
+    if (this == merger) {
+        if (memory_budget != 0) {
+            external_merge_coroutine();
+        } else {
+            incremental_merge_coroutine((size_t) (merger - scheduler_coro_pool()));
+        }
+        return;
+    }
 
-    struct aiocb aiocb;
-    coro_yield();
-    if (!setup_aiocb(&aiocb, fd)) goto close_fd;
-    coro_yield();
-    if (aio_read(&aiocb) != 0) HANDLE_ERROR("aio_read: ", { goto close_fd; });
+    if (memory_budget != 0) {
+        external_sort_coroutine((size_t) (merger - scheduler_coro_pool()));
+        return;
+    }
+
+    int fd = 0;
     coro_yield();
-    int req_status = EINPROGRESS;
+    if ((fd = open(this->file_name, O_RDONLY)) == -1) HANDLE_ERROR("open: ", { goto cleanup; });
     coro_yield();
-    while (req_status == EINPROGRESS) {
-        coro_suspend();
 
-        req_status = aio_error(&aiocb);
-        coro_yield();
-    }
-    if (req_status != 0) HANDLE_ERROR("aio_error: ", { goto close_fd; });
+    bool sorted = false;
     coro_yield();
-    if (aio_return(&aiocb) == -1) HANDLE_ERROR("aio_return: ", { goto close_fd; });
+    if (!ingest_file(input_mode, fd, &this->storage, &this->storage_sz, &sorted)) goto close_fd;
     coro_yield();
-    if (close(fd) != 0) HANDLE_ERROR("close: ", { goto close_fd; });
+    if (close(fd) != 0) HANDLE_ERROR("close: ", { goto cleanup; });
     coro_yield();
 
-    this->storage_sz = str_cnt_whitespaces((const char *) aiocb.aio_buf);
+    if (sorted) goto done;
     coro_yield();
 
-    if ((this->storage = calloc(this->storage_sz, sizeof(*this->storage))) == NULL) goto close_fd;
+    bool slot = false;
+    if (!coro_chan_recv(&sort_slots, &slot)) goto cleanup;
     coro_yield();
 
-    const char *begin = (const char *) aiocb.aio_buf;
-    coro_yield();
-    char *end = NULL;
-    coro_yield();
-    size_t i = 0;
+    elem_t *aux = coro_arena_alloc(this->storage_sz * sizeof(*aux));
     coro_yield();
-    while (begin != end) {
-        coro_yield();
-
-        this->storage[i++] = strtol(begin, &end, 10);
-        coro_yield();
-        assert(i <= this->storage_sz);
-        coro_yield();
-        begin = end;
-        coro_yield();
+    if (aux == NULL) {
+        coro_chan_send(&sort_slots, &slot);
+        goto cleanup;
     }
-    free_and_null((void **) &aiocb.aio_buf);
     coro_yield();
-
-    elem_t *aux = calloc(this->storage_sz, sizeof(*aux));
-    coro_yield();
-    if (aux == NULL) HANDLE_ERROR("calloc: ", { goto cleanup; });
+    sort_array_with_coroutines(this->storage, aux, this->storage_sz);
     coro_yield();
-    merge_sort_array_with_coroutines(this->storage, aux, this->storage_sz);
+    coro_arena_release(aux);
     coro_yield();
-    free_and_null((void **) &aux);
+    if (!coro_chan_send(&sort_slots, &slot)) coro_error();
     coro_yield();
 
+done:
+    if (incremental) {
+        size_t id = (size_t) (this - scheduler_coro_pool());
+        if (!coro_chan_send(&sorted_files, &id)) coro_error();
+    }
+
     coro_done();
     return;
 
@@ -156,141 +327,219 @@ close_fd:
 
 cleanup:
     free_and_null((void **) &this->storage);
-    free_and_null((void **) &aiocb.aio_buf);
 
     coro_error();
 }
 
 /*!
- * Cleans up data of the scheduler's coroutine pool
+ * Coroutine cutting a file into sorted runs within its share of the memory budget
  *
- * @param n_files
+ * @param n_files [in] number of input files sharing the budget
  */
-void cleanup_coro_data(size_t n_files)
+void external_sort_coroutine(size_t n_files)
+{
+    coro *this = scheduler_curr_coro();
+    assert(this != NULL);
+
+    int fd = open(this->file_name, O_RDONLY);
+    if (fd == -1) HANDLE_ERROR("open: ", { coro_error(); });
+
+    size_t file = (size_t) (this - scheduler_coro_pool());
+    bool spilled = external_sort_file(fd, file, memory_budget / n_files, sort_array_with_coroutines, &spills);
+    if (close(fd) != 0) HANDLE_ERROR("close: ", { spilled = false; });
+    if (!spilled) coro_error();
+
+    if (atomic_fetch_sub(&n_files_spilling, 1) == 1) coro_wake(merger);
+
+    coro_done();
+}
+
+/*!
+ * Coroutine merging the spilled runs into the result once all the files are cut into runs
+ */
+void external_merge_coroutine()
+{
+    while (atomic_load(&n_files_spilling) != 0) {
+        coro_block();
+    }
+
+    int fd = open(binary_output ? "result.bin" : "result.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) HANDLE_ERROR("open: ", { coro_error(); });
+
+    bool written = external_merge(&spills, memory_budget, fd, binary_output);
+    if (close(fd) != 0) HANDLE_ERROR("close: ", { written = false; });
+    if (!written) coro_error();
+
+    coro_done();
+}
+
+/*!
+ * Coroutine merging the files' arrays as soon as they are sorted, all but the last one
+ *
+ * @details arrays are merged in groups of INCREMENTAL_FAN_IN, the merged arrays of a level forming groups of the next
+ * level in turn, so every number is moved once per level; the arrays left in partial groups go to the final merge
+ *
+ * @param n_files [in] number of input files
+ */
+void incremental_merge_coroutine(size_t n_files)
 {
     coro *coro_pool = scheduler_coro_pool();
     assert(coro_pool != NULL);
 
-    for (size_t i = 0; i < n_files; ++i) {
-        free_and_null((void **) &coro_pool[i].storage);
+    coro *groups[INCREMENTAL_LEVELS][INCREMENTAL_FAN_IN];
+    size_t group_sz[INCREMENTAL_LEVELS] = {0};
+
+    for (size_t n_sorted = 0; n_sorted + 1 < n_files; ++n_sorted) {
+        size_t id = 0;
+        if (!coro_chan_recv(&sorted_files, &id)) coro_error();
+
+        coro *merged = &coro_pool[id];
+        for (size_t level = 0; merged != NULL; ++level) {
+            groups[level][group_sz[level]++] = merged;
+            merged = NULL;
+
+            if (group_sz[level] < INCREMENTAL_FAN_IN) break;
+
+            if (!merge_group(groups[level], INCREMENTAL_FAN_IN)) coro_error();
+            if (level + 1 < INCREMENTAL_LEVELS) {
+                merged = groups[level][0];
+                group_sz[level] = 0;
+            } else {
+                group_sz[level] = 1;
+            }
+        }
     }
+
+    coro_done();
 }
 
 /*!
- * Setups asynchronous I/O control block (aiocb)
+ * Merges the sorted arrays of a group of files into the first file's array, yielding cooperatively
+ *
+ * @details the arrays are merged through a loser tree into a new array, in batches of INCREMENTAL_BATCH_SZ numbers
+ * between calls to coro_yield(), and freed afterwards
  *
- * @param aiocb [out]
- * @param fd [in] file descriptor to operate on
+ * @param group [in, out] coroutines whose arrays are merged, all but the first one are left with empty arrays
+ * @param n     [in] number of coroutines in the group
  *
  * @return true on success, false otherwise
  */
-bool setup_aiocb(struct aiocb *aiocb, int fd)
+bool merge_group(coro *group[], size_t n)
 {
-    assert(aiocb != NULL);
+    assert(group != NULL);
+    assert((n > 0) && (n <= INCREMENTAL_FAN_IN));
+
+    merge_run runs[INCREMENTAL_FAN_IN];
+    size_t sz = 0;
+    for (size_t i = 0; i < n; ++i) {
+        runs[i] = (merge_run) {.begin = group[i]->storage, .end = group[i]->storage + group[i]->storage_sz};
+        sz += group[i]->storage_sz;
+    }
 
-    struct stat buf;
-    if (fstat(fd, &buf) != 0) HANDLE_ERROR("fstat: ", { goto cleanup; });
-    size_t file_sz = buf.st_size;
+    elem_t *storage = malloc((sz != 0) ? sz * sizeof(*storage) : 1);
+    coro_yield();
+    if (storage == NULL) HANDLE_ERROR("malloc: ", { return false; });
+    coro_arena_advise(storage, sz * sizeof(*storage));
 
-    aiocb->aio_fildes = fd;
-    aiocb->aio_offset = 0;
-    if ((aiocb->aio_buf = calloc(file_sz + 1, sizeof(*aiocb->aio_buf))) == NULL) HANDLE_ERROR("calloc: ", { goto cleanup; });
-    aiocb->aio_nbytes = file_sz;
-    aiocb->aio_reqprio = 0;
-    aiocb->aio_sigevent.sigev_notify = SIGEV_NONE;
+    loser_tree tree;
+    if (!loser_tree_init(&tree, runs, n)) {
+        free(storage);
+        return false;
+    }
+    coro_yield();
 
-    return true;
+    for (size_t merged = 0; merged < sz;) {
+        size_t batch_sz = (sz - merged < INCREMENTAL_BATCH_SZ) ? sz - merged : INCREMENTAL_BATCH_SZ;
+        merged += loser_tree_pop(&tree, storage + merged, batch_sz);
+        coro_yield();
+    }
+    loser_tree_cleanup(&tree);
 
-cleanup:
-    free_and_null((void **) &aiocb->aio_buf);
+    for (size_t i = 0; i < n; ++i) {
+        free_and_null((void **) &group[i]->storage);
+        group[i]->storage_sz = 0;
+    }
+    group[0]->storage = storage;
+    group[0]->storage_sz = sz;
 
-    return false;
+    return true;
 }
 
 /*!
- * Counts the number of whitespaces in string
- *
- * @param str [in]
+ * Cleans up data of the scheduler's coroutine pool
  *
- * @return number of whitespaces found in string
+ * @param n_files
  */
-size_t str_cnt_whitespaces(const char *str)
+void cleanup_coro_data(size_t n_files)
 {
-    assert(str != NULL);
-
-    size_t amount_of_numbers = 0;
-    bool at_least_one_number = false;
-    const char *restrict reader = str;
-    while (*reader != '\0') {
-        if (!at_least_one_number) at_least_one_number = true;
-        if (*(reader++) == ' ') ++amount_of_numbers;
+    coro *coro_pool = scheduler_coro_pool();
+    assert(coro_pool != NULL);
+
+    for (size_t i = 0; i < n_files; ++i) {
+        free_and_null((void **) &coro_pool[i].storage);
     }
+}
 
-    return at_least_one_number ? amount_of_numbers + 1 : 0;
+/*!
+ * Writes the scheduler's metrics to the metrics file
+ *
+ * @return true on success, false otherwise
+ */
+bool write_metrics()
+{
+    FILE *file = fopen(metrics_file_name, "w");
+    if (file == NULL) HANDLE_ERROR("fopen: ", { return false; });
+
+    bool written = scheduler_write_metrics(file);
+    if (fclose(file) != 0) HANDLE_ERROR("fclose: ", { written = false; });
+
+    return written;
 }
 
 /*!
- * Merges sorted arrays containing numbers from input files into one sorted array
+ * Merges sorted arrays containing numbers from input files, streaming the result to the output
  *
- * @param n_files         [in] number of input files
- * @param storage_address [out] pointer to an array, expected to be NULL
- * @param storage_sz      [out]
+ * @details the arrays are merged at once through loser trees, so every number is read and written exactly once, and
+ * the output is split into slices merged by separate threads (see merge_path.h)
  *
- * @return true on success, false otherwise
+ * @param fd        [in] file descriptor to write to, at its beginning
+ * @param n_files   [in] number of input files
+ * @param n_writers [in] number of threads merging the output
  *
- * @attention dynamically allocates storage, therefore the caller is responsible for freeing the storage
+ * @return true on success, false otherwise
  */
-bool merge_sorted_files(size_t n_files, elem_t **storage_address, size_t *storage_sz)
+bool write_merged_files(int fd, size_t n_files, size_t n_writers)
 {
-    assert(storage_address != NULL);
-    assert(*storage_address == NULL);
-    assert(storage_sz != NULL);
-
     coro *coro_pool = scheduler_coro_pool();
     assert(coro_pool != NULL);
 
-    *storage_sz = 0;
-    size_t *storage_offsets = calloc(n_files, sizeof(*storage_offsets));
-    if (storage_offsets == NULL) HANDLE_ERROR("calloc: ", { return false; });
+    merge_run *runs = calloc(n_files, sizeof(*runs));
+    if (runs == NULL) HANDLE_ERROR("calloc: ", { return false; });
 
+    size_t n_runs = 0;
     for (size_t i = 0; i < n_files; ++i) {
-        storage_offsets[i] = *storage_sz;
-        *storage_sz += coro_pool[i].storage_sz;
+        const coro *coro = &coro_pool[i];
+        if (coro->storage_sz == 0) continue;
+        runs[n_runs++] = (merge_run) {.begin = coro->storage, .end = coro->storage + coro->storage_sz};
     }
 
-    if ((*storage_address = calloc(*storage_sz, sizeof(**storage_address))) == NULL) HANDLE_ERROR("calloc: ", { goto cleanup; });
+    bool written = merge_path_write(fd, runs, n_runs, binary_output, n_writers);
+    free_and_null((void **) &runs);
 
-    for (size_t i = 0; i < n_files; ++i) {
-        memcpy(*storage_address + storage_offsets[i], coro_pool[i].storage, coro_pool[i].storage_sz);
-    }
-    cleanup_coro_data(n_files);
-
-    elem_t *aux = calloc(*storage_sz, sizeof(*aux));
-    if (aux == NULL) HANDLE_ERROR("calloc: ", { goto cleanup; });
-    merge_sort_files(*storage_address, aux, *storage_sz, storage_offsets, n_files);
-    free_and_null((void **) &storage_offsets);
-    free_and_null((void **) &aux);
-
-    return true;
-
-cleanup:
-    free_and_null((void **) &storage_offsets);
-    free_and_null((void **) storage_address);
-
-    return false;
+    return written;
 }
 
 /*!
- * Prints program execution details, prints result of sorting contents of input files to 'result.txt'.
+ * Prints program execution details, prints result of sorting contents of input files to 'result.txt' (or writes it
+ * to 'result.bin' as a binary run), unless the external sort has written it already.
  *
  * @param program_start [in] program execution start timestamp
  * @param n_files       [in] number of input files
- * @param storage       [in] array containing sorted numbers from input file
- * @param storage_sz    [in]
+ * @param n_writers     [in] number of threads merging the result
  *
  * @return true on success, false otherwise
  */
-bool print_result(struct timespec *program_start, size_t n_files, elem_t *storage, size_t storage_sz)
+bool print_result(struct timespec *program_start, size_t n_files, size_t n_writers)
 {
     assert(program_start != NULL);
 
@@ -311,12 +560,13 @@ bool print_result(struct timespec *program_start, size_t n_files, elem_t *storag
     printf("Total execution time: %lg microseconds\n",
            (double) (now.tv_sec - program_start->tv_sec) * pow(10, 6) + (double) (now.tv_nsec - program_start->tv_nsec) * pow(10, -3));
 
-    FILE *output_file_handle = fopen("result.txt", "w");
-    if (output_file_handle == NULL) HANDLE_ERROR("fopen: ", { return false; });
-    for (size_t i = 0; i < storage_sz; ++i) {
-        fprintf(output_file_handle, (i != storage_sz - 1) ? "%d " : "%d", storage[i]);
-    }
-    fclose(output_file_handle);
+    if (memory_budget != 0) return true;
 
-    return true;
+    int fd = open(binary_output ? "result.bin" : "result.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) HANDLE_ERROR("open: ", { return false; });
+
+    bool written = write_merged_files(fd, n_files, n_writers);
+    if (close(fd) != 0) HANDLE_ERROR("close: ", { written = false; });
+
+    return written;
 }
@@ -0,0 +1,356 @@
+#include "merge_path.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+
+#include "dynamic_memory_management.h"
+#include "errors.h"
+#include "run_file.h"
+#include "text_writer.h"
+
+/*
+ * The merged output is cut into slices of equal size. The boundaries of a slice within every run are found by a
+ * co-rank search, i.e. a generalization of the merge path to k runs, so that each slice is merged through a loser tree
+ * of its own, independently of the others. Binary output is written at positions known upfront, while the formatted
+ * length of each slice is computed from its subranges first, so that text output is written at precomputed offsets
+ * as well.
+ */
+
+/*!
+ * Number of elements popped out of a loser tree at once before being handed to the output writer
+ */
+static const size_t MERGE_BATCH_SZ = 64 * 1024;
+
+/*!
+ * Minimum number of elements worth a thread of its own
+ */
+static const size_t MIN_SLICE_SZ = 256 * 1024;
+
+/*!
+ * Slice of the merged output produced by one thread
+ */
+typedef struct {
+    pthread_t thread;
+    signed fd;
+    bool binary;
+
+    merge_run *runs;
+    size_t k;
+    size_t first;
+    size_t sz;
+
+    off_t offset;
+    size_t len;
+    bool ok;
+} slice;
+
+static const elem_t *lower_bound(const merge_run *run, elem_key_t key);
+static const elem_t *upper_bound(const merge_run *run, elem_key_t key);
+static size_t count_less(const merge_run *runs, size_t k, elem_key_t key);
+
+static bool write_slice(slice *slice);
+static void *slice_len_main(void *arg);
+static void *slice_write_main(void *arg);
+static bool run_slices(slice *slices, size_t n_slices, void *(*func)(void *));
+
+/*!
+ * Finds where the element of a given rank in the merged output splits every run
+ *
+ * @details bisects the range of keys (see elem.h) for the key of the element, then takes the elements with an equal key
+ * from the runs in order of their indices, the same way a stable merge does, so that splits at increasing ranks never
+ * cross each other
+ *
+ * @param runs   [in] sorted runs
+ * @param k      [in] number of runs
+ * @param rank   [in] number of elements going before the split, at most the total number of elements
+ * @param splits [out] array of k positions, one within each run, such that exactly rank elements precede them
+ */
+void merge_path_split(const merge_run *runs, size_t k, size_t rank, const elem_t **splits)
+{
+    assert((runs != NULL) || (k == 0));
+    assert((splits != NULL) || (k == 0));
+
+    elem_key_t low = 0;
+    elem_key_t high = 0;
+    bool empty = true;
+    for (size_t i = 0; i < k; ++i) {
+        if (runs[i].begin == runs[i].end) continue;
+
+        elem_key_t first = elem_key(*runs[i].begin);
+        elem_key_t last = elem_key(*(runs[i].end - 1));
+        if (empty || (first < low)) low = first;
+        if (empty || (last > high)) high = last;
+        empty = false;
+    }
+
+    while (low < high) {
+        elem_key_t middle = low + (high - low) / 2 + (high - low) % 2;
+        if (count_less(runs, k, middle) <= rank) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    size_t n_left = rank;
+    for (size_t i = 0; i < k; ++i) {
+        splits[i] = lower_bound(&runs[i], low);
+        n_left -= (size_t) (splits[i] - runs[i].begin);
+    }
+    for (size_t i = 0; (i < k) && (n_left != 0); ++i) {
+        size_t n_equal = (size_t) (upper_bound(&runs[i], low) - splits[i]);
+        size_t n_taken = (n_equal < n_left) ? n_equal : n_left;
+
+        splits[i] += n_taken;
+        n_left -= n_taken;
+    }
+}
+
+/*!
+ * Merges sorted runs, writing the result as text or as a binary run
+ *
+ * @param fd        [in] file descriptor of a regular file to write to, at its beginning
+ * @param runs      [in] sorted runs
+ * @param k         [in] number of runs
+ * @param binary    [in] whether to write a binary run (see run_file.h) instead of text
+ * @param n_threads [in] number of threads merging slices of the output, 1 to merge on the calling thread
+ *
+ * @return true on success, false otherwise
+ */
+bool merge_path_write(int fd, const merge_run *runs, size_t k, bool binary, size_t n_threads)
+{
+    assert((runs != NULL) || (k == 0));
+
+    size_t sz = 0;
+    for (size_t i = 0; i < k; ++i) {
+        sz += (size_t) (runs[i].end - runs[i].begin);
+    }
+
+    if (binary && !run_write_header(fd, sz, true)) return false;
+
+    if (n_threads > sz / MIN_SLICE_SZ) n_threads = sz / MIN_SLICE_SZ;
+    if (n_threads < 1) n_threads = 1;
+
+    bool ok = false;
+    slice *slices = calloc(n_threads, sizeof(*slices));
+    if (slices == NULL) HANDLE_ERROR("calloc: ", { return false; });
+
+    const elem_t **splits = calloc((n_threads + 1) * k + 1, sizeof(*splits));
+    if (splits == NULL) HANDLE_ERROR("calloc: ", { goto cleanup_slices; });
+
+    merge_run *slice_runs = calloc(n_threads * k + 1, sizeof(*slice_runs));
+    if (slice_runs == NULL) HANDLE_ERROR("calloc: ", { goto cleanup_splits; });
+
+    size_t slice_sz = (sz + n_threads - 1) / n_threads;
+    for (size_t i = 0; i <= n_threads; ++i) {
+        size_t rank = (i * slice_sz < sz) ? i * slice_sz : sz;
+        merge_path_split(runs, k, rank, splits + i * k);
+    }
+    for (size_t i = 0; i < n_threads; ++i) {
+        size_t first = (i * slice_sz < sz) ? i * slice_sz : sz;
+        size_t last = ((i + 1) * slice_sz < sz) ? (i + 1) * slice_sz : sz;
+
+        slices[i] = (slice) {.fd = fd, .binary = binary, .runs = slice_runs + i * k, .k = k, .first = first,
+                             .sz = last - first};
+        for (size_t j = 0; j < k; ++j) {
+            slices[i].runs[j] = (merge_run) {.begin = splits[i * k + j], .end = splits[(i + 1) * k + j]};
+        }
+    }
+
+    if (!binary) {
+        if (!run_slices(slices, n_threads, slice_len_main)) goto cleanup;
+
+        off_t offset = 0;
+        for (size_t i = 0; i < n_threads; ++i) {
+            slices[i].offset = offset;
+            offset += (off_t) slices[i].len;
+        }
+    }
+
+    ok = run_slices(slices, n_threads, slice_write_main);
+
+cleanup:
+    free_and_null((void **) &slice_runs);
+
+cleanup_splits:
+    free_and_null((void **) &splits);
+
+cleanup_slices:
+    free_and_null((void **) &slices);
+
+    return ok;
+}
+
+/*!
+ * @param run [in]
+ * @param key [in]
+ *
+ * @return position of the first element of the run whose key is not less than the given one
+ */
+const elem_t *lower_bound(const merge_run *run, elem_key_t key)
+{
+    const elem_t *low = run->begin;
+    for (size_t n = (size_t) (run->end - run->begin); n != 0;) {
+        size_t half = n / 2;
+        if (elem_key(low[half]) < key) {
+            low += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+
+    return low;
+}
+
+/*!
+ * @param run [in]
+ * @param key [in]
+ *
+ * @return position of the first element of the run whose key is greater than the given one
+ */
+const elem_t *upper_bound(const merge_run *run, elem_key_t key)
+{
+    const elem_t *low = run->begin;
+    for (size_t n = (size_t) (run->end - run->begin); n != 0;) {
+        size_t half = n / 2;
+        if (elem_key(low[half]) <= key) {
+            low += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+
+    return low;
+}
+
+/*!
+ * @param runs [in]
+ * @param k    [in]
+ * @param key  [in]
+ *
+ * @return number of elements of all the runs whose key is less than the given one
+ */
+size_t count_less(const merge_run *runs, size_t k, elem_key_t key)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < k; ++i) {
+        count += (size_t) (lower_bound(&runs[i], key) - runs[i].begin);
+    }
+
+    return count;
+}
+
+/*!
+ * Merges a slice, writing it at its position in the output
+ *
+ * @param slice [in]
+ *
+ * @return true on success, false otherwise
+ */
+bool write_slice(slice *slice)
+{
+    bool ok = false;
+
+    loser_tree tree;
+    if (!loser_tree_init(&tree, slice->runs, slice->k)) return false;
+
+    elem_t *batch = calloc(MERGE_BATCH_SZ, sizeof(*batch));
+    if (batch == NULL) HANDLE_ERROR("calloc: ", { goto cleanup_tree; });
+
+    text_writer writer;
+    if (!slice->binary && !text_writer_open(&writer, slice->fd, slice->offset, slice->first != 0)) goto cleanup;
+
+    ok = true;
+    for (size_t n_merged = 0; ok && (n_merged < slice->sz);) {
+        size_t n_popped = loser_tree_pop(&tree, batch, MERGE_BATCH_SZ);
+        assert(n_popped != 0);
+
+        ok = slice->binary ? run_write_elems(slice->fd, batch, n_popped, slice->first + n_merged)
+                           : text_writer_write(&writer, batch, n_popped);
+        n_merged += n_popped;
+    }
+
+    if (!slice->binary && !text_writer_close(&writer)) ok = false;
+
+cleanup:
+    free_and_null((void **) &batch);
+
+cleanup_tree:
+    loser_tree_cleanup(&tree);
+
+    return ok;
+}
+
+/*!
+ * Computes the formatted length of a slice from its subranges, which hold exactly the slice's elements
+ *
+ * @param arg [in, out] slice
+ *
+ * @return NULL
+ */
+void *slice_len_main(void *arg)
+{
+    slice *slice = arg;
+
+    size_t len = ((slice->sz != 0) && (slice->first == 0)) ? slice->sz - 1 : slice->sz;
+    for (size_t i = 0; i < slice->k; ++i) {
+        for (const elem_t *elem = slice->runs[i].begin; elem != slice->runs[i].end; ++elem) {
+            len += elem_format_len(*elem);
+        }
+    }
+    slice->len = len;
+    slice->ok = true;
+
+    return NULL;
+}
+
+/*!
+ * Merges a slice and writes it at its precomputed position
+ *
+ * @param arg [in, out] slice
+ *
+ * @return NULL
+ */
+void *slice_write_main(void *arg)
+{
+    slice *slice = arg;
+
+    slice->ok = write_slice(slice);
+
+    return NULL;
+}
+
+/*!
+ * Runs a function on every slice, each on a thread of its own but the first one, which runs on the calling thread
+ *
+ * @param slices   [in, out]
+ * @param n_slices [in]
+ * @param func     [in]
+ *
+ * @return whether the function succeeded on every slice
+ */
+bool run_slices(slice *slices, size_t n_slices, void *(*func)(void *))
+{
+    size_t n_threads = 1;
+    for (; n_threads < n_slices; ++n_threads) {
+        errno = pthread_create(&slices[n_threads].thread, NULL, func, &slices[n_threads]);
+        if (errno != 0) HANDLE_ERROR("pthread_create: ", { break; });
+    }
+
+    func(&slices[0]);
+
+    bool ok = (n_threads == n_slices);
+    for (size_t i = 0; i < n_threads; ++i) {
+        if (i != 0) pthread_join(slices[i].thread, NULL);
+        ok = ok && slices[i].ok;
+    }
+
+    return ok;
+}
@@ -0,0 +1,13 @@
+#ifndef MERGE_PATH_H
+#define MERGE_PATH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "elem.h"
+#include "loser_tree.h"
+
+void merge_path_split(const merge_run *runs, size_t k, size_t rank, const elem_t **splits);
+bool merge_path_write(int fd, const merge_run *runs, size_t k, bool binary, size_t n_threads);
+
+#endif /* MERGE_PATH_H */
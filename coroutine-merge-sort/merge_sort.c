@@ -1,15 +1,121 @@
 #include "merge_sort.h"
 
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
+#if !defined(MERGE_SORT_SCALAR) && defined(__x86_64__) && defined(ELEM_INT32)
+#include <immintrin.h>
+#else
+#ifndef MERGE_SORT_SCALAR
+#define MERGE_SORT_SCALAR
+#endif
+#endif
+
 #include "coro.h"
 
-static size_t min_idx(size_t a, size_t b);
-static void merge(elem_t *restrict writer, const elem_t *restrict reader, size_t left, size_t middle, size_t right);
+/*
+ * The sort is adaptive, in the manner of TimSort: the array is scanned for natural runs, ascending or strictly
+ * descending (the latter reversed in place), and runs shorter than a minimum length are extended to it with binary
+ * insertion sort. Runs are pushed on a stack whose lengths are kept growing faster than the Fibonacci numbers, merging
+ * the topmost ones as needed, so merges stay balanced. A merge first skips the prefix of the left run and the suffix
+ * of the right run which are in place already, then merges the rest through the auxiliary array, switching to
+ * galloping (exponential search) while one run keeps winning. Already sorted input takes a single pass.
+ *
+ * On x86-64 with AVX2 both the short runs and the merges are vectorized instead. A short run is sorted by a network
+ * over eight registers of eight elements: the columns are sorted by a 19-comparator network, the registers are
+ * transposed into eight sorted rows, and the rows are combined by bitonic merges. A merge takes eight elements from
+ * the run with the smaller head at a time, merges them with the eight held back from the previous step by a bitonic
+ * network, and stores the lower eight; the last elements of the runs are merged by a branchless scalar loop. Runs
+ * which don't interleave evenly (judged by where the middle of the right one falls in the left one) are still merged
+ * by galloping, which skips over their long stretches in logarithmic time. Neither network is stable, which doesn't
+ * matter for plain numbers. The instruction set is picked at runtime; defining MERGE_SORT_SCALAR (or building for any
+ * other architecture or element type than 32-bit integers) leaves just the scalar kernel, which is stable.
+ */
+
+/*!
+ * Arrays shorter than this are sorted with binary insertion sort alone
+ */
+enum { MIN_MERGE = 64 };
+
+/*!
+ * Number of consecutive wins of one run after which a merge starts galloping
+ */
+enum { MIN_GALLOP = 7 };
 
 /*!
- * Implementation of bottom-top merge sort with coroutines
+ * Capacity of the run stack, enough for any array addressable with 64 bits given the invariant on run lengths
+ */
+enum { MAX_RUNS = 85 };
+
+#ifndef MERGE_SORT_SCALAR
+_Static_assert(sizeof(elem_t) == sizeof(int32_t), "vectorized merge sort expects 32-bit elements");
+
+/*!
+ * Number of elements in a vector
+ */
+enum { VEC_SZ = 8 };
+
+/*!
+ * Maximum number of elements sorted by the sorting network, which is no less than any minimum run length
+ */
+enum { NETWORK_SZ = VEC_SZ * VEC_SZ };
+
+/*!
+ * Number of vectors merged between calls to coro_yield()
+ */
+enum { YIELD_VECS = 8 };
+#endif
+
+/*!
+ * Sorted run of the array being sorted
+ */
+typedef struct {
+    size_t base;
+    size_t len;
+} sort_run;
+
+/*!
+ * State of a sort
+ */
+typedef struct {
+    elem_t *arr;
+    elem_t *aux;
+    size_t min_gallop;
+    bool simd;
+
+    sort_run runs[MAX_RUNS];
+    size_t n_runs;
+} sort_state;
+
+static inline size_t min_run_len(size_t sz);
+static inline size_t count_run(elem_t *arr, size_t sz);
+static inline void sort_short_run(sort_state *state, elem_t *arr, size_t sz, size_t start);
+static inline void binary_insertion_sort(elem_t *arr, size_t sz, size_t start);
+static inline void merge_collapse(sort_state *state);
+static inline void merge_force_collapse(sort_state *state);
+static inline void merge_at(sort_state *state, size_t i);
+static inline void merge_lo(sort_state *state, elem_t *a, size_t na, elem_t *b, size_t nb);
+static inline void merge_hi(sort_state *state, elem_t *a, size_t na, elem_t *b, size_t nb);
+static inline size_t gallop_left(elem_t key, const elem_t *arr, size_t sz, size_t hint);
+static inline size_t gallop_right(elem_t key, const elem_t *arr, size_t sz, size_t hint);
+
+#ifndef MERGE_SORT_SCALAR
+static inline bool interleaved(const elem_t *a, size_t na, const elem_t *b, size_t nb);
+static inline elem_t *merge_branchless(elem_t *dest, const elem_t *a, size_t na, const elem_t *b, size_t nb);
+static void sort_network_avx2(elem_t *arr, size_t sz);
+static void merge_avx2(elem_t *dest, const elem_t *a, size_t na, const elem_t *b, size_t nb);
+static inline void compare_exchange(__m256i *lo, __m256i *hi);
+static inline __m256i reverse(__m256i vec);
+static inline __m256i bitonic_sort_vec(__m256i vec);
+static inline void bitonic_sort(__m256i *vecs, size_t n);
+static inline void bitonic_merge(__m256i *vecs, size_t n);
+static inline void transpose(__m256i *vecs);
+#endif
+
+/*!
+ * Implementation of adaptive merge sort with coroutines
  *
  * @param arr [in, out] array to sort
  * @param aux [in, out] auxiliary array, expected to be at least the same size as arr
@@ -19,105 +125,742 @@ static void merge(elem_t *restrict writer, const elem_t *restrict reader, size_t
  */
 void merge_sort_array_with_coroutines(elem_t *restrict arr, elem_t *restrict aux, size_t sz)
 {
-    assert(arr != NULL);
-    assert(aux != NULL);
+    assert((arr != NULL) || (sz == 0));
+    assert((aux != NULL) || (sz == 0));
 
-    elem_t *reader = aux;
+    if (sz < 2) return;
     coro_yield();
-    elem_t *writer = arr;
+
+    sort_state state = {.arr = arr, .aux = aux, .min_gallop = MIN_GALLOP, .simd = false, .n_runs = 0};
+#ifndef MERGE_SORT_SCALAR
+    state.simd = __builtin_cpu_supports("avx2");
+#endif
+    size_t min_run = min_run_len(sz);
     coro_yield();
 
-    for (size_t width = 1; width < sz; width <<= 1) {
+    for (size_t base = 0; base < sz;) {
         coro_yield();
-        reader = (reader == aux) ? arr : aux;
+        size_t len = count_run(arr + base, sz - base);
         coro_yield();
-        writer = (writer == arr) ? aux : arr;
+
+        if (len < min_run) {
+            size_t forced = (sz - base < min_run) ? sz - base : min_run;
+            sort_short_run(&state, arr + base, forced, len);
+            len = forced;
+        }
         coro_yield();
 
-        for (size_t i = 0; i < sz; i += 2 * width) {
+        state.runs[state.n_runs++] = (sort_run) {.base = base, .len = len};
+        merge_collapse(&state);
+        base += len;
+    }
+
+    coro_yield();
+    merge_force_collapse(&state);
+    coro_yield();
+}
+
+/*!
+ * @param sz [in] size of the array
+ *
+ * @return minimum length of runs, such that the number of runs is a power of two or slightly less than one
+ */
+size_t min_run_len(size_t sz)
+{
+    size_t odd = 0;
+    for (; sz >= MIN_MERGE; sz >>= 1) {
+        odd |= sz & 1;
+    }
+
+    return sz + odd;
+}
+
+/*!
+ * Finds the natural run at the beginning of an array, reversing it if it's strictly descending
+ *
+ * @param arr [in, out]
+ * @param sz [in] size of arr, at least 1
+ *
+ * @return length of the run
+ */
+__attribute__((always_inline)) size_t count_run(elem_t *arr, size_t sz)
+{
+    size_t len = 1;
+    if (sz == 1) return len;
+
+    if (elem_less(arr[1], arr[0])) {
+        for (len = 2; (len < sz) && elem_less(arr[len], arr[len - 1]); ++len) {
             coro_yield();
-            merge(writer, reader, i, min_idx(i + width, sz), min_idx(i + 2 * width, sz));
+        }
+
+        for (size_t i = 0, j = len - 1; i < j; ++i, --j) {
+            coro_yield();
+            elem_t tmp = arr[i];
+            arr[i] = arr[j];
+            arr[j] = tmp;
+        }
+    } else {
+        for (len = 2; (len < sz) && !elem_less(arr[len], arr[len - 1]); ++len) {
             coro_yield();
         }
     }
 
-    if (writer != arr) {
+    return len;
+}
+
+/*!
+ * Sorts a run extended up to the minimum run length
+ *
+ * @param state [in]
+ * @param arr [in, out]
+ * @param sz [in] size of arr, at most the minimum run length
+ * @param start [in] length of the sorted beginning, at least 1
+ */
+__attribute__((always_inline)) void sort_short_run(sort_state *state, elem_t *arr, size_t sz, size_t start)
+{
+#ifndef MERGE_SORT_SCALAR
+    if (state->simd) {
+        sort_network_avx2(arr, sz);
+        return;
+    }
+#endif
+
+    binary_insertion_sort(arr, sz, start);
+}
+
+/*!
+ * Sorts an array whose beginning is sorted already by inserting the rest of its elements one by one
+ *
+ * @param arr [in, out]
+ * @param sz [in] size of arr
+ * @param start [in] length of the sorted beginning, at least 1
+ */
+__attribute__((always_inline)) void binary_insertion_sort(elem_t *arr, size_t sz, size_t start)
+{
+    for (size_t i = start; i < sz; ++i) {
         coro_yield();
-        memcpy(arr, writer, sz * sizeof(elem_t));
+        elem_t pivot = arr[i];
+
+        size_t left = 0;
+        size_t right = i;
+        while (left < right) {
+            size_t middle = left + (right - left) / 2;
+            if (elem_less(pivot, arr[middle])) {
+                right = middle;
+            } else {
+                left = middle + 1;
+            }
+        }
         coro_yield();
+
+        memmove(arr + left + 1, arr + left, (i - left) * sizeof(*arr));
+        arr[left] = pivot;
     }
 }
 
 /*!
- * Implementation of a custom bottom-top merge sort, operating on a sequence of sorted arrays of numbers from files
+ * Merges runs on top of the stack until the lengths of the runs satisfy the invariants
+ * runs[i - 2].len > runs[i - 1].len + runs[i].len and runs[i - 1].len > runs[i].len
  *
- * @param storage [in, out] sequence of sorted arrays merged together
- * @param aux [in, out] auxiliary array, expected to be at least the same size as storage
- * @param storage_sz [in]
- * @param storage_offsets [in] array of offsets for sorted arrays
- * @param n_files [in] number of files (corresponding to the number of sorted arrays)
- *
- * @note sorting result is stored in storage
+ * @param state [in, out]
  */
-void merge_sort_files(elem_t *restrict storage, elem_t *restrict aux, size_t storage_sz, const size_t *storage_offsets, size_t n_files)
+__attribute__((always_inline)) void merge_collapse(sort_state *state)
 {
-    assert(storage != NULL);
-    assert(aux != NULL);
-    assert(storage_offsets != NULL);
-
-    elem_t *reader = aux;
-    elem_t *writer = storage;
+    sort_run *runs = state->runs;
 
-    for (size_t width = 1; width < n_files; width <<= 1) {
-        reader = (reader == aux) ? storage : aux;
-        writer = (writer == storage) ? aux : storage;
+    while (state->n_runs > 1) {
+        coro_yield();
+        size_t n = state->n_runs - 2;
 
-        for (size_t i = 0; i < n_files; i += 2 * width) {
-            merge(writer, reader, storage_offsets[i], storage_offsets[min_idx(i + width, n_files - 1)],
-                  storage_offsets[min_idx(i + 2 * width, n_files - 1)]);
+        if (((n > 0) && (runs[n - 1].len <= runs[n].len + runs[n + 1].len)) ||
+            ((n > 1) && (runs[n - 2].len <= runs[n - 1].len + runs[n].len))) {
+            if (runs[n - 1].len < runs[n + 1].len) --n;
+        } else if (runs[n].len > runs[n + 1].len) {
+            break;
         }
+
+        merge_at(state, n);
     }
+}
 
-    if (writer != storage) {
-        memcpy(storage, writer, storage_sz * sizeof(elem_t));
+/*!
+ * Merges all the runs on the stack
+ *
+ * @param state [in, out]
+ */
+__attribute__((always_inline)) void merge_force_collapse(sort_state *state)
+{
+    sort_run *runs = state->runs;
+
+    while (state->n_runs > 1) {
+        coro_yield();
+        size_t n = state->n_runs - 2;
+        if ((n > 0) && (runs[n - 1].len < runs[n + 1].len)) --n;
+
+        merge_at(state, n);
     }
 }
 
 /*!
- * @param a [in] first index
- * @param b [in] second index
+ * Merges the runs at positions i and i + 1 of the stack
  *
- * @return minimum of two indices
+ * @param state [in, out]
+ * @param i [in]
  */
-static size_t min_idx(size_t a, size_t b)
+__attribute__((always_inline)) void merge_at(sort_state *state, size_t i)
 {
-    return (a <= b) ? a : b;
+    sort_run *runs = state->runs;
+
+    elem_t *a = state->arr + runs[i].base;
+    size_t na = runs[i].len;
+    elem_t *b = state->arr + runs[i + 1].base;
+    size_t nb = runs[i + 1].len;
+
+    runs[i].len += nb;
+    if (i + 2 < state->n_runs) runs[i + 1] = runs[i + 2];
+    --state->n_runs;
+    coro_yield();
+
+    size_t in_place = gallop_right(b[0], a, na, 0);
+    a += in_place;
+    na -= in_place;
+    if (na == 0) return;
+    coro_yield();
+
+    nb = gallop_left(a[na - 1], b, nb, nb - 1);
+    if (nb == 0) return;
+    coro_yield();
+
+#ifndef MERGE_SORT_SCALAR
+    if (state->simd && (na >= VEC_SZ) && (nb >= VEC_SZ) && interleaved(a, na, b, nb)) {
+        merge_avx2(a, memcpy(state->aux, a, na * sizeof(*a)), na, b, nb);
+        return;
+    }
+#endif
+
+    if (na <= nb) {
+        merge_lo(state, a, na, b, nb);
+    } else {
+        merge_hi(state, a, na, b, nb);
+    }
 }
 
 /*!
- * Merges two sorted subarrays
+ * Merges two adjacent runs from their beginnings, moving the left one to the auxiliary array
  *
- * @param writer [out] array to which the merge result is written to
- * @param reader [in] array containing the subarrays
- * @param left [in] left bound for first subarray (inclusive)
- * @param middle [in] right bound for first subarray (exclusive), left bound for second subarray (inclusive)
- * @param right [in] right bound for second subarray (exclusive)
+ * @param state [in, out]
+ * @param a [in, out] left run, whose first element goes after the first element of b
+ * @param na [in] length of a, at most nb
+ * @param b [in, out] right run, right after a, whose last element goes before the last element of a
+ * @param nb [in] length of b
  */
-void merge(elem_t *restrict writer, const elem_t *restrict reader, size_t left, size_t middle, size_t right)
+__attribute__((always_inline)) void merge_lo(sort_state *state, elem_t *a, size_t na, elem_t *b, size_t nb)
 {
-    assert(writer != NULL);
-    assert(reader != NULL);
+    elem_t *dest = a;
+    a = memcpy(state->aux, a, na * sizeof(*a));
+    size_t min_gallop = state->min_gallop;
 
-    for (size_t k = left, i = left, j = middle; k < right; ++k) {
-        coro_yield();
-        if ((i < middle) && ((j >= right) || (reader[i] <= reader[j]))) {
+    *dest++ = *b++;
+    if (--nb == 0) goto done;
+    if (na == 1) goto last_a;
+
+    for (;;) {
+        size_t a_wins = 0;
+        size_t b_wins = 0;
+
+        do {
             coro_yield();
-            writer[k] = reader[i++];
+            if (elem_less(*b, *a)) {
+                *dest++ = *b++;
+                ++b_wins;
+                a_wins = 0;
+                if (--nb == 0) goto done;
+            } else {
+                *dest++ = *a++;
+                ++a_wins;
+                b_wins = 0;
+                if (--na == 1) goto last_a;
+            }
+        } while ((a_wins | b_wins) < min_gallop);
+
+        ++min_gallop;
+        do {
             coro_yield();
-        } else {
+            min_gallop -= (min_gallop > 1);
+
+            a_wins = gallop_right(*b, a, na, 0);
+            if (a_wins != 0) {
+                memcpy(dest, a, a_wins * sizeof(*a));
+                dest += a_wins;
+                a += a_wins;
+                na -= a_wins;
+                if (na == 1) goto last_a;
+                if (na == 0) goto done;
+            }
+            *dest++ = *b++;
+            if (--nb == 0) goto done;
+
+            b_wins = gallop_left(*a, b, nb, 0);
+            if (b_wins != 0) {
+                memmove(dest, b, b_wins * sizeof(*b));
+                dest += b_wins;
+                b += b_wins;
+                nb -= b_wins;
+                if (nb == 0) goto done;
+            }
+            *dest++ = *a++;
+            if (--na == 1) goto last_a;
+        } while ((a_wins >= MIN_GALLOP) || (b_wins >= MIN_GALLOP));
+        ++min_gallop;
+    }
+
+done:
+    state->min_gallop = (min_gallop != 0) ? min_gallop : 1;
+    memcpy(dest, a, na * sizeof(*a));
+    return;
+
+last_a:
+    state->min_gallop = (min_gallop != 0) ? min_gallop : 1;
+    memmove(dest, b, nb * sizeof(*b));
+    dest[nb] = *a;
+}
+
+/*!
+ * Merges two adjacent runs from their ends, moving the right one to the auxiliary array
+ *
+ * @param state [in, out]
+ * @param a [in, out] left run, whose first element goes after the first element of b
+ * @param na [in] length of a
+ * @param b [in, out] right run, right after a, whose last element goes before the last element of a
+ * @param nb [in] length of b, less than na
+ */
+__attribute__((always_inline)) void merge_hi(sort_state *state, elem_t *a, size_t na, elem_t *b, size_t nb)
+{
+    elem_t *base_a = a;
+    elem_t *base_b = memcpy(state->aux, b, nb * sizeof(*b));
+    elem_t *dest = b + nb - 1;
+    size_t min_gallop = state->min_gallop;
+
+    a += na - 1;
+    b = base_b + nb - 1;
+
+    *dest-- = *a--;
+    if (--na == 0) goto done;
+    if (nb == 1) goto first_b;
+
+    for (;;) {
+        size_t a_wins = 0;
+        size_t b_wins = 0;
+
+        do {
             coro_yield();
-            writer[k] = reader[j++];
+            if (elem_less(*b, *a)) {
+                *dest-- = *a--;
+                ++a_wins;
+                b_wins = 0;
+                if (--na == 0) goto done;
+            } else {
+                *dest-- = *b--;
+                ++b_wins;
+                a_wins = 0;
+                if (--nb == 1) goto first_b;
+            }
+        } while ((a_wins | b_wins) < min_gallop);
+
+        ++min_gallop;
+        do {
             coro_yield();
+            min_gallop -= (min_gallop > 1);
+
+            a_wins = na - gallop_right(*b, base_a, na, na - 1);
+            if (a_wins != 0) {
+                dest -= a_wins;
+                a -= a_wins;
+                na -= a_wins;
+                memmove(dest + 1, a + 1, a_wins * sizeof(*a));
+                if (na == 0) goto done;
+            }
+            *dest-- = *b--;
+            if (--nb == 1) goto first_b;
+
+            b_wins = nb - gallop_left(*a, base_b, nb, nb - 1);
+            if (b_wins != 0) {
+                dest -= b_wins;
+                b -= b_wins;
+                nb -= b_wins;
+                memcpy(dest + 1, b + 1, b_wins * sizeof(*b));
+                if (nb == 1) goto first_b;
+                if (nb == 0) goto done;
+            }
+            *dest-- = *a--;
+            if (--na == 0) goto done;
+        } while ((a_wins >= MIN_GALLOP) || (b_wins >= MIN_GALLOP));
+        ++min_gallop;
+    }
+
+done:
+    state->min_gallop = (min_gallop != 0) ? min_gallop : 1;
+    memcpy(dest - (nb - 1), base_b, nb * sizeof(*b));
+    return;
+
+first_b:
+    state->min_gallop = (min_gallop != 0) ? min_gallop : 1;
+    dest -= na;
+    a -= na;
+    memmove(dest + 1, a + 1, na * sizeof(*a));
+    *dest = *b;
+}
+
+/*!
+ * Locates the leftmost position at which a key can be inserted into a sorted array, searching exponentially from a
+ * hint, then in binary
+ *
+ * @param key [in]
+ * @param arr [in] sorted array
+ * @param sz [in] size of arr, at least 1
+ * @param hint [in] position to start from, below sz
+ *
+ * @return k such that arr[k - 1] < key <= arr[k]
+ */
+size_t gallop_left(elem_t key, const elem_t *arr, size_t sz, size_t hint)
+{
+    ptrdiff_t last_ofs = 0;
+    ptrdiff_t ofs = 1;
+
+    if (elem_less(arr[hint], key)) {
+        ptrdiff_t max_ofs = (ptrdiff_t) (sz - hint);
+        while ((ofs < max_ofs) && elem_less(arr[hint + (size_t) ofs], key)) {
+            last_ofs = ofs;
+            ofs = (ofs << 1) + 1;
+        }
+        if (ofs > max_ofs) ofs = max_ofs;
+
+        last_ofs += (ptrdiff_t) hint;
+        ofs += (ptrdiff_t) hint;
+    } else {
+        ptrdiff_t max_ofs = (ptrdiff_t) hint + 1;
+        while ((ofs < max_ofs) && !elem_less(arr[hint - (size_t) ofs], key)) {
+            last_ofs = ofs;
+            ofs = (ofs << 1) + 1;
+        }
+        if (ofs > max_ofs) ofs = max_ofs;
+
+        ptrdiff_t tmp = last_ofs;
+        last_ofs = (ptrdiff_t) hint - ofs;
+        ofs = (ptrdiff_t) hint - tmp;
+    }
+
+    for (++last_ofs; last_ofs < ofs;) {
+        ptrdiff_t middle = last_ofs + (ofs - last_ofs) / 2;
+        if (elem_less(arr[middle], key)) {
+            last_ofs = middle + 1;
+        } else {
+            ofs = middle;
+        }
+    }
+
+    return (size_t) ofs;
+}
+
+/*!
+ * Locates the rightmost position at which a key can be inserted into a sorted array, searching exponentially from a
+ * hint, then in binary
+ *
+ * @param key [in]
+ * @param arr [in] sorted array
+ * @param sz [in] size of arr, at least 1
+ * @param hint [in] position to start from, below sz
+ *
+ * @return k such that arr[k - 1] <= key < arr[k]
+ */
+size_t gallop_right(elem_t key, const elem_t *arr, size_t sz, size_t hint)
+{
+    ptrdiff_t last_ofs = 0;
+    ptrdiff_t ofs = 1;
+
+    if (elem_less(key, arr[hint])) {
+        ptrdiff_t max_ofs = (ptrdiff_t) hint + 1;
+        while ((ofs < max_ofs) && elem_less(key, arr[hint - (size_t) ofs])) {
+            last_ofs = ofs;
+            ofs = (ofs << 1) + 1;
+        }
+        if (ofs > max_ofs) ofs = max_ofs;
+
+        ptrdiff_t tmp = last_ofs;
+        last_ofs = (ptrdiff_t) hint - ofs;
+        ofs = (ptrdiff_t) hint - tmp;
+    } else {
+        ptrdiff_t max_ofs = (ptrdiff_t) (sz - hint);
+        while ((ofs < max_ofs) && !elem_less(key, arr[hint + (size_t) ofs])) {
+            last_ofs = ofs;
+            ofs = (ofs << 1) + 1;
+        }
+        if (ofs > max_ofs) ofs = max_ofs;
+
+        last_ofs += (ptrdiff_t) hint;
+        ofs += (ptrdiff_t) hint;
+    }
+
+    for (++last_ofs; last_ofs < ofs;) {
+        ptrdiff_t middle = last_ofs + (ofs - last_ofs) / 2;
+        if (elem_less(key, arr[middle])) {
+            ofs = middle;
+        } else {
+            last_ofs = middle + 1;
+        }
+    }
+
+    return (size_t) ofs;
+}
+
+#ifndef MERGE_SORT_SCALAR
+/*!
+ * Estimates whether two runs interleave evenly enough for a merge to gain nothing from galloping
+ *
+ * @param a [in] left run
+ * @param na [in] length of a
+ * @param b [in] right run
+ * @param nb [in] length of b
+ *
+ * @return true if the middle element of b falls within the middle three quarters of a, false otherwise
+ */
+bool interleaved(const elem_t *a, size_t na, const elem_t *b, size_t nb)
+{
+    size_t rank = gallop_left(b[nb / 2], a, na, na / 2);
+
+    return (rank > na / 8) && (rank < na - na / 8);
+}
+
+/*!
+ * Merges two sorted arrays, picking elements without branches
+ *
+ * @param dest [out] array to store the result to, which may overlap b as long as it starts at least na elements before
+ * @param a [in] first sorted array
+ * @param na [in] size of a
+ * @param b [in] second sorted array
+ * @param nb [in] size of b
+ *
+ * @return end of the result
+ */
+elem_t *merge_branchless(elem_t *dest, const elem_t *a, size_t na, const elem_t *b, size_t nb)
+{
+    const elem_t *a_end = a + na;
+    const elem_t *b_end = b + nb;
+
+    while ((a < a_end) && (b < b_end)) {
+        bool take_b = elem_less(*b, *a);
+        *dest++ = take_b ? *b : *a;
+        a += !take_b;
+        b += take_b;
+    }
+
+    memmove(dest, a, (size_t) (a_end - a) * sizeof(*a));
+    dest += a_end - a;
+    memmove(dest, b, (size_t) (b_end - b) * sizeof(*b));
+
+    return dest + (b_end - b);
+}
+
+/*!
+ * Sorts a short array with a sorting network with AVX2
+ *
+ * @param arr [in, out]
+ * @param sz [in] size of arr, at most NETWORK_SZ
+ */
+__attribute__((target("avx2"))) void sort_network_avx2(elem_t *arr, size_t sz)
+{
+    assert(sz <= NETWORK_SZ);
+
+    static const uint8_t comparators[][2] = {
+        {0, 2}, {1, 3}, {4, 6}, {5, 7}, {0, 4}, {1, 5}, {2, 6}, {3, 7}, {0, 1}, {2, 3},
+        {4, 5}, {6, 7}, {2, 4}, {3, 5}, {1, 4}, {3, 6}, {1, 2}, {3, 4}, {5, 6},
+    };
+
+    elem_t padded[NETWORK_SZ];
+    memcpy(padded, arr, sz * sizeof(*arr));
+    for (size_t i = sz; i < NETWORK_SZ; ++i) {
+        padded[i] = INT32_MAX;
+    }
+
+    __m256i vecs[VEC_SZ];
+    for (size_t i = 0; i < VEC_SZ; ++i) {
+        vecs[i] = _mm256_loadu_si256((const __m256i *) (padded + i * VEC_SZ));
+    }
+
+    for (size_t i = 0; i < sizeof(comparators) / sizeof(*comparators); ++i) {
+        compare_exchange(&vecs[comparators[i][0]], &vecs[comparators[i][1]]);
+    }
+    transpose(vecs);
+
+    for (size_t width = 1; width < VEC_SZ; width *= 2) {
+        for (size_t i = 0; i < VEC_SZ; i += 2 * width) {
+            bitonic_merge(vecs + i, width);
         }
     }
+
+    for (size_t i = 0; i < VEC_SZ; ++i) {
+        _mm256_storeu_si256((__m256i *) (padded + i * VEC_SZ), vecs[i]);
+    }
+    memcpy(arr, padded, sz * sizeof(*arr));
+}
+
+/*!
+ * Merges two sorted arrays with AVX2
+ *
+ * @param dest [out] array to store the result to, which may overlap b as long as it starts at least na elements before
+ * @param a [in] first sorted array
+ * @param na [in] size of a, at least VEC_SZ
+ * @param b [in] second sorted array
+ * @param nb [in] size of b, at least VEC_SZ
+ */
+__attribute__((target("avx2"))) void merge_avx2(elem_t *dest, const elem_t *a, size_t na, const elem_t *b, size_t nb)
+{
+    assert((na >= VEC_SZ) && (nb >= VEC_SZ));
+
+    const elem_t *a_end = a + na;
+    const elem_t *b_end = b + nb;
+
+    __m256i vecs[2] = {_mm256_loadu_si256((const __m256i *) a), _mm256_loadu_si256((const __m256i *) b)};
+    a += VEC_SZ;
+    b += VEC_SZ;
+
+    for (size_t i = 1; (a_end - a >= VEC_SZ) && (b_end - b >= VEC_SZ); ++i) {
+        bitonic_merge(vecs, 1);
+        _mm256_storeu_si256((__m256i *) dest, vecs[0]);
+        dest += VEC_SZ;
+
+        bool take_b = elem_less(*b, *a);
+        const elem_t *next = take_b ? b : a;
+        a += take_b ? 0 : VEC_SZ;
+        b += take_b ? VEC_SZ : 0;
+        vecs[0] = _mm256_loadu_si256((const __m256i *) next);
+
+        if (i % YIELD_VECS == 0) coro_yield();
+    }
+    bitonic_merge(vecs, 1);
+    _mm256_storeu_si256((__m256i *) dest, vecs[0]);
+    dest += VEC_SZ;
+
+    elem_t held[VEC_SZ];
+    _mm256_storeu_si256((__m256i *) held, vecs[1]);
+
+    elem_t tail[2 * VEC_SZ];
+    if (a_end - a < VEC_SZ) {
+        size_t n_tail = (size_t) (merge_branchless(tail, held, VEC_SZ, a, (size_t) (a_end - a)) - tail);
+        merge_branchless(dest, tail, n_tail, b, (size_t) (b_end - b));
+    } else {
+        size_t n_tail = (size_t) (merge_branchless(tail, held, VEC_SZ, b, (size_t) (b_end - b)) - tail);
+        merge_branchless(dest, a, (size_t) (a_end - a), tail, n_tail);
+    }
+}
+
+/*!
+ * Puts the lanewise minimums of two vectors into the first and the maximums into the second
+ *
+ * @param lo [in, out]
+ * @param hi [in, out]
+ */
+__attribute__((target("avx2"), always_inline)) inline void compare_exchange(__m256i *lo, __m256i *hi)
+{
+    __m256i min = _mm256_min_epi32(*lo, *hi);
+    *hi = _mm256_max_epi32(*lo, *hi);
+    *lo = min;
+}
+
+/*!
+ * @param vec [in]
+ *
+ * @return vec with its lanes in reverse order
+ */
+__attribute__((target("avx2"), always_inline)) inline __m256i reverse(__m256i vec)
+{
+    return _mm256_permutevar8x32_epi32(vec, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+/*!
+ * Sorts a bitonic sequence within a vector
+ *
+ * @param vec [in]
+ *
+ * @return vec sorted
+ */
+__attribute__((target("avx2"), always_inline)) inline __m256i bitonic_sort_vec(__m256i vec)
+{
+    __m256i other = _mm256_permute2x128_si256(vec, vec, 0x01);
+    vec = _mm256_blend_epi32(_mm256_min_epi32(vec, other), _mm256_max_epi32(vec, other), 0xf0);
+
+    other = _mm256_shuffle_epi32(vec, _MM_SHUFFLE(1, 0, 3, 2));
+    vec = _mm256_blend_epi32(_mm256_min_epi32(vec, other), _mm256_max_epi32(vec, other), 0xcc);
+
+    other = _mm256_shuffle_epi32(vec, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm256_blend_epi32(_mm256_min_epi32(vec, other), _mm256_max_epi32(vec, other), 0xaa);
+}
+
+/*!
+ * Sorts a bitonic sequence spread over vectors in order
+ *
+ * @param vecs [in, out]
+ * @param n [in] number of vectors, a power of two
+ */
+__attribute__((target("avx2"), always_inline)) inline void bitonic_sort(__m256i *vecs, size_t n)
+{
+    for (size_t distance = n / 2; distance > 0; distance /= 2) {
+        for (size_t i = 0; i < n; ++i) {
+            if ((i & distance) == 0) compare_exchange(&vecs[i], &vecs[i + distance]);
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        vecs[i] = bitonic_sort_vec(vecs[i]);
+    }
+}
+
+/*!
+ * Merges two sorted sequences spread over adjacent vectors in order
+ *
+ * @param vecs [in, out] 2 * n vectors, the first n holding one sequence and the rest the other
+ * @param n [in] number of vectors in a sequence, a power of two
+ */
+__attribute__((target("avx2"), always_inline)) inline void bitonic_merge(__m256i *vecs, size_t n)
+{
+    __m256i reversed[VEC_SZ];
+    for (size_t i = 0; i < n; ++i) {
+        reversed[i] = reverse(vecs[2 * n - 1 - i]);
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        vecs[n + i] = _mm256_max_epi32(vecs[i], reversed[i]);
+        vecs[i] = _mm256_min_epi32(vecs[i], reversed[i]);
+    }
+
+    bitonic_sort(vecs, n);
+    bitonic_sort(vecs + n, n);
+}
+
+/*!
+ * Transposes the 8x8 matrix of elements held in eight vectors
+ *
+ * @param vecs [in, out]
+ */
+__attribute__((target("avx2"), always_inline)) inline void transpose(__m256i *vecs)
+{
+    __m256i pairs[VEC_SZ];
+    for (size_t i = 0; i < VEC_SZ; i += 2) {
+        pairs[i] = _mm256_unpacklo_epi32(vecs[i], vecs[i + 1]);
+        pairs[i + 1] = _mm256_unpackhi_epi32(vecs[i], vecs[i + 1]);
+    }
+
+    __m256i quads[VEC_SZ];
+    for (size_t i = 0; i < VEC_SZ; i += 4) {
+        quads[i] = _mm256_unpacklo_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 1] = _mm256_unpackhi_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 2] = _mm256_unpacklo_epi64(pairs[i + 1], pairs[i + 3]);
+        quads[i + 3] = _mm256_unpackhi_epi64(pairs[i + 1], pairs[i + 3]);
+    }
+
+    for (size_t i = 0; i < VEC_SZ / 2; ++i) {
+        vecs[i] = _mm256_permute2x128_si256(quads[i], quads[i + 4], 0x20);
+        vecs[i + 4] = _mm256_permute2x128_si256(quads[i], quads[i + 4], 0x31);
+    }
 }
+#endif
@@ -0,0 +1,125 @@
+#include "radix_sort.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coro.h"
+#include "dynamic_memory_management.h"
+#include "merge_sort.h"
+
+/*
+ * Least significant digit first radix sort. Elements are mapped to their unsigned keys (see elem.h), and the keys are
+ * split into 11-bit digits, three passes for 32 bits and six for 64: fewer passes over the array pay off more than the
+ * narrower scatter of 8-bit digits, and the counters of a pass still fit in L1. The histograms of all the digits are
+ * counted in a single read of the array, after which each pass scatters the elements between arr and aux by one
+ * digit. Passes whose digit is the same for all elements are skipped, which is common for numbers of a narrow range.
+ * Being LSD, the sort is stable, so records are sorted by key keeping the order of equal keys.
+ *
+ * The histograms take 24 KiB for 32-bit keys and 48 KiB for 64-bit ones, their counters being 32-bit, which is more
+ * than the smallest coroutine stacks can hold, so they are allocated on the heap; should that fail, the array is merge
+ * sorted instead, which needs no memory besides aux.
+ */
+
+/*!
+ * Number of bits in a digit
+ */
+enum { DIGIT_BITS = 11 };
+
+/*!
+ * Number of values of a digit
+ */
+enum { N_BUCKETS = 1 << DIGIT_BITS };
+
+/*!
+ * Number of digits in a key
+ */
+enum { N_DIGITS = (sizeof(elem_key_t) * 8 + DIGIT_BITS - 1) / DIGIT_BITS };
+
+/*!
+ * Number of elements counted or scattered between calls to coro_yield()
+ */
+enum { YIELD_STRIDE = 4096 };
+
+static inline size_t radix_digit(elem_t elem, size_t digit);
+
+/*!
+ * Implementation of radix sort with coroutines
+ *
+ * @param arr [in, out] array to sort
+ * @param aux [in, out] auxiliary array, expected to be at least the same size as arr
+ * @param sz [in] size of arrays, at most UINT32_MAX
+ *
+ * @note sorting result in stored in arr
+ */
+void radix_sort_array_with_coroutines(elem_t *restrict arr, elem_t *restrict aux, size_t sz)
+{
+    assert((arr != NULL) || (sz == 0));
+    assert((aux != NULL) || (sz == 0));
+    assert(sz <= UINT32_MAX);
+
+    if (sz < 2) return;
+    coro_yield();
+
+    uint32_t (*counts)[N_BUCKETS] = calloc(N_DIGITS, sizeof(*counts));
+    coro_yield();
+    if (counts == NULL) {
+        merge_sort_array_with_coroutines(arr, aux, sz);
+        return;
+    }
+    coro_yield();
+
+    for (size_t begin = 0; begin < sz; begin += YIELD_STRIDE) {
+        size_t end = (sz - begin < YIELD_STRIDE) ? sz : begin + YIELD_STRIDE;
+        for (size_t i = begin; i < end; ++i) {
+            for (size_t digit = 0; digit < N_DIGITS; ++digit) {
+                ++counts[digit][radix_digit(arr[i], digit)];
+            }
+        }
+        coro_yield();
+    }
+
+    elem_t *from = arr;
+    elem_t *to = aux;
+    for (size_t digit = 0; digit < N_DIGITS; ++digit) {
+        coro_yield();
+        uint32_t *offsets = counts[digit];
+        if (offsets[radix_digit(from[0], digit)] == sz) continue;
+
+        uint32_t sum = 0;
+        for (size_t bucket = 0; bucket < N_BUCKETS; ++bucket) {
+            uint32_t count = offsets[bucket];
+            offsets[bucket] = sum;
+            sum += count;
+        }
+        coro_yield();
+
+        for (size_t begin = 0; begin < sz; begin += YIELD_STRIDE) {
+            size_t end = (sz - begin < YIELD_STRIDE) ? sz : begin + YIELD_STRIDE;
+            for (size_t i = begin; i < end; ++i) {
+                to[offsets[radix_digit(from[i], digit)]++] = from[i];
+            }
+            coro_yield();
+        }
+
+        elem_t *tmp = from;
+        from = to;
+        to = tmp;
+    }
+
+    if (from != arr) memcpy(arr, from, sz * sizeof(*arr));
+    coro_yield();
+    free_and_null((void **) &counts);
+}
+
+/*!
+ * @param elem [in]
+ * @param digit [in] index of the digit, from the least significant one
+ *
+ * @return value of the digit of elem's key
+ */
+size_t radix_digit(elem_t elem, size_t digit)
+{
+    return (size_t) (elem_key(elem) >> (digit * DIGIT_BITS)) & (N_BUCKETS - 1);
+}
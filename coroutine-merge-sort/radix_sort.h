@@ -0,0 +1,10 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <stddef.h>
+
+#include "elem.h"
+
+void radix_sort_array_with_coroutines(elem_t *restrict arr, elem_t *restrict aux, size_t sz);
+
+#endif /* RADIX_SORT_H */
@@ -0,0 +1,422 @@
+#include "run_file.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "coro_arena.h"
+#include "coro_io.h"
+#include "dynamic_memory_management.h"
+#include "errors.h"
+
+_Static_assert(sizeof(run_header) == 64, "run header must take 64 bytes");
+
+static const char RUN_MAGIC[8] = {'C', 'M', 'S', 'R', 'U', 'N', '\r', '\n'};
+static const uint32_t RUN_VERSION = 1;
+#if defined(ELEM_INT32)
+static const run_elem_type RUN_ELEM_TYPE = RUN_ELEM_INT32;
+#elif defined(ELEM_INT64)
+static const run_elem_type RUN_ELEM_TYPE = RUN_ELEM_INT64;
+#elif defined(ELEM_UINT64)
+static const run_elem_type RUN_ELEM_TYPE = RUN_ELEM_UINT64;
+#elif defined(ELEM_DOUBLE)
+static const run_elem_type RUN_ELEM_TYPE = RUN_ELEM_FLOAT64;
+#elif defined(ELEM_RECORD)
+static const run_elem_type RUN_ELEM_TYPE = RUN_ELEM_RECORD;
+#endif
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+/*!
+ * Number of elements byte-swapped at once when writing runs on big-endian hosts
+ */
+static const size_t SWAP_BUF_SZ = 64 * 1024;
+
+static void elems_swap(elem_t *dst, const elem_t *src, size_t sz);
+#endif
+
+static bool write_elems(int fd, const elem_t *elems, size_t sz, off_t offset);
+static bool write_all(int fd, const void *buf, size_t nbytes, off_t offset);
+static bool read_all(int fd, void *buf, size_t nbytes, off_t offset);
+static bool run_check_size(int fd, size_t sz);
+
+/*!
+ * @param header [out]
+ * @param sz     [in] number of elements
+ * @param sorted [in] whether the elements are sorted
+ */
+void run_header_init(run_header *header, size_t sz, bool sorted)
+{
+    assert(header != NULL);
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, RUN_MAGIC, sizeof(RUN_MAGIC));
+    header->version = htole32(RUN_VERSION);
+    header->elem_type = htole32(RUN_ELEM_TYPE);
+    header->count = htole64(sz);
+    header->flags = htole32(sorted ? RUN_SORTED : 0);
+}
+
+/*!
+ * @param buf [in] beginning of a file
+ * @param len [in] number of bytes available
+ *
+ * @return whether the file starts with a run header
+ */
+bool run_header_is_run(const void *buf, size_t len)
+{
+    assert(buf != NULL);
+
+    return (len >= sizeof(run_header)) && (memcmp(buf, RUN_MAGIC, sizeof(RUN_MAGIC)) == 0);
+}
+
+/*!
+ * Validates a run header
+ *
+ * @param header [in]
+ * @param sz     [out] number of elements
+ * @param sorted [out] whether the elements are sorted
+ *
+ * @return true on success, false if the run has another version or element type
+ */
+bool run_header_decode(const run_header *header, size_t *sz, bool *sorted)
+{
+    assert(header != NULL);
+    assert(sz != NULL);
+    assert(sorted != NULL);
+
+    if ((le32toh(header->version) != RUN_VERSION) || (le32toh(header->elem_type) != RUN_ELEM_TYPE)) {
+        errno = EPROTO;
+        HANDLE_ERROR("run header: ", { return false; });
+    }
+
+    *sz = (size_t) le64toh(header->count);
+    *sorted = (le32toh(header->flags) & RUN_SORTED) != 0;
+
+    return true;
+}
+
+/*!
+ * Writes elements as a run
+ *
+ * @param fd     [in] file descriptor to write to, at its current offset
+ * @param elems  [in]
+ * @param sz     [in]
+ * @param sorted [in] whether the elements are sorted
+ *
+ * @return true on success, false otherwise
+ */
+bool run_write(int fd, const elem_t *elems, size_t sz, bool sorted)
+{
+    return run_write_header(fd, sz, sorted) && write_elems(fd, elems, sz, -1);
+}
+
+/*!
+ * Writes the header of a run whose elements are written with run_write_elems() afterwards
+ *
+ * @param fd     [in] file descriptor to write to, at its current offset
+ * @param sz     [in] total number of elements the run is going to hold
+ * @param sorted [in] whether the elements are sorted
+ *
+ * @return true on success, false otherwise
+ */
+bool run_write_header(int fd, size_t sz, bool sorted)
+{
+    run_header header;
+    run_header_init(&header, sz, sorted);
+
+    return write_all(fd, &header, sizeof(header), -1);
+}
+
+/*!
+ * Writes elements into a run whose header has already been written, without using the file offset
+ *
+ * @param fd    [in] file descriptor of a run file, the run starting at the beginning of the file
+ * @param elems [in]
+ * @param sz    [in]
+ * @param first [in] position of the first element within the run
+ *
+ * @return true on success, false otherwise
+ *
+ * @note disjoint ranges of a run may be written concurrently
+ */
+bool run_write_elems(int fd, const elem_t *elems, size_t sz, size_t first)
+{
+    return write_elems(fd, elems, sz, (off_t) (sizeof(run_header) + first * sizeof(*elems)));
+}
+
+/*!
+ * Reads a run through the scheduler's I/O reactor
+ *
+ * @param fd     [in] file descriptor of a run file
+ * @param elems  [out] elements, expected to be NULL
+ * @param sz     [out] number of elements
+ * @param sorted [out] whether the elements are sorted
+ *
+ * @return true on success, false otherwise
+ *
+ * @attention dynamically allocates elems, therefore the caller is responsible for freeing it
+ */
+bool run_read(int fd, elem_t **elems, size_t *sz, bool *sorted)
+{
+    assert(elems != NULL);
+    assert(*elems == NULL);
+    assert(sz != NULL);
+    assert(sorted != NULL);
+
+    run_header header;
+    if (!read_all(fd, &header, sizeof(header), 0)) return false;
+    if (!run_header_is_run(&header, sizeof(header))) {
+        errno = EPROTO;
+        HANDLE_ERROR("run header: ", { return false; });
+    }
+    if (!run_header_decode(&header, sz, sorted)) return false;
+    if (!run_check_size(fd, *sz)) return false;
+
+    if ((*elems = malloc((*sz != 0) ? *sz * sizeof(**elems) : 1)) == NULL) HANDLE_ERROR("malloc: ", { return false; });
+    coro_arena_advise(*elems, *sz * sizeof(**elems));
+    if (!read_all(fd, *elems, *sz * sizeof(**elems), sizeof(header))) {
+        free_and_null((void **) elems);
+
+        return false;
+    }
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    elems_swap(*elems, *elems, *sz);
+#endif
+
+    return true;
+}
+
+/*!
+ * Maps a run read-only
+ *
+ * @param fd      [in] file descriptor of a run file
+ * @param mapping [out]
+ *
+ * @return true on success, false otherwise
+ *
+ * @note the elements are used as stored, hence mapping runs requires a little-endian host
+ */
+bool run_map(int fd, run_mapping *mapping)
+{
+    assert(mapping != NULL);
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    errno = ENOTSUP;
+    HANDLE_ERROR("run_map: ", { return false; });
+#endif
+
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) HANDLE_ERROR("fstat: ", { return false; });
+    if ((size_t) stat_buf.st_size < sizeof(run_header)) {
+        errno = EPROTO;
+        HANDLE_ERROR("run header: ", { return false; });
+    }
+
+    mapping->map_sz = (size_t) stat_buf.st_size;
+    mapping->map = mmap(NULL, mapping->map_sz, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping->map == MAP_FAILED) HANDLE_ERROR("mmap: ", { return false; });
+
+    const run_header *header = mapping->map;
+    if (!run_header_is_run(header, mapping->map_sz)) {
+        errno = EPROTO;
+        HANDLE_ERROR("run header: ", { goto cleanup; });
+    }
+    if (!run_header_decode(header, &mapping->sz, &mapping->sorted)) goto cleanup;
+    if (mapping->sz > (mapping->map_sz - sizeof(*header)) / sizeof(elem_t)) {
+        errno = EPROTO;
+        HANDLE_ERROR("run size: ", { goto cleanup; });
+    }
+    mapping->elems = (elem_t *) (header + 1);
+
+    return true;
+
+cleanup:
+    run_unmap(mapping);
+
+    return false;
+}
+
+/*!
+ * Creates a run of a given size and maps it read-write, so that the elements can be produced right in the file
+ *
+ * @param fd      [in] file descriptor of a file opened for reading and writing, which gets truncated
+ * @param sz      [in] number of elements
+ * @param sorted  [in] whether the elements are going to be sorted
+ * @param mapping [out]
+ *
+ * @return true on success, false otherwise
+ *
+ * @note the elements are used as stored, hence mapping runs requires a little-endian host
+ */
+bool run_map_create(int fd, size_t sz, bool sorted, run_mapping *mapping)
+{
+    assert(mapping != NULL);
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    errno = ENOTSUP;
+    HANDLE_ERROR("run_map_create: ", { return false; });
+#endif
+
+    mapping->map_sz = sizeof(run_header) + sz * sizeof(elem_t);
+    if (ftruncate(fd, (off_t) mapping->map_sz) != 0) HANDLE_ERROR("ftruncate: ", { return false; });
+
+    mapping->map = mmap(NULL, mapping->map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping->map == MAP_FAILED) HANDLE_ERROR("mmap: ", { return false; });
+
+    run_header *header = mapping->map;
+    run_header_init(header, sz, sorted);
+    mapping->elems = (elem_t *) (header + 1);
+    mapping->sz = sz;
+    mapping->sorted = sorted;
+
+    return true;
+}
+
+/*!
+ * Unmaps a run
+ *
+ * @param mapping [in, out]
+ */
+void run_unmap(run_mapping *mapping)
+{
+    assert(mapping != NULL);
+
+    if ((mapping->map != NULL) && (mapping->map != MAP_FAILED)) {
+        if (munmap(mapping->map, mapping->map_sz) != 0) HANDLE_ERROR("munmap: ", {});
+    }
+    mapping->map = NULL;
+    mapping->elems = NULL;
+}
+
+/*!
+ * Writes elements in their stored byte order
+ *
+ * @param fd     [in]
+ * @param elems  [in]
+ * @param sz     [in]
+ * @param offset [in] offset at which to write, -1 to write at the file offset
+ *
+ * @return true on success, false otherwise
+ */
+bool write_elems(int fd, const elem_t *elems, size_t sz, off_t offset)
+{
+    assert((elems != NULL) || (sz == 0));
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return write_all(fd, elems, sz * sizeof(*elems), offset);
+#else
+    elem_t *buf = malloc(SWAP_BUF_SZ * sizeof(*buf));
+    if (buf == NULL) HANDLE_ERROR("malloc: ", { return false; });
+
+    for (size_t i = 0; i < sz; i += SWAP_BUF_SZ) {
+        size_t n = (sz - i < SWAP_BUF_SZ) ? sz - i : SWAP_BUF_SZ;
+        elems_swap(buf, elems + i, n);
+        if (!write_all(fd, buf, n * sizeof(*buf), (offset == -1) ? -1 : offset + (off_t) (i * sizeof(*buf)))) {
+            free(buf);
+            return false;
+        }
+    }
+    free(buf);
+
+    return true;
+#endif
+}
+
+/*!
+ * Writes a buffer in full
+ *
+ * @param fd     [in]
+ * @param buf    [in]
+ * @param nbytes [in]
+ * @param offset [in] offset at which to write, -1 to write at the file offset
+ *
+ * @return true on success, false otherwise
+ */
+bool write_all(int fd, const void *buf, size_t nbytes, off_t offset)
+{
+    for (const char *writer = buf; nbytes != 0;) {
+        ssize_t n_written = (offset == -1) ? write(fd, writer, nbytes) : pwrite(fd, writer, nbytes, offset);
+        if (n_written == -1) {
+            if (errno == EINTR) continue;
+
+            HANDLE_ERROR("write: ", { return false; });
+        }
+
+        writer += n_written;
+        nbytes -= (size_t) n_written;
+        if (offset != -1) offset += n_written;
+    }
+
+    return true;
+}
+
+/*!
+ * Reads a buffer in full through the scheduler's I/O reactor
+ *
+ * @param fd     [in]
+ * @param buf    [out]
+ * @param nbytes [in]
+ * @param offset [in]
+ *
+ * @return true on success, false otherwise (including a premature end of the file)
+ */
+bool read_all(int fd, void *buf, size_t nbytes, off_t offset)
+{
+    for (char *reader = buf; nbytes != 0;) {
+        ssize_t n_read = coro_io_read(fd, reader, nbytes, offset);
+        if (n_read == -1) HANDLE_ERROR("coro_io_read: ", { return false; });
+        if (n_read == 0) {
+            errno = EPROTO;
+            HANDLE_ERROR("run size: ", { return false; });
+        }
+
+        reader += n_read;
+        offset += n_read;
+        nbytes -= (size_t) n_read;
+    }
+
+    return true;
+}
+
+/*!
+ * @param fd [in] file descriptor of a run file
+ * @param sz [in] number of elements according to the run's header
+ *
+ * @return whether the file is large enough to hold the elements
+ */
+bool run_check_size(int fd, size_t sz)
+{
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) HANDLE_ERROR("fstat: ", { return false; });
+
+    if (sz > ((size_t) stat_buf.st_size - sizeof(run_header)) / sizeof(elem_t)) {
+        errno = EPROTO;
+        HANDLE_ERROR("run size: ", { return false; });
+    }
+
+    return true;
+}
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+/*!
+ * Converts elements between the host's and little-endian byte order
+ *
+ * @param dst [out] may be the same as src
+ * @param src [in]
+ * @param sz  [in]
+ */
+void elems_swap(elem_t *dst, const elem_t *src, size_t sz)
+{
+    for (size_t i = 0; i < sz; ++i) {
+        dst[i] = elem_swap_le(src[i]);
+    }
+}
+#endif
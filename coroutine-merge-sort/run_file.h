@@ -0,0 +1,70 @@
+#ifndef RUN_FILE_H
+#define RUN_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "elem.h"
+
+/*
+ * Binary run format: a 64-byte header followed by the elements as raw little-endian values, so that runs exchanged
+ * between jobs skip text conversion and can be mapped straight into memory. All header fields are little-endian.
+ */
+
+/*!
+ * Codes of element types stored in runs, of which a build reads and writes the one it's specialized for (see elem.h)
+ *
+ * @details records are stored as their 64-bit key followed by their 64-bit payload
+ */
+typedef enum {
+    RUN_ELEM_INT32 = 1,
+    RUN_ELEM_INT64 = 2,
+    RUN_ELEM_UINT64 = 3,
+    RUN_ELEM_FLOAT64 = 4,
+    RUN_ELEM_RECORD = 5,
+} run_elem_type;
+
+/*!
+ * Flags of runs
+ */
+enum {
+    RUN_SORTED = 1 << 0,
+};
+
+/*!
+ * Header of a run file
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t elem_type;
+    uint64_t count;
+    uint32_t flags;
+    uint8_t reserved[36];
+} run_header;
+
+/*!
+ * Run file mapped into memory
+ */
+typedef struct {
+    void *map;
+    size_t map_sz;
+    elem_t *elems;
+    size_t sz;
+    bool sorted;
+} run_mapping;
+
+void run_header_init(run_header *header, size_t sz, bool sorted);
+bool run_header_is_run(const void *buf, size_t len);
+bool run_header_decode(const run_header *header, size_t *sz, bool *sorted);
+
+bool run_write(int fd, const elem_t *elems, size_t sz, bool sorted);
+bool run_write_header(int fd, size_t sz, bool sorted);
+bool run_write_elems(int fd, const elem_t *elems, size_t sz, size_t first);
+bool run_read(int fd, elem_t **elems, size_t *sz, bool *sorted);
+bool run_map(int fd, run_mapping *mapping);
+bool run_map_create(int fd, size_t sz, bool sorted, run_mapping *mapping);
+void run_unmap(run_mapping *mapping);
+
+#endif /* RUN_FILE_H */
@@ -0,0 +1,78 @@
+#include "sort_kernel.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "merge_sort.h"
+#include "radix_sort.h"
+
+/*
+ * Choice between the sort engines. Radix sort takes a fixed number of passes whatever the input, which beats the
+ * comparisons of merge sort on random numbers by several times, but its fixed cost of clearing and summing the
+ * histograms dominates small arrays. Merge sort, on the other hand, is adaptive and takes about one pass over input
+ * that is nearly sorted (ascending or descending) on a large scale. So small arrays go to merge sort, and so do
+ * larger ones whose evenly spaced samples come out nearly monotonic; the rest go to radix sort. Sampling tells
+ * locally shuffled data, which merge sort handles in close to linear time, from independently sorted blocks, which
+ * it doesn't. Arrays beyond the reach of radix sort's 32-bit counters go to merge sort as well.
+ */
+
+/*!
+ * Arrays smaller than this are sorted with merge sort
+ */
+enum { RADIX_MIN_SZ = 256 };
+
+/*!
+ * Number of pairs of neighbouring samples compared to estimate whether an array is presorted
+ */
+enum { N_SAMPLE_PAIRS = 64 };
+
+/*!
+ * Maximum number of sample pairs out of order for an array to count as presorted
+ */
+enum { MAX_SAMPLE_INVERSIONS = N_SAMPLE_PAIRS / 16 };
+
+static bool prefers_merge_sort(const elem_t *arr, size_t sz);
+
+/*!
+ * Sorts an array with the engine that suits it best, yielding cooperatively
+ *
+ * @param arr [in, out] array to sort
+ * @param aux [in, out] auxiliary array, expected to be at least the same size as arr
+ * @param sz [in] size of arrays
+ *
+ * @note sorting result in stored in arr
+ */
+void sort_array_with_coroutines(elem_t *restrict arr, elem_t *restrict aux, size_t sz)
+{
+    if (prefers_merge_sort(arr, sz)) {
+        merge_sort_array_with_coroutines(arr, aux, sz);
+    } else {
+        radix_sort_array_with_coroutines(arr, aux, sz);
+    }
+}
+
+/*!
+ * Decides whether merge sort is likely faster than radix sort on an array
+ *
+ * @param arr [in]
+ * @param sz [in] size of arr
+ *
+ * @return true if arr is small, huge or its samples are nearly ascending or nearly descending, false otherwise
+ */
+bool prefers_merge_sort(const elem_t *arr, size_t sz)
+{
+    if ((sz < RADIX_MIN_SZ) || (sz > UINT32_MAX)) return true;
+
+    size_t stride = (sz - 1) / N_SAMPLE_PAIRS;
+    size_t n_descents = 0;
+    size_t n_ascents = 0;
+    for (size_t i = 0; i < N_SAMPLE_PAIRS; ++i) {
+        elem_t curr = arr[i * stride];
+        elem_t next = arr[(i + 1) * stride];
+
+        n_descents += elem_less(next, curr);
+        n_ascents += elem_less(curr, next);
+    }
+
+    return (n_descents <= MAX_SAMPLE_INVERSIONS) || (n_ascents <= MAX_SAMPLE_INVERSIONS);
+}
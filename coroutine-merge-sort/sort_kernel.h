@@ -0,0 +1,10 @@
+#ifndef SORT_KERNEL_H
+#define SORT_KERNEL_H
+
+#include <stddef.h>
+
+#include "elem.h"
+
+void sort_array_with_coroutines(elem_t *restrict arr, elem_t *restrict aux, size_t sz);
+
+#endif /* SORT_KERNEL_H */
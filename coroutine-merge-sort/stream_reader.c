@@ -0,0 +1,136 @@
+#include "stream_reader.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dynamic_memory_management.h"
+#include "errors.h"
+
+static bool stream_reader_submit(stream_reader *reader);
+
+/*!
+ * Sets up a reader and submits the read of the first chunk
+ *
+ * @param reader   [out]
+ * @param fd       [in] file descriptor to read from, starting at offset 0
+ * @param chunk_sz [in] size of each of the two buffers
+ *
+ * @return true on success, false otherwise
+ *
+ * @note the reader's request must not go out of scope while a read is in flight, so the reader is expected to live on
+ * the stack of the coroutine using it until it's closed
+ */
+bool stream_reader_open(stream_reader *reader, int fd, size_t chunk_sz)
+{
+    return stream_reader_open_range(reader, fd, chunk_sz, 0, -1);
+}
+
+/*!
+ * Sets up a reader of a range of a file and submits the read of the first chunk
+ *
+ * @param reader   [out]
+ * @param fd       [in] file descriptor to read from
+ * @param chunk_sz [in] size of each of the two buffers
+ * @param offset   [in] offset at which the range starts
+ * @param end      [in] offset at which the range ends, -1 to read up to the end of the file
+ *
+ * @return true on success, false otherwise
+ *
+ * @note chunks start at multiples of chunk_sz past offset, so they're aligned to whatever divides both
+ */
+bool stream_reader_open_range(stream_reader *reader, int fd, size_t chunk_sz, off_t offset, off_t end)
+{
+    assert(reader != NULL);
+    assert(chunk_sz != 0);
+    assert((end == -1) || (offset <= end));
+
+    reader->fd = fd;
+    reader->chunk_sz = chunk_sz;
+    reader->offset = offset;
+    reader->end = end;
+    reader->pending = 0;
+    reader->in_flight = false;
+
+    reader->bufs[0] = malloc(chunk_sz);
+    reader->bufs[1] = malloc(chunk_sz);
+    if ((reader->bufs[0] == NULL) || (reader->bufs[1] == NULL)) HANDLE_ERROR("malloc: ", { goto cleanup; });
+
+    if (!stream_reader_submit(reader)) goto cleanup;
+
+    return true;
+
+cleanup:
+    stream_reader_close(reader);
+
+    return false;
+}
+
+/*!
+ * Waits for the next chunk, then submits the read of the one after it into the buffer of the previous chunk
+ *
+ * @param reader [in, out]
+ * @param chunk  [out] chunk read, valid until the next call
+ *
+ * @return size of the chunk, 0 at the end of the file (or of the range), -1 on failure
+ */
+ssize_t stream_reader_next(stream_reader *reader, const char **chunk)
+{
+    assert(reader != NULL);
+    assert(chunk != NULL);
+
+    if (!reader->in_flight) return 0;
+
+    ssize_t n_read = coro_io_await(&reader->req);
+    reader->in_flight = false;
+    if (n_read == -1) HANDLE_ERROR("coro_io_await: ", { return -1; });
+    if (n_read == 0) return 0;
+
+    *chunk = reader->bufs[reader->pending];
+    reader->offset += n_read;
+    reader->pending ^= 1;
+    if (!stream_reader_submit(reader)) return -1;
+
+    return n_read;
+}
+
+/*!
+ * Waits for the read in flight, if any, and frees the reader's buffers
+ *
+ * @param reader [in, out]
+ *
+ * @attention doesn't close the file descriptor
+ */
+void stream_reader_close(stream_reader *reader)
+{
+    assert(reader != NULL);
+
+    if (reader->in_flight) coro_io_await(&reader->req);
+    reader->in_flight = false;
+
+    free_and_null((void **) &reader->bufs[0]);
+    free_and_null((void **) &reader->bufs[1]);
+}
+
+/*!
+ * Submits the read of the chunk at the reader's offset into its pending buffer
+ *
+ * @param reader [in, out]
+ *
+ * @return true on success, false otherwise
+ */
+bool stream_reader_submit(stream_reader *reader)
+{
+    size_t nbytes = reader->chunk_sz;
+    if (reader->end != -1) {
+        if (reader->offset == reader->end) return true;
+        if ((off_t) nbytes > reader->end - reader->offset) nbytes = (size_t) (reader->end - reader->offset);
+    }
+
+    if (!coro_io_submit_read(&reader->req, reader->fd, reader->bufs[reader->pending], nbytes, reader->offset)) {
+        return false;
+    }
+    reader->in_flight = true;
+
+    return true;
+}
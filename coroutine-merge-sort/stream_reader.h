@@ -0,0 +1,34 @@
+#ifndef STREAM_READER_H
+#define STREAM_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+#include "coro_io.h"
+
+/*!
+ * Reader streaming a file in fixed-size chunks through the scheduler's I/O reactor
+ *
+ * @details double-buffered: while the caller processes one chunk, the read of the next one into the other buffer is
+ * already in flight
+ */
+typedef struct {
+    signed fd;
+    size_t chunk_sz;
+    off_t offset;
+    off_t end;
+
+    char *bufs[2];
+    coro_io_req req;
+    unsigned pending;
+    bool in_flight;
+} stream_reader;
+
+bool stream_reader_open(stream_reader *reader, int fd, size_t chunk_sz);
+bool stream_reader_open_range(stream_reader *reader, int fd, size_t chunk_sz, off_t offset, off_t end);
+ssize_t stream_reader_next(stream_reader *reader, const char **chunk);
+void stream_reader_close(stream_reader *reader);
+
+#endif /* STREAM_READER_H */
@@ -0,0 +1,525 @@
+#include "text_writer.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#include "dynamic_memory_management.h"
+#include "errors.h"
+
+/*
+ * Numbers are written space-separated, with no trailing separator. Formatting goes two digits at a time through a
+ * lookup table (records being written as key:payload, and doubles with the fewest significant digits that read back
+ * to the same value) into large page-aligned buffers, which are written with pwritev() two at a time, so numbers can be
+ * streamed through a text_writer as they are produced. With several threads an array is split into chunks whose
+ * formatted lengths are computed first, so that each thread formats its chunk independently and writes it at its
+ * precomputed offset.
+ */
+
+/*!
+ * Size of each output buffer
+ */
+static const size_t BUF_SZ = 1024 * 1024;
+
+/*!
+ * Alignment of output buffers
+ */
+static const size_t BUF_ALIGNMENT = 4096;
+
+/*!
+ * Maximum length of a formatted number with its separator
+ */
+#if defined(ELEM_INT32)
+enum { MAX_FORMAT_LEN = 12 };
+#elif defined(ELEM_DOUBLE)
+enum { MAX_FORMAT_LEN = 25 };
+#elif defined(ELEM_RECORD)
+enum { MAX_FORMAT_LEN = 42 };
+#else
+enum { MAX_FORMAT_LEN = 21 };
+#endif
+
+/*!
+ * Minimum number of elements worth a thread of its own
+ */
+static const size_t MIN_CHUNK_SZ = 64 * 1024;
+
+#ifndef ELEM_DOUBLE
+static const char DIGIT_PAIRS[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+#endif
+
+/*!
+ * Chunk of the array formatted by one thread
+ */
+typedef struct {
+    pthread_t thread;
+    signed fd;
+    const elem_t *elems;
+    size_t sz;
+    bool separate;
+    off_t offset;
+    size_t len;
+    bool ok;
+} chunk;
+
+#ifndef ELEM_DOUBLE
+static size_t u64_len(uint64_t value);
+static size_t format_u64(char *buf, uint64_t value);
+#ifndef ELEM_UINT64
+static size_t format_i64(char *buf, int64_t value);
+#endif
+static void format_8_digits(char *buf, uint32_t value);
+#else
+static size_t format_double(char *buf, double value);
+#endif
+static bool write_chunk(int fd, const elem_t *elems, size_t sz, bool separate, off_t offset);
+static bool text_writer_flush(text_writer *writer);
+static void *chunk_len_main(void *arg);
+static void *chunk_write_main(void *arg);
+static bool run_chunks(chunk *chunks, size_t n_chunks, void *(*func)(void *));
+
+/*!
+ * @param value [in]
+ *
+ * @return length of the formatted number, without a separator
+ */
+size_t elem_format_len(elem_t value)
+{
+#if defined(ELEM_UINT64)
+    return u64_len(value);
+#elif defined(ELEM_INTEGER)
+    return (value < 0) ? u64_len(-(uint64_t) value) + 1 : u64_len((uint64_t) value);
+#else
+    char buf[MAX_FORMAT_LEN];
+
+    return elem_format(buf, value);
+#endif
+}
+
+/*!
+ * Formats a number in decimal
+ *
+ * @param buf   [out] buffer of at least 11 bytes for 32-bit integers, 20 for 64-bit ones, 24 for doubles and 41 for
+ *              records
+ * @param value [in]
+ *
+ * @return length of the formatted number
+ *
+ * @note the result is not null-terminated
+ */
+size_t elem_format(char *buf, elem_t value)
+{
+    assert(buf != NULL);
+
+#if defined(ELEM_UINT64)
+    return format_u64(buf, value);
+#elif defined(ELEM_INTEGER)
+    return format_i64(buf, value);
+#elif defined(ELEM_DOUBLE)
+    return format_double(buf, value);
+#elif defined(ELEM_RECORD)
+    size_t len = format_i64(buf, value.key);
+    buf[len++] = ':';
+
+    return len + format_u64(buf + len, value.payload);
+#endif
+}
+
+/*!
+ * Writes numbers as text
+ *
+ * @param fd        [in] file descriptor of a regular file to write to, starting at its current offset
+ * @param elems     [in]
+ * @param sz        [in]
+ * @param n_threads [in] number of threads formatting the numbers, 1 to format them on the calling thread
+ *
+ * @return true on success, false otherwise
+ *
+ * @note the file offset is left where it was
+ */
+bool text_write(int fd, const elem_t *elems, size_t sz, size_t n_threads)
+{
+    assert((elems != NULL) || (sz == 0));
+
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == -1) HANDLE_ERROR("lseek: ", { return false; });
+
+    if (n_threads > sz / MIN_CHUNK_SZ) n_threads = sz / MIN_CHUNK_SZ;
+    if (n_threads <= 1) return write_chunk(fd, elems, sz, false, offset);
+
+    chunk *chunks = calloc(n_threads, sizeof(*chunks));
+    if (chunks == NULL) HANDLE_ERROR("calloc: ", { return false; });
+
+    size_t chunk_sz = (sz + n_threads - 1) / n_threads;
+    for (size_t i = 0; i < n_threads; ++i) {
+        size_t begin = i * chunk_sz;
+        size_t end = (begin + chunk_sz < sz) ? begin + chunk_sz : sz;
+        chunks[i] = (chunk) {.fd = fd, .elems = elems + begin, .sz = end - begin, .separate = (i != 0)};
+    }
+
+    bool ok = run_chunks(chunks, n_threads, chunk_len_main);
+    if (ok) {
+        for (size_t i = 0; i < n_threads; ++i) {
+            chunks[i].offset = offset;
+            offset += (off_t) chunks[i].len;
+        }
+
+        ok = run_chunks(chunks, n_threads, chunk_write_main);
+    }
+    free(chunks);
+
+    return ok;
+}
+
+#ifndef ELEM_DOUBLE
+/*!
+ * @param value [in]
+ *
+ * @return number of decimal digits of the value
+ */
+size_t u64_len(uint64_t value)
+{
+    static const uint64_t POWERS_OF_10[] = {
+        0,
+        10,
+        100,
+        1000,
+        10000,
+        100000,
+        1000000,
+        10000000,
+        100000000,
+        1000000000,
+        10000000000,
+        100000000000,
+        1000000000000,
+        10000000000000,
+        100000000000000,
+        1000000000000000,
+        10000000000000000,
+        100000000000000000,
+        1000000000000000000,
+        10000000000000000000u,
+    };
+
+    size_t len = (size_t) (((64 - __builtin_clzll(value | 1)) * 1233) >> 12) + 1;
+
+    return len - (value < POWERS_OF_10[len - 1]);
+}
+
+/*!
+ * Formats an unsigned number in decimal
+ *
+ * @param buf   [out] buffer of at least 20 bytes
+ * @param value [in]
+ *
+ * @return length of the formatted number
+ */
+size_t format_u64(char *buf, uint64_t value)
+{
+    size_t len = u64_len(value);
+    char *writer = buf + len;
+    while (value >= 100000000) {
+        writer -= 8;
+        format_8_digits(writer, (uint32_t) (value % 100000000));
+        value /= 100000000;
+    }
+
+    uint32_t high = (uint32_t) value;
+    while (high >= 100) {
+        writer -= 2;
+        memcpy(writer, &DIGIT_PAIRS[(high % 100) * 2], 2);
+        high /= 100;
+    }
+    if (high >= 10) {
+        memcpy(writer - 2, &DIGIT_PAIRS[high * 2], 2);
+    } else {
+        *(writer - 1) = (char) ('0' + high);
+    }
+
+    return len;
+}
+
+#ifndef ELEM_UINT64
+/*!
+ * Formats a signed number in decimal
+ *
+ * @param buf   [out] buffer of at least 20 bytes
+ * @param value [in]
+ *
+ * @return length of the formatted number
+ */
+size_t format_i64(char *buf, int64_t value)
+{
+    bool negative = value < 0;
+    *buf = '-';
+
+    return format_u64(buf + negative, negative ? -(uint64_t) value : (uint64_t) value) + negative;
+}
+#endif
+
+/*!
+ * Formats exactly 8 digits, padding with zeros
+ *
+ * @details the halves and quarters are independent, so that the divisions don't form a single dependency chain
+ *
+ * @param buf   [out] buffer of at least 8 bytes
+ * @param value [in] value below 10^8
+ */
+void format_8_digits(char *buf, uint32_t value)
+{
+    uint32_t high = value / 10000;
+    uint32_t low = value % 10000;
+
+    memcpy(buf, &DIGIT_PAIRS[(high / 100) * 2], 2);
+    memcpy(buf + 2, &DIGIT_PAIRS[(high % 100) * 2], 2);
+    memcpy(buf + 4, &DIGIT_PAIRS[(low / 100) * 2], 2);
+    memcpy(buf + 6, &DIGIT_PAIRS[(low % 100) * 2], 2);
+}
+#else
+/*!
+ * Formats a double with the fewest significant digits, from 15 to 17, which read back to the same value
+ *
+ * @param buf   [out] buffer of at least 24 bytes
+ * @param value [in]
+ *
+ * @return length of the formatted number
+ */
+size_t format_double(char *buf, double value)
+{
+    char formatted[32];
+    signed len = 0;
+    for (signed precision = 15; precision <= 17; ++precision) {
+        len = snprintf(formatted, sizeof(formatted), "%.*g", precision, value);
+        if (strtod(formatted, NULL) == value) break;
+    }
+
+    memcpy(buf, formatted, (size_t) len);
+
+    return (size_t) len;
+}
+#endif
+
+/*!
+ * Writes numbers as text at an offset
+ *
+ * @param fd       [in]
+ * @param elems    [in]
+ * @param sz       [in]
+ * @param separate [in] whether the first number is preceded by a separator
+ * @param offset   [in] offset at which to write
+ *
+ * @return true on success, false otherwise
+ */
+bool write_chunk(int fd, const elem_t *elems, size_t sz, bool separate, off_t offset)
+{
+    text_writer writer;
+    if (!text_writer_open(&writer, fd, offset, separate)) return false;
+
+    bool ok = text_writer_write(&writer, elems, sz);
+
+    return text_writer_close(&writer) && ok;
+}
+
+/*!
+ * Sets up a writer
+ *
+ * @param writer   [out]
+ * @param fd       [in] file descriptor to write to
+ * @param offset   [in] offset at which to start writing
+ * @param separate [in] whether the first number is preceded by a separator, i.e. whether some numbers precede offset
+ *
+ * @return true on success, false otherwise
+ *
+ * @note the file offset is not used, let alone advanced
+ */
+bool text_writer_open(text_writer *writer, int fd, off_t offset, bool separate)
+{
+    assert(writer != NULL);
+
+    writer->fd = fd;
+    writer->offset = offset;
+    writer->separate = separate;
+    writer->lens[0] = writer->lens[1] = 0;
+    writer->curr = 0;
+
+    writer->bufs[0] = aligned_alloc(BUF_ALIGNMENT, BUF_SZ);
+    writer->bufs[1] = aligned_alloc(BUF_ALIGNMENT, BUF_SZ);
+    if ((writer->bufs[0] == NULL) || (writer->bufs[1] == NULL)) {
+        HANDLE_ERROR("aligned_alloc: ", {
+            free_and_null((void **) &writer->bufs[0]);
+            free_and_null((void **) &writer->bufs[1]);
+            return false;
+        });
+    }
+
+    return true;
+}
+
+/*!
+ * Formats numbers into the writer's buffers, writing the pair out whenever both are full
+ *
+ * @param writer [in, out]
+ * @param elems  [in]
+ * @param sz     [in]
+ *
+ * @return true on success, false otherwise
+ */
+bool text_writer_write(text_writer *writer, const elem_t *elems, size_t sz)
+{
+    assert(writer != NULL);
+    assert((elems != NULL) || (sz == 0));
+
+    for (size_t i = 0; i < sz; ++i) {
+        if (BUF_SZ - writer->lens[writer->curr] < MAX_FORMAT_LEN) {
+            if ((writer->curr == 1) && !text_writer_flush(writer)) return false;
+            writer->curr ^= 1;
+        }
+
+        char *buf = writer->bufs[writer->curr] + writer->lens[writer->curr];
+        *buf = ' ';
+        buf += writer->separate;
+        writer->lens[writer->curr] += writer->separate + elem_format(buf, elems[i]);
+        writer->separate = true;
+    }
+
+    return true;
+}
+
+/*!
+ * Writes out what's left in the writer's buffers and frees them
+ *
+ * @param writer [in, out]
+ *
+ * @return true on success, false otherwise
+ */
+bool text_writer_close(text_writer *writer)
+{
+    assert(writer != NULL);
+
+    bool ok = text_writer_flush(writer);
+
+    free_and_null((void **) &writer->bufs[0]);
+    free_and_null((void **) &writer->bufs[1]);
+
+    return ok;
+}
+
+/*!
+ * Writes out the writer's buffers, emptying them
+ *
+ * @param writer [in, out]
+ *
+ * @return true on success, false otherwise
+ */
+bool text_writer_flush(text_writer *writer)
+{
+    struct iovec iov[2] = {
+        {.iov_base = writer->bufs[0], .iov_len = writer->lens[0]},
+        {.iov_base = writer->bufs[1], .iov_len = writer->lens[1]},
+    };
+    unsigned first = 0;
+
+    while (first < 2) {
+        if (iov[first].iov_len == 0) {
+            ++first;
+            continue;
+        }
+
+        ssize_t n_written = pwritev(writer->fd, &iov[first], (signed) (2 - first), writer->offset);
+        if (n_written == -1) {
+            if (errno == EINTR) continue;
+
+            HANDLE_ERROR("pwritev: ", { return false; });
+        }
+        writer->offset += n_written;
+
+        for (size_t left = (size_t) n_written; left != 0;) {
+            size_t n = (left < iov[first].iov_len) ? left : iov[first].iov_len;
+            iov[first].iov_base = (char *) iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+            left -= n;
+            if (iov[first].iov_len == 0) ++first;
+        }
+    }
+
+    writer->lens[0] = writer->lens[1] = 0;
+    writer->curr = 0;
+
+    return true;
+}
+
+/*!
+ * Computes the formatted length of a chunk
+ *
+ * @param arg [in, out] chunk
+ *
+ * @return NULL
+ */
+void *chunk_len_main(void *arg)
+{
+    chunk *chunk = arg;
+
+    size_t len = (chunk->sz != 0) ? chunk->sz - !chunk->separate : 0;
+    for (size_t i = 0; i < chunk->sz; ++i) {
+        len += elem_format_len(chunk->elems[i]);
+    }
+    chunk->len = len;
+    chunk->ok = true;
+
+    return NULL;
+}
+
+/*!
+ * Formats a chunk and writes it at its offset
+ *
+ * @param arg [in, out] chunk
+ *
+ * @return NULL
+ */
+void *chunk_write_main(void *arg)
+{
+    chunk *chunk = arg;
+
+    chunk->ok = write_chunk(chunk->fd, chunk->elems, chunk->sz, chunk->separate, chunk->offset);
+
+    return NULL;
+}
+
+/*!
+ * Runs a function on every chunk, each on a thread of its own but the first one, which runs on the calling thread
+ *
+ * @param chunks   [in, out]
+ * @param n_chunks [in]
+ * @param func     [in]
+ *
+ * @return whether the function succeeded on every chunk
+ */
+bool run_chunks(chunk *chunks, size_t n_chunks, void *(*func)(void *))
+{
+    size_t n_threads = 1;
+    for (; n_threads < n_chunks; ++n_threads) {
+        errno = pthread_create(&chunks[n_threads].thread, NULL, func, &chunks[n_threads]);
+        if (errno != 0) HANDLE_ERROR("pthread_create: ", { break; });
+    }
+
+    func(&chunks[0]);
+
+    bool ok = (n_threads == n_chunks);
+    for (size_t i = 0; i < n_threads; ++i) {
+        if (i != 0) pthread_join(chunks[i].thread, NULL);
+        ok = ok && chunks[i].ok;
+    }
+
+    return ok;
+}
@@ -0,0 +1,32 @@
+#ifndef TEXT_WRITER_H
+#define TEXT_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+#include "elem.h"
+
+/*!
+ * Writer streaming numbers as text to a file through a pair of buffers
+ */
+typedef struct {
+    signed fd;
+    off_t offset;
+    bool separate;
+
+    char *bufs[2];
+    size_t lens[2];
+    unsigned curr;
+} text_writer;
+
+size_t elem_format_len(elem_t value);
+size_t elem_format(char *buf, elem_t value);
+bool text_write(int fd, const elem_t *elems, size_t sz, size_t n_threads);
+
+bool text_writer_open(text_writer *writer, int fd, off_t offset, bool separate);
+bool text_writer_write(text_writer *writer, const elem_t *elems, size_t sz);
+bool text_writer_close(text_writer *writer);
+
+#endif /* TEXT_WRITER_H */